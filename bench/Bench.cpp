@@ -0,0 +1,405 @@
+// fisidecar_bench - times HEIF/AVIF loading on synthetic files, generated with the libheif encoder.
+//
+// Every case is loaded header-only (FIF_LOAD_NOPIXELS) and in full. Most phases are measured by loading with 
+// one more step enabled at a time, so they are differences of medians. Decode and copy are the medians of what the plugin 
+// reports itself (FISIDECAR_LOAD_HEIF_STATS), with the same thread limit and code path (tiles) as the timed loads:
+//
+//  read     - parsing the container (FISidecar_ProbeFromMemory)
+//  meta     - the rest of a header-only load: metadata, color profile, the FIBITMAP header
+//  decode   - FISIDECAR_LOAD_STATS::decode_ms, libheif decoding the primary image (or its tiles)
+//  copy     - FISIDECAR_LOAD_STATS::copy_ms, the pixel copy into the FIBITMAP
+//  icc      - FISIDECAR_LOAD_HEIF_NCLX_TO_ICC (NCLX files only)
+//  thumb    - decoding and attaching the thumbnail
+//
+// usage: fisidecar_bench [--iterations N] [--threads N] [--filter text] [--out folder]
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h> //< before FreeImage.h, which otherwise defines its own BOOL, DWORD, etc.
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "FISidecar.h"
+#include "libheif/heif.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#if defined(FISIDECAR_HAS_LCMS)
+#include "lcms2.h"
+#endif
+
+
+// Grid encoding (heif_context_encode_grid)
+#if defined(LIBHEIF_HAVE_VERSION)
+#if LIBHEIF_HAVE_VERSION(1, 18, 0)
+#define FISIDECAR_HAS_HEIF_ENCODE_GRID
+#endif
+#endif
+
+namespace {
+
+// --- corpus
+
+struct Case
+{
+  heif_compression_format compression;
+  unsigned width;
+  unsigned height;
+  bool tiled;
+  unsigned bits;
+  bool alpha;
+  bool icc;         //< else NCLX
+  bool thumbnail;
+
+  std::string name() const {
+    char name[128];
+    snprintf(name, sizeof(name), "%s-%ux%u%s-%ubit%s-%s%s"
+      , this->compression == heif_compression_AV1 ? "avif" : "heic", this->width, this->height, this->tiled ? "-tiled" : ""
+      , this->bits, this->alpha ? "-alpha" : "", this->icc ? "icc" : "nclx", this->thumbnail ? "-thumb" : "");
+    return name;
+  }
+};
+
+// Each property is varied on its own, around a baseline (8 bit, NCLX, with thumbnail), so that its cost shows
+std::vector<Case> getCases() {
+  std::vector<Case> cases;
+  for(const auto compression : {heif_compression_HEVC, heif_compression_AV1}) {
+    for(const auto size : {std::make_pair(640u, 480u), std::make_pair(2048u, 1536u), std::make_pair(4096u, 3072u)})
+      cases.push_back({compression, size.first, size.second, false, 8, false, false, true});
+
+    cases.push_back({compression, 4096, 3072, true,  8,  false, false, true});
+    cases.push_back({compression, 2048, 1536, false, 10, false, false, true});
+    cases.push_back({compression, 2048, 1536, false, 8,  true,  false, true});
+    cases.push_back({compression, 2048, 1536, false, 8,  false, true,  true});
+    cases.push_back({compression, 2048, 1536, false, 8,  false, false, false});
+  }
+  return cases;
+}
+
+heif_error writeToVector(heif_context* ctx, const void* data, size_t size, void* userdata) {
+  const auto* bytes = static_cast<const uint8_t*>(data);
+  static_cast<std::vector<uint8_t>*>(userdata)->insert(static_cast<std::vector<uint8_t>*>(userdata)->end(), bytes, bytes + size);
+  return {heif_error_Ok, heif_suberror_Unspecified, "Success"};
+}
+
+std::vector<uint8_t> getICC() {
+#if defined(FISIDECAR_HAS_LCMS)
+  if(auto profile = cmsCreate_sRGBProfile()) {
+    cmsUInt32Number size{};
+    std::vector<uint8_t> icc;
+    if(cmsSaveProfileToMem(profile, nullptr, &size)) {
+      icc.resize(size);
+      cmsSaveProfileToMem(profile, icc.data(), &size);
+    }
+    cmsCloseProfile(profile);
+    return icc;
+  }
+#endif
+  // The plugin passes the profile on as-is, a blob of the usual size does for timing
+  std::vector<uint8_t> icc(3144);
+  memcpy(&icc[36], "acsp", 4);
+  return icc;
+}
+
+// Smooth gradients with some noise - neither trivial to compress, nor random
+heif_image* createImage(const Case& c, unsigned x0, unsigned y0, unsigned width, unsigned height) {
+  const auto chroma = c.bits > 8 
+    ? (c.alpha ? heif_chroma_interleaved_RRGGBBAA_LE : heif_chroma_interleaved_RRGGBB_LE)
+    : (c.alpha ? heif_chroma_interleaved_RGBA : heif_chroma_interleaved_RGB);
+  const auto channels = c.alpha ? 4u : 3u;
+  const auto max = (1u << c.bits) - 1;
+
+  heif_image* img{};
+  if(heif_image_create(int(width), int(height), heif_colorspace_RGB, chroma, &img).code)
+    return {};
+  if(heif_image_add_plane(img, heif_channel_interleaved, int(width), int(height), int(c.bits)).code) {
+    heif_image_release(img);
+    return {};
+  }
+
+  int pitch;
+  auto* plane = heif_image_get_plane(img, heif_channel_interleaved, &pitch);
+  uint32_t noise = 12345;
+  for(unsigned y = 0; y < height; y++) {
+    auto* line = plane + ptrdiff_t(pitch) * y;
+    for(unsigned x = 0; x < width; x++) {
+      noise = noise * 1664525u + 1013904223u;
+      const auto gx = (x0 + x) * max / c.width;
+      const auto gy = (y0 + y) * max / c.height;
+      const unsigned values[4] = {gx, gy, (gx + gy) / 2, max - (noise >> 28)};
+      for(unsigned i = 0; i < channels; i++) {
+        const auto v = std::min(max, values[i] + (i < 3 ? (noise >> (24 + i)) & 7 : 0));
+        if(c.bits > 8) {
+          line[(x * channels + i) * 2] = uint8_t(v);
+          line[(x * channels + i) * 2 + 1] = uint8_t(v >> 8);
+        } else {
+          line[x * channels + i] = uint8_t(v);
+        }
+      }
+    }
+  }
+  return img;
+}
+
+bool setProfile(heif_image* img, const Case& c) {
+  if(c.icc) {
+    static const auto icc = getICC();
+    return ! heif_image_set_raw_color_profile(img, "prof", icc.data(), icc.size()).code;
+  }
+
+  // Display P3, which needs a real conversion to ICC (sRGB is left without a profile)
+  auto* nclx = heif_nclx_color_profile_alloc();
+  nclx->color_primaries = heif_color_primaries_SMPTE_EG_432_1;
+  nclx->transfer_characteristics = heif_transfer_characteristic_IEC_61966_2_1;
+  nclx->matrix_coefficients = heif_matrix_coefficients_ITU_R_BT_601_6;
+  nclx->full_range_flag = 1;
+  const auto ok = ! heif_image_set_nclx_color_profile(img, nclx).code;
+  heif_nclx_color_profile_free(nclx);
+  return ok;
+}
+
+// Encodes the case into a file in memory, empty if the encoder is not available
+std::vector<uint8_t> encode(const Case& c) {
+  std::vector<uint8_t> file;
+
+  auto* ctx = heif_context_alloc();
+  heif_encoder* encoder{};
+  if(heif_context_get_encoder_for_format(ctx, c.compression, &encoder).code) {
+    heif_context_free(ctx);
+    return file;
+  }
+  heif_encoder_set_lossy_quality(encoder, 75);
+  heif_encoder_set_parameter_integer(encoder, "speed", 9);
+  heif_encoder_set_parameter_string(encoder, "preset", "ultrafast");
+
+  auto* options = heif_encoding_options_alloc();
+  heif_image_handle* himage{};
+  heif_image* full{};
+  heif_error err{heif_error_Usage_error, heif_suberror_Unspecified, "Not encoded"};
+
+#if defined(FISIDECAR_HAS_HEIF_ENCODE_GRID)
+  if(c.tiled) {
+    const auto tile = 512u;
+    const auto columns = c.width / tile, rows = c.height / tile;
+    std::vector<heif_image*> tiles;
+    auto ok = true;
+    for(unsigned i = 0; i < columns * rows && ok; i++) {
+      tiles.push_back(createImage(c, (i % columns) * tile, (i / columns) * tile, tile, tile));
+      ok = tiles.back() && setProfile(tiles.back(), c);
+    }
+    if(ok)
+      err = heif_context_encode_grid(ctx, tiles.data(), uint16_t(rows), uint16_t(columns), encoder, options, &himage);
+    for(auto* tile : tiles)
+      heif_image_release(tile);
+  } else
+#endif
+  if(! c.tiled) {
+    full = createImage(c, 0, 0, c.width, c.height);
+    if(full && setProfile(full, c))
+      err = heif_context_encode_image(ctx, full, encoder, options, &himage);
+  }
+
+  if(! err.code && c.thumbnail) {
+    if(! full && ! (full = createImage(c, 0, 0, c.width, c.height)))
+      err = {heif_error_Memory_allocation_error, heif_suberror_Unspecified, "Out of memory"};
+    heif_image_handle* hthumb{};
+    if(! err.code)
+      err = heif_context_encode_thumbnail(ctx, full, himage, encoder, options, 320, &hthumb);
+    if(hthumb)
+      heif_image_handle_release(hthumb);
+  }
+
+  if(! err.code) {
+    heif_writer writer{1, &writeToVector};
+    err = heif_context_write(ctx, &writer, &file);
+  }
+  if(err.code) {
+    fprintf(stderr, "%s: %s\n", c.name().c_str(), err.message);
+    file.clear();
+  }
+
+  if(full)
+    heif_image_release(full);
+  if(himage)
+    heif_image_handle_release(himage);
+  heif_encoding_options_free(options);
+  heif_encoder_release(encoder);
+  heif_context_free(ctx);
+  return file;
+}
+
+// --- measuring
+
+double now_ms() {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  return values.empty() ? 0 : values[values.size() / 2];
+}
+
+// Median of iterations runs, in ms. A failed run makes it negative
+double measure(unsigned iterations, const std::function<bool()>& run) {
+  std::vector<double> times;
+  for(unsigned i = 0; i < iterations; i++) {
+    const auto start = now_ms();
+    if(! run())
+      return -1;
+    times.push_back(now_ms() - start);
+  }
+  return median(times);
+}
+
+double peakRSS_MB() {
+#if defined(_WIN32)
+  PROCESS_MEMORY_COUNTERS counters{};
+  GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+  return double(counters.PeakWorkingSetSize) / (1024 * 1024);
+#else
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+  return double(usage.ru_maxrss) / (1024 * 1024);  //< bytes
+#else
+  return double(usage.ru_maxrss) / 1024;           //< KiB
+#endif
+#endif
+}
+
+bool load(FREE_IMAGE_FORMAT fif, std::vector<uint8_t>& file, int flags) {
+  auto* stream = FreeImage_OpenMemory(file.data(), DWORD(file.size()));
+  auto* dib = FreeImage_LoadFromMemory(fif, stream, flags);
+  FreeImage_CloseMemory(stream);
+  FreeImage_Unload(dib);
+  return dib != nullptr;
+}
+
+bool probe(std::vector<uint8_t>& file) {
+  auto* stream = FreeImage_OpenMemory(file.data(), DWORD(file.size()));
+  FISIDECAR_PROBE info;
+  const auto ok = FISidecar_ProbeFromMemory(stream, &info);
+  FreeImage_CloseMemory(stream);
+  return ok != FALSE;
+}
+
+// Medians of the decode and copy phases, as the plugin reports them, over iterations loads. Negative, if a load failed
+void measurePhases(unsigned iterations, FREE_IMAGE_FORMAT fif, std::vector<uint8_t>& file, int flags, double& decode, double& copy) {
+  std::vector<double> decodes, copies;
+  for(unsigned i = 0; i < iterations; i++) {
+    FISIDECAR_LOAD_STATS stats;
+    if(! load(fif, file, flags | FISIDECAR_LOAD_HEIF_STATS) || ! FISidecar_GetLoadStats(&stats)) {
+      decode = copy = -1;
+      return;
+    }
+    decodes.push_back(stats.decode_ms);
+    copies.push_back(stats.copy_ms);
+  }
+  decode = median(decodes);
+  copy = median(copies);
+}
+
+void printRow(const std::string& name, const char* mode, double total, double megapixels
+  , double read, double meta, double decode, double copy, double icc, double thumb) 
+{
+  const auto phase = [](double ms) { 
+    static char buffers[6][16];
+    static unsigned next;
+    auto* buffer = buffers[next++ % 6];
+    if(ms < 0)
+      snprintf(buffer, 16, "%9s", "-");
+    else
+      snprintf(buffer, 16, "%9.2f", ms);
+    return buffer;
+  };
+  printf("%-40s %-8s %9.2f %8.1f %s %s %s %s %s %s %9.1f\n", name.c_str(), mode, total, total > 0 ? megapixels / (total / 1000) : 0
+    , phase(read), phase(meta), phase(decode), phase(copy), phase(icc), phase(thumb), peakRSS_MB());
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  unsigned iterations = 5;
+  unsigned threads = 0;
+  std::string filter;
+  std::string out;
+  for(int i = 1; i + 1 < argc; i += 2) {
+    const std::string arg = argv[i];
+    if(arg == "--iterations")
+      iterations = std::max(1, atoi(argv[i + 1]));
+    else if(arg == "--threads")
+      threads = unsigned(std::min(std::max(atoi(argv[i + 1]), 0), 255));
+    else if(arg == "--filter")
+      filter = argv[i + 1];
+    else if(arg == "--out")
+      out = argv[i + 1];
+    else {
+      fprintf(stderr, "usage: %s [--iterations N] [--threads N] [--filter text] [--out folder]\n", argv[0]);
+      return 1;
+    }
+  }
+
+#if defined(FREEIMAGE_LIB)
+  FreeImage_Initialise();
+#endif
+  const auto heif = FISidecar_RegisterPluginHEIF();
+  const auto avif = FISidecar_RegisterPluginAVIF();
+
+  const auto none = FISIDECAR_LOAD_HEIF_THUMBNAIL_NONE | int(threads);
+  const auto all = FISIDECAR_LOAD_HEIF_NCLX_TO_ICC | int(threads);
+
+  printf("%-40s %-8s %9s %8s %9s %9s %9s %9s %9s %9s %9s\n", "case", "mode", "total ms", "MP/s"
+    , "read", "meta", "decode", "copy", "icc", "thumb", "peak MB");
+
+  for(const auto& c : getCases()) {
+    const auto name = c.name();
+    if(! filter.empty() && name.find(filter) == std::string::npos)
+      continue;
+
+    auto file = encode(c);
+    if(file.empty()) {
+      printf("%-40s skipped (not encoded)\n", name.c_str());
+      continue;
+    }
+    if(! out.empty()) {
+      const auto path = out + "/" + name + (c.compression == heif_compression_AV1 ? ".avif" : ".heic");
+      if(auto* f = fopen(path.c_str(), "wb")) {
+        fwrite(file.data(), 1, file.size(), f);
+        fclose(f);
+      }
+    }
+
+    const auto fif = c.compression == heif_compression_AV1 ? avif : heif;
+    const auto megapixels = double(c.width) * c.height / 1e6;
+    const auto diff = [](double a, double b) { return a < 0 || b < 0 ? -1 : std::max(0.0, a - b); };
+
+    const auto t_read = measure(iterations, [&] { return probe(file); });
+    const auto t_header = measure(iterations, [&] { return load(fif, file, none | FIF_LOAD_NOPIXELS); });
+    const auto t_header_all = measure(iterations, [&] { return load(fif, file, all | FIF_LOAD_NOPIXELS); });
+    const auto t_plain = measure(iterations, [&] { return load(fif, file, none); });
+    const auto t_icc = measure(iterations, [&] { return load(fif, file, none | FISIDECAR_LOAD_HEIF_NCLX_TO_ICC); });
+    const auto t_all = measure(iterations, [&] { return load(fif, file, all); });
+    double decode, copy;
+    measurePhases(iterations, fif, file, none, decode, copy);
+
+    const auto meta = diff(t_header, t_read);
+    const auto icc = c.icc ? -1 : diff(t_icc, t_plain);
+    printRow(name, "header", t_header_all, megapixels, t_read, meta, -1, -1, c.icc ? -1 : diff(t_header_all, t_header), -1);
+    printRow(name, "full", t_all, megapixels, t_read, meta, decode, copy, icc, c.thumbnail ? diff(t_all, t_icc) : -1);
+  }
+
+#if defined(FREEIMAGE_LIB)
+  FreeImage_DeInitialise();
+#endif
+  return 0;
+}
@@ -0,0 +1,118 @@
+#include "BitmapPool.hpp"
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <algorithm>
+#include <iterator>
+
+namespace {
+
+struct Entry
+{
+  FIBITMAP* dib;
+  FREE_IMAGE_TYPE type;
+  unsigned width;
+  unsigned height;
+  unsigned bpp;
+  size_t bytes;
+};
+
+size_t getBytes(FIBITMAP* dib) {
+  return size_t(FreeImage_GetPitch(dib)) * FreeImage_GetHeight(dib);
+}
+
+class Pool
+{
+public:
+  Pool() : capacity_{0}, bytes_{} {}
+
+  ~Pool() {
+    this->trim(0);
+  }
+
+  void set_capacity(size_t bytes) {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->capacity_.store(bytes, std::memory_order_relaxed);
+    this->trim(bytes);
+  }
+
+  FIBITMAP* acquire(FREE_IMAGE_TYPE type, unsigned width, unsigned height, unsigned bpp) {
+    if(! this->capacity_.load(std::memory_order_relaxed))
+      return {};
+
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    // The newest first, it is the most likely to be still in the cache
+    const auto it = std::find_if(this->entries_.rbegin(), this->entries_.rend(), [&](const Entry& entry) {
+      return entry.type == type && entry.width == width && entry.height == height && entry.bpp == bpp;
+    });
+    if(it == this->entries_.rend())
+      return {};
+
+    auto* dib = it->dib;
+    this->bytes_ -= it->bytes;
+    this->entries_.erase(std::next(it).base());
+    return dib;
+  }
+
+  void release(FIBITMAP* dib) {
+    if(! dib)
+      return;
+
+    const auto bytes = getBytes(dib);
+    const auto keep = FreeImage_HasPixels(dib) && bytes <= this->capacity_.load(std::memory_order_relaxed);
+    if(keep) {
+      bitmap_reset(dib); //< unlocked, it frees memory
+
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      const auto capacity = this->capacity_.load(std::memory_order_relaxed);
+      if(bytes <= capacity) { //< unless changed in the meantime
+        this->trim(capacity - bytes);
+        this->entries_.push_back({dib, FreeImage_GetImageType(dib), FreeImage_GetWidth(dib), FreeImage_GetHeight(dib), FreeImage_GetBPP(dib), bytes});
+        this->bytes_ += bytes;
+        return;
+      }
+    }
+    FreeImage_Unload(dib);
+  }
+
+private:
+  // Drops the oldest bitmaps, until at most bytes are kept. Call locked
+  void trim(size_t bytes) {
+    while(this->bytes_ > bytes && ! this->entries_.empty()) {
+      this->bytes_ -= this->entries_.front().bytes;
+      FreeImage_Unload(this->entries_.front().dib);
+      this->entries_.pop_front();
+    }
+  }
+
+  std::atomic<size_t> capacity_;
+  std::mutex mutex_;        //< guards the below
+  size_t bytes_;
+  std::deque<Entry> entries_;
+};
+
+Pool& pool() {
+  static Pool pool;
+  return pool;
+}
+
+} // namespace
+
+void bitmap_pool_set_capacity(size_t bytes) {
+  pool().set_capacity(bytes);
+}
+
+FIBITMAP* bitmap_pool_acquire(FREE_IMAGE_TYPE type, unsigned width, unsigned height, unsigned bpp) {
+  return pool().acquire(type, width, height, bpp);
+}
+
+void bitmap_pool_release(FIBITMAP* dib) {
+  pool().release(dib);
+}
+
+void bitmap_reset(FIBITMAP* dib) {
+  for(int model = FIMD_COMMENTS; model <= FIMD_EXIF_RAW; model++)
+    FreeImage_SetMetadata(FREE_IMAGE_MDMODEL(model), dib, nullptr, nullptr);
+  FreeImage_DestroyICCProfile(dib);
+  FreeImage_SetThumbnail(dib, nullptr);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include "FreeImage.h"
+
+/** @brief Process-wide pool of FIBITMAPs, recycled between loads, so that a steady stream of loads does not churn the allocator.
+ *
+ * The pool keeps whole bitmaps (header and pixels), up to a total pixel size. A load takes one of exactly the same type, size and bpp,
+ * if there is one - their pixels are overwritten, their metadata, ICC profile and thumbnail are cleared, when they are released.
+ * The oldest bitmaps are dropped, when the pool is full. It is disabled (0 bytes) by default.
+**/
+void bitmap_pool_set_capacity(size_t bytes);
+
+// A pooled bitmap, or null if there is none of the kind (or the pool is disabled)
+FIBITMAP* bitmap_pool_acquire(FREE_IMAGE_TYPE type, unsigned width, unsigned height, unsigned bpp);
+
+// Takes the bitmap - keeps it for a later load, or unloads it, if the pool is disabled or the bitmap does not fit
+void bitmap_pool_release(FIBITMAP* dib);
+
+// Clears all metadata, the ICC profile and the thumbnail, leaving the pixels
+void bitmap_reset(FIBITMAP* dib);
@@ -0,0 +1,196 @@
+#include "Downsample.hpp"
+#include "Parallel.hpp"
+#include <algorithm>
+
+#include "Simd.hpp"
+
+namespace {
+
+// --- acc[i] += src[i], the vertical part of the filter
+
+template<typename T>
+void accumulate_scalar(const T* src, uint32_t* acc, size_t count) {
+  for(size_t i = 0; i < count; i++)
+    acc[i] += src[i];
+}
+
+#if defined(FISIDECAR_SIMD_X86)
+
+FISIDECAR_TARGET("sse2")
+void accumulate(const BYTE* src, uint32_t* acc, size_t count) {
+  const auto zero = _mm_setzero_si128();
+  size_t i = 0;
+  for(; i + 16 <= count; i += 16) {
+    const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    const auto lo = _mm_unpacklo_epi8(v, zero);
+    const auto hi = _mm_unpackhi_epi8(v, zero);
+
+    auto* a = reinterpret_cast<__m128i*>(acc + i);
+    _mm_storeu_si128(a + 0, _mm_add_epi32(_mm_loadu_si128(a + 0), _mm_unpacklo_epi16(lo, zero)));
+    _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(lo, zero)));
+    _mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2), _mm_unpacklo_epi16(hi, zero)));
+    _mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3), _mm_unpackhi_epi16(hi, zero)));
+  }
+  accumulate_scalar(src + i, acc + i, count - i);
+}
+
+FISIDECAR_TARGET("sse2")
+void accumulate(const WORD* src, uint32_t* acc, size_t count) {
+  const auto zero = _mm_setzero_si128();
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+
+    auto* a = reinterpret_cast<__m128i*>(acc + i);
+    _mm_storeu_si128(a + 0, _mm_add_epi32(_mm_loadu_si128(a + 0), _mm_unpacklo_epi16(v, zero)));
+    _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(v, zero)));
+  }
+  accumulate_scalar(src + i, acc + i, count - i);
+}
+
+#elif defined(FISIDECAR_SIMD_NEON)
+
+void accumulate(const BYTE* src, uint32_t* acc, size_t count) {
+  size_t i = 0;
+  for(; i + 16 <= count; i += 16) {
+    const auto v = vld1q_u8(src + i);
+    const auto lo = vmovl_u8(vget_low_u8(v));
+    const auto hi = vmovl_u8(vget_high_u8(v));
+
+    auto* a = acc + i;
+    vst1q_u32(a + 0,  vaddw_u16(vld1q_u32(a + 0),  vget_low_u16(lo)));
+    vst1q_u32(a + 4,  vaddw_u16(vld1q_u32(a + 4),  vget_high_u16(lo)));
+    vst1q_u32(a + 8,  vaddw_u16(vld1q_u32(a + 8),  vget_low_u16(hi)));
+    vst1q_u32(a + 12, vaddw_u16(vld1q_u32(a + 12), vget_high_u16(hi)));
+  }
+  accumulate_scalar(src + i, acc + i, count - i);
+}
+
+void accumulate(const WORD* src, uint32_t* acc, size_t count) {
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    const auto v = vld1q_u16(src + i);
+
+    auto* a = acc + i;
+    vst1q_u32(a + 0, vaddw_u16(vld1q_u32(a + 0), vget_low_u16(v)));
+    vst1q_u32(a + 4, vaddw_u16(vld1q_u32(a + 4), vget_high_u16(v)));
+  }
+  accumulate_scalar(src + i, acc + i, count - i);
+}
+
+#else
+
+void accumulate(const BYTE* src, uint32_t* acc, size_t count) {
+  accumulate_scalar(src, acc, count);
+}
+
+void accumulate(const WORD* src, uint32_t* acc, size_t count) {
+  accumulate_scalar(src, acc, count);
+}
+
+#endif
+
+} // namespace
+
+unsigned downsample_factor(unsigned width, unsigned height, unsigned size) {
+  const auto longest = std::max(width, height);
+  return (size && longest > size) ? longest / size : 1;
+}
+
+// --- BoxDownsampler
+
+BoxDownsampler::BoxDownsampler(unsigned src_width, unsigned src_height, unsigned src_bpp, unsigned src_bits, unsigned factor)
+  : src_width_(src_width)
+  , src_height_(src_height)
+  , bytes_per_sample_(src_bits > 8 ? 2 : 1)
+  , factor_(std::max(factor, 1u))
+  , width_(downsampled_size(src_width, std::max(factor, 1u)))
+  , block_rows_{}
+  , rows_left_(src_height)
+{
+  this->channels_ = src_bpp / (8 * this->bytes_per_sample_);
+  this->acc_.assign(size_t(src_width) * this->channels_, 0);
+  this->out_.resize(size_t(this->width_) * this->channels_ * this->bytes_per_sample_);
+}
+
+void BoxDownsampler::add(const BYTE* src, unsigned x, unsigned count) {
+  auto* acc = this->acc_.data() + size_t(x) * this->channels_;
+  const auto samples = size_t(count) * this->channels_;
+
+  if(this->bytes_per_sample_ == 2)
+    accumulate(reinterpret_cast<const WORD*>(src), acc, samples);
+  else
+    accumulate(src, acc, samples);
+}
+
+const BYTE* BoxDownsampler::next_row() {
+  if(! this->rows_left_)
+    return {};
+
+  --this->rows_left_;
+  if(++this->block_rows_ < this->factor_ && this->rows_left_)
+    return {};
+
+  // --- the block is complete, reduce it horizontally
+
+  const auto channels = this->channels_;
+  const auto* acc = this->acc_.data();
+  auto* out8 = this->out_.data();
+  auto* out16 = reinterpret_cast<WORD*>(this->out_.data());
+
+  for(unsigned x = 0; x < this->src_width_; x += this->factor_) {
+    const auto block_width = std::min(this->factor_, this->src_width_ - x);
+    const auto count = uint64_t(block_width) * this->block_rows_;
+
+    for(unsigned c = 0; c < channels; c++) {
+      uint64_t sum{};
+      for(unsigned i = 0; i < block_width; i++)
+        sum += acc[i * channels + c];
+
+      const auto value = (sum + count / 2) / count;
+      if(this->bytes_per_sample_ == 2)
+        *out16++ = WORD(value);
+      else
+        *out8++ = BYTE(value);
+    }
+    acc += size_t(block_width) * channels;
+  }
+
+  std::fill(this->acc_.begin(), this->acc_.end(), 0);
+  this->block_rows_ = 0;
+  return this->out_.data();
+}
+
+// --- whole image
+
+unsigned downsample_image(swizzle_row_t row
+  , const BYTE* src, ptrdiff_t src_pitch
+  , BYTE* dst, ptrdiff_t dst_pitch
+  , unsigned width, unsigned height, unsigned src_bpp, unsigned src_bits
+  , unsigned factor, unsigned max_threads)
+{
+  // Bands are made of whole blocks, so that they are independent of each other
+  static const size_t min_bytes_per_band = 1 << 20;
+  const auto out_height = downsampled_size(height, factor);
+  const auto bytes = size_t(src_pitch < 0 ? -src_pitch : src_pitch) * height;
+  const auto bands = unsigned(std::max<size_t>(1, std::min<size_t>({max_threads, out_height, bytes / min_bytes_per_band})));
+  const auto out_rows_per_band = (out_height + bands - 1) / bands;
+
+  return parallel_for(bands, bands, [=](unsigned band) {
+    const auto first = band * out_rows_per_band * factor;
+    const auto last = std::min(height, (band + 1) * out_rows_per_band * factor);
+    if(first >= last)
+      return;
+
+    BoxDownsampler sampler(width, last - first, src_bpp, src_bits, factor);
+    auto* dst_line = dst + dst_pitch * ptrdiff_t(band * out_rows_per_band);
+
+    for(auto y = first; y < last; y++) {
+      sampler.add(src + src_pitch * ptrdiff_t(y), 0, width);
+      if(const auto* out = sampler.next_row()) {
+        row(out, dst_line, sampler.width(), src_bits);
+        dst_line += dst_pitch;
+      }
+    }
+  });
+}
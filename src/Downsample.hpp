@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "FreeImage.h"
+#include "Swizzle.hpp"
+
+/** @brief Returns the biggest integer factor, which keeps the longer side at least size pixels (1 for no scaling).
+ *
+ * Same as JPEG_SCALE - the result is never smaller than requested. size 0 means no scaling.
+**/
+unsigned downsample_factor(unsigned width, unsigned height, unsigned size);
+
+/** @brief Downsampled length of a side, the last (partial) block included. **/
+inline unsigned downsampled_size(unsigned size, unsigned factor) {
+  return (size + factor - 1) / factor;
+}
+
+/** @brief Box (area) filter by an integer factor, fed one source row at a time.
+ *
+ * Each output pixel is the average of a factor x factor block of source pixels (smaller at the right and bottom edges).
+ * Source rows are summed into a row of accumulators (vectorized), which is reduced horizontally once per output row,
+ * so the source is read exactly once and never has to exist as a whole.
+ * Pixels are interleaved, in the libheif layout (RGB(A), 8 or 16 bit native endian). The output has the same layout.
+**/
+class BoxDownsampler
+{
+public:
+  BoxDownsampler(unsigned src_width, unsigned src_height, unsigned src_bpp, unsigned src_bits, unsigned factor);
+
+  unsigned width() const { return this->width_; }
+  unsigned height() const { return downsampled_size(this->src_height_, this->factor_); }
+
+  // Adds count pixels of the current source row, starting at pixel x (tiles deliver a row in pieces).
+  void add(const BYTE* src, unsigned x, unsigned count);
+
+  // Completes the current source row. Returns the finished output row, if this row completes one, else null.
+  const BYTE* next_row();
+
+private:
+  unsigned src_width_;
+  unsigned src_height_;
+  unsigned channels_;
+  unsigned bytes_per_sample_;
+  unsigned factor_;
+  unsigned width_;
+
+  unsigned block_rows_; //< source rows in the accumulators
+  unsigned rows_left_;  //< source rows still to come
+
+  std::vector<uint32_t> acc_;
+  std::vector<BYTE> out_;
+};
+
+/** @brief Downsamples a whole image and converts the result to the FreeImage layout with the given row kernel.
+ *
+ * Just as swizzle_image, dst points to the row where output row 0 goes, dst_pitch can be negative.
+ * Output rows are split in bands between up to max_threads threads. Returns the threads, which took part.
+**/
+unsigned downsample_image(swizzle_row_t row
+  , const BYTE* src, ptrdiff_t src_pitch
+  , BYTE* dst, ptrdiff_t dst_pitch
+  , unsigned width, unsigned height, unsigned src_bpp, unsigned src_bits
+  , unsigned factor, unsigned max_threads);
@@ -0,0 +1,541 @@
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h> //< before FreeImage.h, which otherwise defines its own BOOL, DWORD, etc.
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "FIIO.hpp"
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
+namespace {
+
+std::atomic<unsigned> s_block_size{FIIO_cache_config::default_block_size};
+std::atomic<unsigned> s_block_count{FIIO_cache_config::default_block_count};
+
+enum detect_t { detect_none, detect_memory, detect_file };
+
+// FreeImage_Validate* calls validate_proc on the calling thread - loads and validations on the others are not the detection
+thread_local detect_t s_detecting{detect_none};
+std::atomic<FI_ReadProc> s_memory_read_proc{nullptr};
+std::atomic<FI_ReadProc> s_file_read_proc{nullptr};
+
+// --- stdio, for files opened by us (FreeImage does not export its own FreeImageIO)
+
+unsigned DLL_CALLCONV stdio_read(void* buffer, unsigned size, unsigned count, fi_handle handle) {
+  return unsigned(fread(buffer, size, count, static_cast<FILE*>(handle)));
+}
+
+unsigned DLL_CALLCONV stdio_write(void* buffer, unsigned size, unsigned count, fi_handle handle) {
+  return unsigned(fwrite(buffer, size, count, static_cast<FILE*>(handle)));
+}
+
+int DLL_CALLCONV stdio_seek(fi_handle handle, long offset, int origin) {
+  return fseek(static_cast<FILE*>(handle), offset, origin);
+}
+
+long DLL_CALLCONV stdio_tell(fi_handle handle) {
+  return ftell(static_cast<FILE*>(handle));
+}
+
+FreeImageIO s_stdio_io{&stdio_read, &stdio_write, &stdio_seek, &stdio_tell};
+
+} // namespace
+
+const unsigned FIIO_cache_config::default_block_size;
+const unsigned FIIO_cache_config::default_block_count;
+const unsigned FIIO_cache_config::min_block_size;
+
+FIIO_cache_config FIIO_cache_config::get() {
+  return {s_block_size.load(std::memory_order_relaxed), s_block_count.load(std::memory_order_relaxed)};
+}
+
+void FIIO_cache_config::set(unsigned block_size, unsigned block_count) {
+  s_block_size.store(block_size ? std::max(block_size, min_block_size) : default_block_size, std::memory_order_relaxed);
+  s_block_count.store(block_count ? block_count : default_block_count, std::memory_order_relaxed);
+}
+
+// --- FIIO
+
+FIIO::FIIO(FreeImageIO* io, fi_handle handle, bool cached)
+  : io(io)
+  , handle(handle)
+  , counters{}
+  , tick{}
+{
+  const auto start_pos = io->tell_proc(handle);
+  io->seek_proc(handle, 0, SEEK_END);
+  this->file_size = io->tell_proc(handle) - start_pos;
+  io->seek_proc(handle, start_pos, SEEK_SET);
+
+  this->pos = this->io_pos = start_pos;
+  this->file_end = start_pos + this->file_size;
+
+  if(cached) {
+    const auto config = FIIO_cache_config::get();
+    this->block_size = config.block_size;
+    this->blocks.resize(config.block_count, Block{-1, 0, 0, {}});
+  } else {
+    this->block_size = 0;
+  }
+}
+
+int64_t FIIO::tell() const {
+  return this->blocks.empty() ? this->io->tell_proc(this->handle) : this->pos;
+}
+
+int FIIO::io_seek(int64_t position) {
+  if(position == this->io_pos)
+    return 0;
+
+  this->counters.seeks++;
+  const auto err = this->io->seek_proc(this->handle, long(position), SEEK_SET);
+  this->io_pos = err ? this->io->tell_proc(this->handle) : position;
+  return err;
+}
+
+int FIIO::io_read(void* data, size_t size) {
+  this->counters.reads++;
+  const auto count = this->io->read_proc(data, 1, unsigned(size), this->handle);
+  this->counters.bytes_read += count;
+  this->io_pos += count;
+  return int(count != size);
+}
+
+const FIIO::Block* FIIO::get_block(int64_t index) {
+  auto lru = this->blocks.begin();
+  for(auto it = this->blocks.begin(); it != this->blocks.end(); ++it) {
+    if(it->index == index) {
+      it->last_use = ++this->tick;
+      return &*it;
+    }
+    if(it->last_use < lru->last_use)
+      lru = it;
+  }
+
+  // --- miss, replace the least recently used block
+
+  const auto block_pos = index * int64_t(this->block_size);
+  if(block_pos >= this->file_end)
+    return {};
+  const auto size = size_t(std::min<int64_t>(this->block_size, this->file_end - block_pos));
+
+  lru->index = -1;
+  lru->data.resize(this->block_size);
+  if(size == 0 || this->io_seek(block_pos) || this->io_read(lru->data.data(), size))
+    return {};
+
+  lru->index = index;
+  lru->size = size;
+  lru->last_use = ++this->tick;
+  return &*lru;
+}
+
+int FIIO::read(void* data, size_t size) {
+  if(this->blocks.empty()) {
+    return this->io_read(data, size);
+  }
+
+  auto* dst = static_cast<BYTE*>(data);
+
+  // Big reads (compressed image data) do not benefit from caching,
+  // read them directly, instead of thrashing the cache.
+  if(size >= this->block_size) {
+    if(this->io_seek(this->pos) || this->io_read(dst, size))
+      return 1;
+    this->pos += size;
+    return 0;
+  }
+
+  while(size) {
+    const auto index = this->pos / this->block_size;
+    const auto offset = size_t(this->pos % this->block_size);
+
+    const auto* block = this->get_block(index);
+    if(! block || offset >= block->size)
+      return 1;
+
+    const auto count = std::min(size, block->size - offset);
+    memcpy(dst, block->data.data() + offset, count);
+
+    dst += count;
+    size -= count;
+    this->pos += count;
+  }
+  return 0;
+}
+
+int FIIO::seek(int64_t position) {
+  if(this->blocks.empty()) {
+    this->counters.seeks++;
+    return this->io->seek_proc(this->handle, long(position), SEEK_SET);
+  }
+
+  // Seeking is free, the handle is moved only when the data is not in the cache
+  this->pos = position;
+  return 0;
+}
+
+// --- FIIO_reader
+
+int64_t FIIO_reader::get_position(void* userdata) {
+  return static_cast<FIIO*>(userdata)->tell();
+}
+
+int FIIO_reader::read(void* data, size_t size, void* userdata) {
+  return static_cast<FIIO*>(userdata)->read(data, size);
+}
+
+int FIIO_reader::seek(int64_t position, void* userdata) {
+  return static_cast<FIIO*>(userdata)->seek(position);
+}
+
+heif_reader_grow_status FIIO_reader::wait_for_file_size(int64_t target_size, void* userdata) {
+  auto fio = static_cast<FIIO*>(userdata);
+
+  return (target_size > fio->file_size)
+    ? heif_reader_grow_status_size_beyond_eof
+    : heif_reader_grow_status_size_reached;
+}
+
+// --- FIIO_writer
+
+heif_error FIIO_writer::write(heif_context*, const void* data, size_t size, void* userdata) {
+  auto writer = static_cast<FIIO_writer*>(userdata);
+  auto bytes = static_cast<const BYTE*>(data);
+
+  // write_proc takes an unsigned count
+  const size_t max_chunk = 1u << 30;
+  while(size) {
+    const auto chunk = static_cast<unsigned>(size < max_chunk ? size : max_chunk);
+    if(writer->io->write_proc(const_cast<BYTE*>(bytes), 1, chunk, writer->handle) != chunk) {
+      return {heif_error_Encoding_error, heif_suberror_Cannot_write_output_data, "Write failed"};
+    }
+    bytes += chunk;
+    size -= chunk;
+  }
+  return {heif_error_Ok, heif_suberror_Unspecified, "Success"};
+}
+
+// --- builtin IO detection
+
+void FIIO_observe_io(const FreeImageIO* io) {
+  switch(s_detecting) {
+    case detect_memory:
+      s_memory_read_proc.store(io->read_proc);
+    break;
+    case detect_file:
+      s_file_read_proc.store(io->read_proc);
+    break;
+  }
+}
+
+void FIIO_detect_builtin_io(FREE_IMAGE_FORMAT fif) {
+  if(! s_memory_read_proc.load()) {
+    BYTE signature[12] = {};
+    if(auto* stream = FreeImage_OpenMemory(signature, sizeof(signature))) {
+      s_detecting = detect_memory;
+      FreeImage_ValidateFromMemory(fif, stream);
+      s_detecting = detect_none;
+      FreeImage_CloseMemory(stream);
+    }
+  }
+
+  if(! s_file_read_proc.load()) {
+#if defined(_WIN32)
+    static const char* null_device = "NUL";
+#else
+    static const char* null_device = "/dev/null";
+#endif
+    s_detecting = detect_file;
+    FreeImage_Validate(fif, null_device);
+    s_detecting = detect_none;
+  }
+}
+
+// --- file identity
+
+bool FIIO_file_id::operator==(const FIIO_file_id& other) const {
+  return std::equal(std::begin(this->values), std::end(this->values), std::begin(other.values));
+}
+
+FILE* FIIO_get_file(const FreeImageIO* io, fi_handle handle) {
+  const auto read_proc = io->read_proc;
+  return read_proc && read_proc == s_file_read_proc.load(std::memory_order_relaxed) ? static_cast<FILE*>(handle) : nullptr;
+}
+
+FIMEMORY* FIIO_get_memory(const FreeImageIO* io, fi_handle handle) {
+  const auto read_proc = io->read_proc;
+  return read_proc && read_proc == s_memory_read_proc.load(std::memory_order_relaxed) ? static_cast<FIMEMORY*>(handle) : nullptr;
+}
+
+bool FIIO_get_memory_id(FIMEMORY* stream, FIIO_file_id& id) {
+  BYTE* data{};
+  DWORD size{};
+  if(! FreeImage_AcquireMemory(stream, &data, &size) || ! data)
+    return false;
+
+  // FNV-1a
+  const auto hash = [](const BYTE* bytes, size_t count) {
+    uint64_t hash = 14695981039346656037ull;
+    for(size_t i = 0; i < count; i++)
+      hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+  };
+  const size_t window = 1 << 16;
+  const auto head = std::min<size_t>(size, window);
+  id = {{uint64_t(reinterpret_cast<uintptr_t>(data)), uint64_t(size), hash(data, head), hash(data + size - head, head)}};
+  return true;
+}
+
+bool FIIO_get_file_id(FILE* file, FIIO_file_id& id) {
+#if defined(_WIN32)
+  const auto fh = reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(file)));
+  BY_HANDLE_FILE_INFORMATION info;
+  if(fh == INVALID_HANDLE_VALUE || ! GetFileInformationByHandle(fh, &info))
+    return false;
+
+  id = {{info.dwVolumeSerialNumber
+    , (uint64_t(info.nFileIndexHigh) << 32) | info.nFileIndexLow
+    , (uint64_t(info.nFileSizeHigh) << 32) | info.nFileSizeLow
+    , (uint64_t(info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime}};
+#else
+  struct stat st;
+  if(fstat(fileno(file), &st) || ! S_ISREG(st.st_mode))
+    return false;
+
+  // The modification time in nanoseconds, seconds miss a rewrite (of the same size) within the same second
+#if defined(__APPLE__)
+  const auto& mtime = st.st_mtimespec;
+#else
+  const auto& mtime = st.st_mtim;
+#endif
+  id = {{uint64_t(st.st_dev), uint64_t(st.st_ino), uint64_t(st.st_size), uint64_t(mtime.tv_sec) * 1000000000u + uint64_t(mtime.tv_nsec)}};
+#endif
+  return true;
+}
+
+// --- FIIO_source
+
+FIIO_source::FIIO_source(FreeImageIO* io, fi_handle handle, bool cached)
+  : kind_(kind_reader)
+  , data_{}
+  , size_{}
+  , mapping_{}
+  , mapping_size_{}
+{
+  const auto read_proc = io->read_proc;
+
+  if(read_proc && read_proc == s_memory_read_proc.load(std::memory_order_relaxed)) {
+    if(this->acquire_memory(static_cast<FIMEMORY*>(handle), io->tell_proc(handle)))
+      return;
+  } else if(auto* file = FIIO_get_file(io, handle)) {
+    if(this->map_file(file)) {
+      this->kind_ = kind_mapped;
+      return;
+    }
+  }
+
+  this->fio_.reset(new FIIO(io, handle, cached));
+}
+
+FIIO_source::FIIO_source(FILE* file, bool cached)
+  : kind_(kind_mapped)
+  , data_{}
+  , size_{}
+  , mapping_{}
+  , mapping_size_{}
+{
+  if(! this->map_file(file)) {
+    this->kind_ = kind_reader;
+    this->fio_.reset(new FIIO(&s_stdio_io, file, cached));
+  }
+}
+
+FIIO_source::FIIO_source(FIMEMORY* stream)
+  : kind_(kind_memory)
+  , data_{}
+  , size_{}
+  , mapping_{}
+  , mapping_size_{}
+{
+  this->acquire_memory(stream, FreeImage_TellMemory(stream)); //< on failure, the source is empty and fails to read
+}
+
+FIIO_source::~FIIO_source() {
+  if(! this->mapping_)
+    return;
+#if defined(_WIN32)
+  UnmapViewOfFile(this->mapping_);
+#else
+  munmap(this->mapping_, this->mapping_size_);
+#endif
+}
+
+bool FIIO_source::acquire_memory(FIMEMORY* stream, long pos) {
+  BYTE* data{};
+  DWORD size{};
+  if(! FreeImage_AcquireMemory(stream, &data, &size) || ! data || pos < 0 || DWORD(pos) > size)
+    return false;
+
+  this->kind_ = kind_memory;
+  this->data_ = data + pos;
+  this->size_ = size - pos;
+  return true;
+}
+
+bool FIIO_source::map_file(FILE* file) {
+  const auto pos = ftell(file);
+  if(pos < 0)
+    return false;
+
+#if defined(_WIN32)
+  const auto fh = reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(file)));
+  LARGE_INTEGER file_size;
+  if(fh == INVALID_HANDLE_VALUE || ! GetFileSizeEx(fh, &file_size) || file_size.QuadPart <= pos || uint64_t(file_size.QuadPart) > SIZE_MAX)
+    return false;
+
+  const auto mapping = CreateFileMappingW(fh, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if(! mapping)
+    return false;
+  const auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping); //< The view keeps the mapping alive 
+  if(! view)
+    return false;
+
+  this->mapping_size_ = size_t(file_size.QuadPart);
+#else
+  const auto fd = fileno(file);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) || ! S_ISREG(st.st_mode) || st.st_size <= pos || uint64_t(st.st_size) > SIZE_MAX)
+    return false;
+
+  const auto view = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+  if(view == MAP_FAILED)
+    return false;
+
+  this->mapping_size_ = size_t(st.st_size);
+#endif
+
+  this->mapping_ = view;
+  this->data_ = static_cast<const BYTE*>(view) + pos;
+  this->size_ = this->mapping_size_ - pos;
+  return true;
+}
+
+heif_error FIIO_source::read(heif_context* ctx) {
+  if(this->fio_)
+    return heif_context_read_from_reader(ctx, &this->reader_, this->fio_.get(), nullptr);
+
+  return heif_context_read_from_memory_without_copy(ctx, this->data_, this->size_, nullptr);
+}
+
+size_t FIIO_source::peek(void* data, size_t size) {
+  if(! this->fio_) {
+    const auto count = std::min(size, this->size_);
+    if(count)
+      memcpy(data, this->data_, count);
+    return count;
+  }
+
+  auto* fio = this->fio_.get();
+  const auto pos = fio->tell();
+  size = size_t(std::min<int64_t>(int64_t(size), fio->file_size));
+  const auto failed = fio->read(data, size);
+  fio->seek(pos);
+  return failed ? 0 : size;
+}
+
+int64_t FIIO_source::size() const {
+  return this->fio_ ? this->fio_->file_size : int64_t(this->size_);
+}
+
+// --- FIIO_stream
+
+FIIO_stream::FIIO_stream(uint64_t expected_size)
+  : reader_{1, &get_position, &read_data, &seek_data, &wait_for_file_size}
+  , pos_{}
+  , expected_size_(expected_size)
+  , ended_{}
+{
+  if(expected_size && expected_size <= SIZE_MAX) {
+    try {
+      this->data_.reserve(size_t(expected_size)); //< no reallocations, in the common case
+    } catch (const std::exception&) { //< std::bad_alloc, std::length_error - a bogus size, grown as the data comes instead
+    }
+  }
+}
+
+void FIIO_stream::push(const void* data, size_t size) {
+  const auto* bytes = static_cast<const BYTE*>(data);
+  {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    if(this->ended_)
+      return;
+    this->data_.insert(this->data_.end(), bytes, bytes + size);
+  }
+  this->grown_.notify_all();
+}
+
+void FIIO_stream::end() {
+  {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->ended_ = true;
+  }
+  this->grown_.notify_all();
+}
+
+bool FIIO_stream::wait(int64_t size) {
+  if(size < 0 || (this->expected_size_ && uint64_t(size) > this->expected_size_))
+    return false;
+
+  std::unique_lock<std::mutex> lock(this->mutex_);
+  this->grown_.wait(lock, [&] { return int64_t(this->data_.size()) >= size || this->ended_; });
+  return int64_t(this->data_.size()) >= size;
+}
+
+heif_error FIIO_stream::read(heif_context* ctx) {
+  return heif_context_read_from_reader(ctx, &this->reader_, this, nullptr);
+}
+
+size_t FIIO_stream::peek(void* data, size_t size) {
+  this->wait(int64_t(size));
+
+  std::lock_guard<std::mutex> lock(this->mutex_);
+  const auto count = std::min(size, this->data_.size());
+  if(count)
+    memcpy(data, this->data_.data(), count);
+  return count;
+}
+
+int64_t FIIO_stream::get_position(void* userdata) {
+  return static_cast<FIIO_stream*>(userdata)->pos_;
+}
+
+int FIIO_stream::read_data(void* data, size_t size, void* userdata) {
+  auto* stream = static_cast<FIIO_stream*>(userdata);
+  if(! stream->wait(stream->pos_ + int64_t(size)))
+    return 1;
+
+  std::lock_guard<std::mutex> lock(stream->mutex_); //< the producer might be reallocating
+  memcpy(data, stream->data_.data() + stream->pos_, size);
+  stream->pos_ += int64_t(size);
+  return 0;
+}
+
+int FIIO_stream::seek_data(int64_t position, void* userdata) {
+  static_cast<FIIO_stream*>(userdata)->pos_ = position; //< the data is waited for on read
+  return 0;
+}
+
+heif_reader_grow_status FIIO_stream::wait_for_file_size(int64_t target_size, void* userdata) {
+  return static_cast<FIIO_stream*>(userdata)->wait(target_size)
+    ? heif_reader_grow_status_size_reached
+    : heif_reader_grow_status_size_beyond_eof;
+}
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include "FreeImage.h"
+#include "libheif/heif.h"
+
+/** @brief Block cache geometry, used by FIIO when cached IO is requested (FISIDECAR_LOAD_HEIF_CACHED_IO).
+ *
+ * Values are process-wide and read once per load.
+ * See FISidecar_SetIOCache for the public setter.
+**/
+struct FIIO_cache_config
+{
+  static const unsigned default_block_size  = 64 * 1024;
+  static const unsigned default_block_count = 8;
+  static const unsigned min_block_size      = 512;
+
+  unsigned block_size;
+  unsigned block_count;
+
+  static FIIO_cache_config get();
+  static void set(unsigned block_size, unsigned block_count);
+};
+
+/** @brief Access counters, as seen by the underlying FreeImageIO (not by libheif). **/
+struct FIIO_counters
+{
+  uint64_t reads;
+  uint64_t seeks;
+  uint64_t bytes_read;
+};
+
+struct FIIO
+{
+  FIIO(FreeImageIO* io, fi_handle handle, bool cached = false);
+
+  int64_t tell() const;
+  // Both return 0 on success, just as the heif_reader functions
+  int read(void* data, size_t size);
+  int seek(int64_t position);
+
+  FreeImageIO* io;
+  fi_handle handle;
+
+  int64_t file_size;
+
+  FIIO_counters counters;
+
+private:
+  struct Block
+  {
+    int64_t index;      //< -1 for empty
+    uint64_t last_use;  //< LRU tick
+    size_t size;        //< valid bytes, less than block size only for the last block in the file
+    std::vector<BYTE> data;
+  };
+
+  int io_read(void* data, size_t size);
+  int io_seek(int64_t position);
+  const Block* get_block(int64_t index);
+
+  int64_t pos;          //< logical position, as seen by libheif
+  int64_t io_pos;       //< position of the underlying handle, to skip redundant seeks
+  int64_t file_end;
+
+  size_t block_size;
+  uint64_t tick;
+  std::vector<Block> blocks;
+};
+
+struct FIIO_reader : heif_reader
+{
+  FIIO_reader()
+    : heif_reader{1, &get_position, &read, &seek, &wait_for_file_size}
+  {}
+
+  static int64_t get_position(void* userdata);
+
+  // The functions read(), and seek() return 0 on success.
+  // Generally, libheif will make sure that we do not read past the file size.
+  static int read(void* data,
+               size_t size,
+               void* userdata);
+
+  static int seek(int64_t position,
+               void* userdata);
+
+  // "When calling this function, libheif wants to make sure that it can read the file
+  // up to 'target_size'. This is useful when the file is currently downloaded and may
+  // grow with time. You may, for example, extract the image sizes even before the actual
+  // compressed image data has been completely downloaded.
+  //
+  // Even if your input files will not grow, you will have to implement at least
+  // detection whether the target_size is above the (fixed) file length
+  // (in this case, return 'size_beyond_eof')." libheif
+  static heif_reader_grow_status wait_for_file_size(int64_t target_size, void* userdata);
+};
+
+/** @brief Passes the file, written by heif_context_write, to FreeImageIO. The writer is also the userdata. **/
+struct FIIO_writer : heif_writer
+{
+  FIIO_writer(FreeImageIO* io, fi_handle handle)
+    : heif_writer{1, &write}
+    , io(io)
+    , handle(handle)
+  {}
+
+  static heif_error write(heif_context* ctx, const void* data, size_t size, void* userdata);
+
+  FreeImageIO* io;
+  fi_handle handle;
+};
+
+/** @brief Detection of the FreeImageIO implementations, built into FreeImage. 
+ * 
+ * FreeImage does not export its memory and file IO routines, so we learn them by observing a validation call, 
+ * which FreeImage makes with each of them (see FIIO_detect_builtin_io).
+ * Knowing them, FIMEMORY handles can be read without a copy and FILE handles can be mapped into memory.
+**/
+void FIIO_detect_builtin_io(FREE_IMAGE_FORMAT fif);
+void FIIO_observe_io(const FreeImageIO* io); //< Call from the plugins validate_proc
+
+/** @brief Identity of an open file (device, inode, size, modification time), to recognize it, when it is opened again.
+ * Or of a memory buffer (address, size, hashes of the first and the last 64 KiB - where the container boxes are).
+**/
+struct FIIO_file_id
+{
+  uint64_t values[4];
+
+  bool operator==(const FIIO_file_id& other) const;
+};
+
+FILE* FIIO_get_file(const FreeImageIO* io, fi_handle handle); //< The handle, if io is the FreeImage file IO, else null
+bool FIIO_get_file_id(FILE* file, FIIO_file_id& id);
+
+FIMEMORY* FIIO_get_memory(const FreeImageIO* io, fi_handle handle); //< The handle, if io is the FreeImage memory IO, else null
+bool FIIO_get_memory_id(FIMEMORY* stream, FIIO_file_id& id);
+
+/** @brief Feeds a heif_context from FreeImageIO, the cheapest available way:
+ * 
+ *  - FIMEMORY handle - the memory buffer is passed to libheif as-is (no copy)
+ *  - FILE handle - the file is mapped into memory and passed to libheif as-is
+ *  - any other handle (or if the above fail) - FIIO and FIIO_reader (optionally cached)
+ * 
+ * The source must outlive the context. 
+**/
+class FIIO_source
+{
+public:
+  enum kind_t { kind_reader, kind_memory, kind_mapped };
+
+  FIIO_source(FreeImageIO* io, fi_handle handle, bool cached = false);
+  explicit FIIO_source(FILE* file, bool cached = false); //< mapped, or read through stdio
+  explicit FIIO_source(FIMEMORY* stream);                 //< from the current position, no copy
+  ~FIIO_source();
+
+  FIIO_source(const FIIO_source&) = delete;
+  FIIO_source& operator=(const FIIO_source&) = delete;
+
+  heif_error read(heif_context* ctx);
+
+  // Copies the first bytes (the file type, brand), without consuming them. Returns the count copied.
+  size_t peek(void* data, size_t size);
+
+  kind_t kind() const { return this->kind_; }
+  const FIIO* fio() const { return this->fio_.get(); } //< null, unless kind_reader
+  int64_t size() const;
+
+private:
+  bool map_file(FILE* file);
+  bool acquire_memory(FIMEMORY* stream, long pos);
+
+  kind_t kind_;
+  std::unique_ptr<FIIO> fio_;
+  FIIO_reader reader_;
+
+  const BYTE* data_;
+  size_t size_;
+
+  void* mapping_;
+  size_t mapping_size_;
+};
+
+/** @brief A file, which arrives in pieces (upload, download). The producer pushes the bytes as they come, from any thread,
+ * while libheif reads the bytes, which are there, and waits (wait_for_file_size) for those, which are not yet.
+ * 
+ * libheif needs to know, where the file ends, to finish parsing the container, so with no expected size, 
+ * parsing waits for end() (after the image data, as the last box usually is "mdat").
+**/
+class FIIO_stream
+{
+public:
+  explicit FIIO_stream(uint64_t expected_size); //< 0 if unknown
+
+  FIIO_stream(const FIIO_stream&) = delete;
+  FIIO_stream& operator=(const FIIO_stream&) = delete;
+
+  void push(const void* data, size_t size);
+  void end(); //< no more data, the waiting reads fail beyond it
+
+  heif_error read(heif_context* ctx);
+
+  // Waits for the first bytes (or the end) and copies them, without consuming them. Returns the count copied.
+  size_t peek(void* data, size_t size);
+
+private:
+  bool wait(int64_t size); //< true, once size bytes are there, false if they never will be
+
+  static int64_t get_position(void* userdata);
+  static int read_data(void* data, size_t size, void* userdata);
+  static int seek_data(int64_t position, void* userdata);
+  static heif_reader_grow_status wait_for_file_size(int64_t target_size, void* userdata);
+
+  heif_reader reader_;
+  int64_t pos_;                   //< of the reader (the consumer)
+  uint64_t expected_size_;
+
+  std::mutex mutex_;              //< guards the below
+  std::condition_variable grown_;
+  std::vector<BYTE> data_;
+  bool ended_;
+};
@@ -1,9 +1,163 @@
  #include "FISidecar.h"
  #include "PluginHEIF.hpp"
+ #include "FIIO.hpp"
+ #include "Parallel.hpp"
+ #include "Startup.hpp"
+ #include <chrono>
+
+ namespace {
+   FREE_IMAGE_FORMAT registerPlugin(FI_InitProc init) {
+     const auto start = std::chrono::steady_clock::now();
+     const auto fif = FreeImage_RegisterLocalPlugin(init);
+     if(fif != FIF_UNKNOWN)
+       FIIO_detect_builtin_io(fif);
+     startup_add_register_ms(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+     return fif;
+   }
+ }
 
  FREE_IMAGE_FORMAT DLL_CALLCONV FISidecar_RegisterPluginHEIF() {
-   return FreeImage_RegisterLocalPlugin(&InitHEIF);
+   return registerPlugin(&InitHEIF);
  }
  FREE_IMAGE_FORMAT DLL_CALLCONV FISidecar_RegisterPluginAVIF() {
-   return FreeImage_RegisterLocalPlugin(&InitAVIF);
+   return registerPlugin(&InitAVIF);
+ }
+
+ void DLL_CALLCONV FISidecar_Initialise(const FISIDECAR_INIT* init) {
+   libheif_configure(init ? init->plugins : nullptr);
+   const auto scan = ! init || init->scan_plugin_directory != FALSE;
+   if(! scan || (init && init->immediate))
+     libheif_init(scan); //< skipping the scan touches the environment, so not later, on whichever thread loads first
+ }
+ void DLL_CALLCONV FISidecar_DeInitialise() {
+   ReleaseState(); //< before libheif
+   libheif_shutdown();
+ }
+ void DLL_CALLCONV FISidecar_GetStartupStats(FISIDECAR_STARTUP_STATS* stats) {
+   if(stats)
+     startup_get_stats(stats);
+ }
+
+ void DLL_CALLCONV FISidecar_SetIOCache(unsigned block_size, unsigned block_count) {
+   FIIO_cache_config::set(block_size, block_count);
+ }
+ void DLL_CALLCONV FISidecar_SetThreadBudget(unsigned threads) {
+   parallel_set_budget(threads);
+ }
+
+ FISIDECAR_IMAGE* DLL_CALLCONV FISidecar_OpenImage(const char* filename, int flags) {
+   return OpenImage(filename, flags);
+ }
+ FISIDECAR_IMAGE* DLL_CALLCONV FISidecar_OpenImageFromMemory(FIMEMORY* stream, int flags) {
+   return OpenImage(stream, flags);
+ }
+ FISIDECAR_IMAGE* DLL_CALLCONV FISidecar_OpenImageFromHandle(FreeImageIO* io, fi_handle handle, int flags) {
+   return OpenImage(io, handle, flags);
+ }
+ void DLL_CALLCONV FISidecar_CloseImage(FISIDECAR_IMAGE* image) {
+   CloseImage(image);
+ }
+
+ BOOL DLL_CALLCONV FISidecar_GetTileLayout(FISIDECAR_IMAGE* image, FISIDECAR_TILE_LAYOUT* layout) {
+   return GetTileLayout(image, layout);
+ }
+ FIBITMAP* DLL_CALLCONV FISidecar_LoadRegion(FISIDECAR_IMAGE* image, int left, int top, int right, int bottom) {
+   return LoadRegion(image, left, top, right, bottom);
+ }
+ BOOL DLL_CALLCONV FISidecar_LoadTile(FISIDECAR_IMAGE* image, unsigned column, unsigned row, FIBITMAP* dst, int dst_left, int dst_top) {
+   return LoadTile(image, column, row, dst, dst_left, dst_top);
+ }
+ BOOL DLL_CALLCONV FISidecar_LoadToSink(FISIDECAR_IMAGE* image, FISIDECAR_SINK sink, void* user_data, int mode, unsigned band_height) {
+   return LoadToSink(image, sink, user_data, mode, band_height);
+ }
+
+ BOOL DLL_CALLCONV FISidecar_Probe(const char* filename, FISIDECAR_PROBE* info) {
+   return Probe(filename, info);
+ }
+ BOOL DLL_CALLCONV FISidecar_ProbeFromMemory(FIMEMORY* stream, FISIDECAR_PROBE* info) {
+   return Probe(stream, info);
+ }
+ BOOL DLL_CALLCONV FISidecar_ProbeFromHandle(FreeImageIO* io, fi_handle handle, FISIDECAR_PROBE* info) {
+   return Probe(io, handle, info);
+ }
+ unsigned DLL_CALLCONV FISidecar_LoadBatch(FISIDECAR_BATCH_ITEM* items, unsigned count) {
+   return LoadBatch(items, count);
+ }
+
+ FISIDECAR_ASYNC* DLL_CALLCONV FISidecar_LoadAsync(FREE_IMAGE_FORMAT fif, const char* filename, int flags) {
+   return LoadAsync(fif, filename, nullptr, flags);
+ }
+ FISIDECAR_ASYNC* DLL_CALLCONV FISidecar_LoadFromMemoryAsync(FREE_IMAGE_FORMAT fif, FIMEMORY* stream, int flags) {
+   return LoadAsync(fif, nullptr, stream, flags);
+ }
+ void DLL_CALLCONV FISidecar_CancelLoad(FISIDECAR_ASYNC* async) {
+   CancelLoad(async);
+ }
+ BOOL DLL_CALLCONV FISidecar_WaitLoad(FISIDECAR_ASYNC* async, unsigned timeout_ms) {
+   return WaitLoad(async, timeout_ms);
+ }
+ const char* DLL_CALLCONV FISidecar_GetLoadError(FISIDECAR_ASYNC* async) {
+   return GetLoadError(async);
+ }
+ FIBITMAP* DLL_CALLCONV FISidecar_FinishLoad(FISIDECAR_ASYNC* async) {
+   return FinishLoad(async);
+ }
+
+ void DLL_CALLCONV FISidecar_EnableStats(BOOL enable) {
+   EnableStats(enable != FALSE);
+ }
+ BOOL DLL_CALLCONV FISidecar_GetLoadStats(FISIDECAR_LOAD_STATS* stats) {
+   return GetLoadStats(stats);
+ }
+ void DLL_CALLCONV FISidecar_GetStatsTotals(FISIDECAR_STATS_TOTALS* totals, BOOL reset) {
+   GetStatsTotals(totals, reset != FALSE);
+ }
+
+ BOOL DLL_CALLCONV FISidecar_LoadInto(FIBITMAP* dst, FREE_IMAGE_FORMAT fif, const char* filename, int flags) {
+   return LoadInto(dst, fif, filename, nullptr, flags);
+ }
+ BOOL DLL_CALLCONV FISidecar_LoadIntoFromMemory(FIBITMAP* dst, FREE_IMAGE_FORMAT fif, FIMEMORY* stream, int flags) {
+   return LoadInto(dst, fif, nullptr, stream, flags);
+ }
+ void DLL_CALLCONV FISidecar_SetBitmapPool(unsigned megabytes) {
+   SetBitmapPool(size_t(megabytes) * 1024 * 1024);
+ }
+ void DLL_CALLCONV FISidecar_RecycleBitmap(FIBITMAP* dib) {
+   RecycleBitmap(dib);
+ }
+
+ FISIDECAR_STREAM* DLL_CALLCONV FISidecar_OpenStream(unsigned long long expected_size, int flags) {
+   return OpenStream(expected_size, flags);
+ }
+ BOOL DLL_CALLCONV FISidecar_PushStream(FISIDECAR_STREAM* stream, const void* data, unsigned size) {
+   return PushStream(stream, data, size);
+ }
+ void DLL_CALLCONV FISidecar_EndStream(FISIDECAR_STREAM* stream) {
+   EndStream(stream);
+ }
+ void DLL_CALLCONV FISidecar_CloseStream(FISIDECAR_STREAM* stream) {
+   CloseStream(stream);
+ }
+ FIBITMAP* DLL_CALLCONV FISidecar_LoadStreamHeader(FISIDECAR_STREAM* stream) {
+   return LoadStreamHeader(stream);
+ }
+ FIBITMAP* DLL_CALLCONV FISidecar_LoadStreamThumbnail(FISIDECAR_STREAM* stream) {
+   return LoadStreamThumbnail(stream);
+ }
+ FIBITMAP* DLL_CALLCONV FISidecar_LoadStream(FISIDECAR_STREAM* stream) {
+   return LoadStream(stream);
+ }
+
+ BOOL DLL_CALLCONV FISidecar_SetOutputProfile(const void* icc, unsigned size) {
+   return SetOutputProfile(icc, size);
+ }
+
+ unsigned DLL_CALLCONV FISidecar_GetDecoders(FREE_IMAGE_FORMAT fif, FISIDECAR_DECODER_INFO* decoders, unsigned count) {
+   return GetDecoders(fif, decoders, count);
+ }
+ BOOL DLL_CALLCONV FISidecar_SetDecoder(FREE_IMAGE_FORMAT fif, const char* id) {
+   return SetDecoder(fif, id, false);
+ }
+ BOOL DLL_CALLCONV FISidecar_SetThreadDecoder(FREE_IMAGE_FORMAT fif, const char* id) {
+   return SetDecoder(fif, id, true);
  }
@@ -16,24 +16,452 @@ extern "C" {
  * If the limit is not set (or 0), FISIDECAR_LOAD_MAXTHREADS_DEFAULT is used. 
  * Maximum limit is 255 by default, which is defined via FISIDECAR_LOAD_MAXTHREADS_VALUE_SIZE.
  * 
+ * The limit is an upper bound. The threads come from a pool, shared by all loads (see FISidecar_SetThreadBudget), 
+ * and a load gets at most its share of it - no more than its tiles, and an equal part of the budget with the other loads, running at the time.
+ * 
  * @note libheif must be compiled with #define ENABLE_PARALLEL_TILE_DECODING to have threaded loading in the first place.
  * It also needs to have heif_context_set_max_decoding_threads function present.
 **/
 
 const size_t FISIDECAR_LOAD_MAXTHREADS_DEFAULT    = 4; //< Default threads count, see above comment. (max 2 ^ FISIDECAR_LOAD_MAXTHREADS_VALUE_SIZE - 1)
-const size_t FISIDECAR_LOAD_MAXTHREADS_VALUE_SIZE = 8; //< In bits, max 15 (FIF_LOAD_NOPIXELS) - 3 (FISIDECAR_LOAD_HEIF_TRANSFORM)
+const size_t FISIDECAR_LOAD_MAXTHREADS_VALUE_SIZE = 8; //< In bits, max 15 (FIF_LOAD_NOPIXELS) - 7 (FISIDECAR_LOAD_HEIF_STATS)
 
-#define FISIDECAR_LOAD_HEIF_SDR                   (1 << (0 + FISIDECAR_LOAD_MAXTHREADS_VALUE_SIZE))
+#define FISIDECAR_LOAD_HEIF_SDR                   (1 << (0 + FISIDECAR_LOAD_MAXTHREADS_VALUE_SIZE)) //< Load 10bit+ as 8bit, instead of FIT_RGB(A)16
 #define FISIDECAR_LOAD_HEIF_NCLX_TO_ICC           (1 << (1 + FISIDECAR_LOAD_MAXTHREADS_VALUE_SIZE))
 #define FISIDECAR_LOAD_HEIF_TRANSFORM             (1 << (2 + FISIDECAR_LOAD_MAXTHREADS_VALUE_SIZE))
+#define FISIDECAR_LOAD_HEIF_CACHED_IO             (1 << (3 + FISIDECAR_LOAD_MAXTHREADS_VALUE_SIZE)) //< Read the file in blocks, see FISidecar_SetIOCache
+
+/** @brief What to do with the embedded thumbnail - a 2 bit value, one of the below (not a bit mask).
+ * 
+ * DEFAULT - Decode and attach it (FreeImage_GetThumbnail) with a full load. Skip it with FIF_LOAD_NOPIXELS, so that header-only loads do not pay for a decode.
+ * NONE    - Never decode it. 
+ * ALWAYS  - Always decode and attach it, also with FIF_LOAD_NOPIXELS (the behavior before this option existed). 
+ * ONLY    - Return the thumbnail as the image itself, never decoding the primary image (previews, galleries). 
+ *           The metadata is still the one of the primary image. If there is no thumbnail, the primary image is loaded.
+ *           Combined with FIF_LOAD_NOPIXELS, returns the thumbnail dimensions.
+**/
+#define FISIDECAR_LOAD_HEIF_THUMBNAIL_DEFAULT     0
+#define FISIDECAR_LOAD_HEIF_THUMBNAIL_NONE        (1 << (4 + FISIDECAR_LOAD_MAXTHREADS_VALUE_SIZE))
+#define FISIDECAR_LOAD_HEIF_THUMBNAIL_ALWAYS      (2 << (4 + FISIDECAR_LOAD_MAXTHREADS_VALUE_SIZE))
+#define FISIDECAR_LOAD_HEIF_THUMBNAIL_ONLY        (3 << (4 + FISIDECAR_LOAD_MAXTHREADS_VALUE_SIZE))
+#define FISIDECAR_LOAD_HEIF_THUMBNAIL_MASK        (3 << (4 + FISIDECAR_LOAD_MAXTHREADS_VALUE_SIZE))
+
+#define FISIDECAR_LOAD_HEIF_STATS                 (1 << (6 + FISIDECAR_LOAD_MAXTHREADS_VALUE_SIZE)) //< Collect the load statistics, see FISidecar_GetLoadStats
+
+/** @brief Decode 8 bit images as they are stored (YCbCr 4:2:0, 4:2:2, 4:4:4 or monochrome) and convert them to BGR(A), 
+ * while they are copied into the FIBITMAP - in a single vectorized pass, instead of libheif's conversion to RGB, followed by a swizzle.
+ * 
+ * The matrix and the range are those of the NCLX profile of the stream. Chroma is upsampled by replication, 
+ * so the result may differ slightly from libheif's conversion. Images, which are not plain YCbCr (RGB/identity matrix, YCgCo, 10 bit+), 
+ * and scaled loads (FISIDECAR_LOAD_HEIF_SIZE) are converted by libheif, as usual.
+**/
+#define FISIDECAR_LOAD_HEIF_FUSED_YCBCR           (1 << 30) //< Above FISIDECAR_LOAD_HEIF_SIZE
+
+/** @brief Convert the pixels to sRGB (or the profile set with FISidecar_SetOutputProfile) during the load, and attach that profile.
+ * 
+ * The source is the embedded ICC profile, or the one made from NCLX (as FISIDECAR_LOAD_HEIF_NCLX_TO_ICC does). Untagged images are taken for sRGB.
+ * The rows are split between the load threads. The lcms transforms are cached, per source profile and pixel format. 
+ * Requires liblcms2, without it the pixels are left as they are. Ignored with FIF_LOAD_NOPIXELS.
+**/
+#define FISIDECAR_LOAD_HEIF_TO_SRGB               ((int) 0x80000000u) //< The top bit
+
+/** @brief Scale on load, similarly to JPEG_SCALE - OR the requested size with the flags:
+ * 
+ * FreeImage_Load(..., ..., flags | FISIDECAR_LOAD_HEIF_SIZE(256));
+ * 
+ * The image is downscaled by the biggest integer factor, which keeps its longer side at least size pixels (box filter),
+ * while it is copied into the FIBITMAP - there is no full-size FIBITMAP and no separate rescale pass.
+ * The embedded thumbnail is used instead of the primary image, if it is big enough. In that case it is not attached as a thumbnail.
+ * Grid images are decoded a row of tiles at a time and streamed through the filter.
+ * Combined with FIF_LOAD_NOPIXELS, returns the scaled dimensions. Max size is 16383, 0 means no scaling.
+**/
+#define FISIDECAR_LOAD_HEIF_SIZE_SHIFT            16
+#define FISIDECAR_LOAD_HEIF_SIZE_MASK             (0x3FFF << FISIDECAR_LOAD_HEIF_SIZE_SHIFT)
+#define FISIDECAR_LOAD_HEIF_SIZE(size)            (((size) << FISIDECAR_LOAD_HEIF_SIZE_SHIFT) & FISIDECAR_LOAD_HEIF_SIZE_MASK)
      
 #define FISIDECAR_LOAD_AVIF_SDR                   FISIDECAR_LOAD_HEIF_SDR
 #define FISIDECAR_LOAD_AVIF_NCLX_TO_ICC           FISIDECAR_LOAD_HEIF_NCLX_TO_ICC
 #define FISIDECAR_LOAD_AVIF_TRANSFORM             FISIDECAR_LOAD_HEIF_TRANSFORM
+#define FISIDECAR_LOAD_AVIF_CACHED_IO             FISIDECAR_LOAD_HEIF_CACHED_IO
+#define FISIDECAR_LOAD_AVIF_THUMBNAIL_DEFAULT     FISIDECAR_LOAD_HEIF_THUMBNAIL_DEFAULT
+#define FISIDECAR_LOAD_AVIF_THUMBNAIL_NONE        FISIDECAR_LOAD_HEIF_THUMBNAIL_NONE
+#define FISIDECAR_LOAD_AVIF_THUMBNAIL_ALWAYS      FISIDECAR_LOAD_HEIF_THUMBNAIL_ALWAYS
+#define FISIDECAR_LOAD_AVIF_THUMBNAIL_ONLY        FISIDECAR_LOAD_HEIF_THUMBNAIL_ONLY
+#define FISIDECAR_LOAD_AVIF_THUMBNAIL_MASK        FISIDECAR_LOAD_HEIF_THUMBNAIL_MASK
+#define FISIDECAR_LOAD_AVIF_SIZE(size)            FISIDECAR_LOAD_HEIF_SIZE(size)
+#define FISIDECAR_LOAD_AVIF_STATS                 FISIDECAR_LOAD_HEIF_STATS
+#define FISIDECAR_LOAD_AVIF_FUSED_YCBCR           FISIDECAR_LOAD_HEIF_FUSED_YCBCR
+#define FISIDECAR_LOAD_AVIF_TO_SRGB               FISIDECAR_LOAD_HEIF_TO_SRGB
+
+/** @brief Save flags (FreeImage_Save), OR-ed together:
+ * 
+ * FreeImage_Save(FIF, dib, "out.heic", 75 | FISIDECAR_SAVE_HEIF_SPEED_FAST | FISIDECAR_SAVE_HEIF_THREADS(8));
+ * 
+ * Quality   - 1-100 in the low 7 bits, 0 for the encoder default.
+ * LOSSLESS  - lossless encoding (4:4:4, identity matrix), the quality is ignored.
+ * THREADS   - encoder threads (the "threads" parameter, "x265:pools" for x265), 0 for the encoder default. 
+ *             Also bounds the threads, converting the pixels, as with loading.
+ * SPEED     - a 2 bit preset, one of the below (not a bit mask), mapped to "speed" (aom, rav1e, svt) or "preset" (x265).
+ * TILED     - encode as a grid of tiles of about FISIDECAR_SAVE_HEIF_TILE_SIZE pixels (libheif 1.18+), so that large images are 
+ *             split into independent streams. The tiles have equal even sizes - an image, which does not split into such, is saved with
+ *             the last tile row and column overhanging it (cropped by the grid) with libheif 1.19+, else as a single image (with a message).
+ * 
+ * 8 bit FreeImage RGB(A) is saved as 8 bit, FIT_RGB(A)16 as 10 bit. Other types are converted to 24 bit first.
+ * The ICC profile, Exif (FIMD_EXIF_RAW) and XMP are saved too.
+**/
+#define FISIDECAR_SAVE_HEIF_QUALITY_MASK          0x7F
+#define FISIDECAR_SAVE_HEIF_LOSSLESS              0x80
+#define FISIDECAR_SAVE_HEIF_THREADS(n)            (((n) & 0xFF) << 8)
+#define FISIDECAR_SAVE_HEIF_SPEED_DEFAULT         0
+#define FISIDECAR_SAVE_HEIF_SPEED_FAST            (1 << 16)
+#define FISIDECAR_SAVE_HEIF_SPEED_FASTEST         (2 << 16)
+#define FISIDECAR_SAVE_HEIF_SPEED_SLOW            (3 << 16)
+#define FISIDECAR_SAVE_HEIF_SPEED_MASK            (3 << 16)
+#define FISIDECAR_SAVE_HEIF_TILED                 (1 << 18)
+#define FISIDECAR_SAVE_HEIF_TILE_SIZE             512
+
+#define FISIDECAR_SAVE_AVIF_QUALITY_MASK          FISIDECAR_SAVE_HEIF_QUALITY_MASK
+#define FISIDECAR_SAVE_AVIF_LOSSLESS              FISIDECAR_SAVE_HEIF_LOSSLESS
+#define FISIDECAR_SAVE_AVIF_THREADS(n)            FISIDECAR_SAVE_HEIF_THREADS(n)
+#define FISIDECAR_SAVE_AVIF_SPEED_DEFAULT         FISIDECAR_SAVE_HEIF_SPEED_DEFAULT
+#define FISIDECAR_SAVE_AVIF_SPEED_FAST            FISIDECAR_SAVE_HEIF_SPEED_FAST
+#define FISIDECAR_SAVE_AVIF_SPEED_FASTEST         FISIDECAR_SAVE_HEIF_SPEED_FASTEST
+#define FISIDECAR_SAVE_AVIF_SPEED_SLOW            FISIDECAR_SAVE_HEIF_SPEED_SLOW
+#define FISIDECAR_SAVE_AVIF_SPEED_MASK            FISIDECAR_SAVE_HEIF_SPEED_MASK
+#define FISIDECAR_SAVE_AVIF_TILED                 FISIDECAR_SAVE_HEIF_TILED
 
 DLL_API FREE_IMAGE_FORMAT DLL_CALLCONV FISidecar_RegisterPluginHEIF();
 DLL_API FREE_IMAGE_FORMAT DLL_CALLCONV FISidecar_RegisterPluginAVIF();
 
+/** @brief libheif initialization and plugin discovery (optional).
+ * 
+ * Registering the plugins does not initialize libheif - the first load (or probe, save) does. This is where libheif discovers 
+ * its decoder/encoder plugins, scanning its plugin directory - a good part of the runtime of short-lived processes.
+ * FISidecar_Initialise, called before that, sets how it is done:
+ * 
+ *  - plugins                - libheif plugin files (full paths) to load, a null terminated array, can be null
+ *  - scan_plugin_directory  - FALSE to load only the above, without scanning libheif's plugin directory. This initializes libheif
+ *                             right away, as immediate does. It sets an empty LIBHEIF_PLUGIN_PATH (unless it is set already) for the
+ *                             duration of libheif's initialization and removes it right after - the process environment is not
+ *                             thread-safe, so call FISidecar_Initialise before starting any other threads.
+ *  - immediate              - initialize now, instead of at the first use (warm-up)
+ * 
+ * Null init is the default - scan the directory, initialize at the first use. Once libheif is initialized, the settings apply
+ * to the next initialization only (after FISidecar_DeInitialise), except scan_plugin_directory - a later initialization at
+ * the first use always scans, call FISidecar_Initialise again to skip it. 
+ * FISidecar_DeInitialise releases the parsed files of multipage bitmaps and the decoder selections (FISidecar_SetDecoder), unloads
+ * the plugins and deinitializes libheif. No loads may be running, and the FISIDECAR_IMAGE and FISIDECAR_STREAM handles must be closed first.
+ * The next use initializes it again.
+**/
+typedef struct {
+  const char* const* plugins;
+  BOOL scan_plugin_directory;
+  BOOL immediate;
+} FISIDECAR_INIT;
+
+DLL_API void DLL_CALLCONV FISidecar_Initialise(const FISIDECAR_INIT* init FI_DEFAULT(NULL));
+DLL_API void DLL_CALLCONV FISidecar_DeInitialise();
+
+/** @brief Where the startup time went - for tuning short-lived processes. All in milliseconds. **/
+typedef struct {
+  double register_ms;       //< FISidecar_RegisterPlugin* calls, summed
+  double init_ms;           //< libheif initialization (heif_init, plugin discovery and loading), summed over re-initializations
+  double first_load_ms;     //< the first FreeImage_Load of a HEIF/AVIF in the process, initialization included. 0 until there is one
+  unsigned plugins;         //< loaded from FISIDECAR_INIT::plugins
+} FISIDECAR_STARTUP_STATS;
+
+DLL_API void DLL_CALLCONV FISidecar_GetStartupStats(FISIDECAR_STARTUP_STATS* stats);
+
+/** @brief Configure the block cache, used when loading with FISIDECAR_LOAD_HEIF_CACHED_IO.
+ * 
+ * libheif reads the container in many small pieces (often 1-8 bytes), seeking back and forth between the boxes. 
+ * With cached IO, the FreeImageIO is read in aligned blocks of block_size bytes and the last block_count blocks are kept around (LRU), 
+ * so that small reads and seeks are served from memory. Reads, bigger than a block (compressed image data), bypass the cache.
+ * 
+ * Passing 0 for either argument restores its default (64 KiB blocks, 8 blocks).
+ * The setting is process-wide and affects loads started after the call.
+**/
+DLL_API void DLL_CALLCONV FISidecar_SetIOCache(unsigned block_size, unsigned block_count);
+
+/** @brief Set the threads of the pool, shared by all loads (tile decoding, pixel copy, downscaling).
+ * 
+ * Concurrent loads do not multiply the threads - with 32 loads at the same time on a 16 core machine, there are still 16 threads.
+ * The thread, calling Load, works on its own image as well, so the pool has threads - 1 workers.
+ * 0 restores the default - the number of hardware threads. 
+ * The setting is process-wide. Loads in progress keep their share.
+**/
+DLL_API void DLL_CALLCONV FISidecar_SetThreadBudget(unsigned threads);
+
+/** @brief Region-of-interest and per-tile decoding. 
+ * 
+ * The file is opened (parsed) once, after which any part of the image can be decoded, without decoding the rest. 
+ * Grid images (iPhone HEIC are grids of 512x512 tiles) decode only the tiles, which intersect the requested region.
+ * Other images are a single tile - they are decoded whole, then cropped.
+ * 
+ * flags are the load flags - the thread limit, FISIDECAR_LOAD_HEIF_SDR, FISIDECAR_LOAD_HEIF_NCLX_TO_ICC and FISIDECAR_LOAD_HEIF_CACHED_IO apply.
+ * Coordinates are in the stored image, FISIDECAR_LOAD_HEIF_TRANSFORM is ignored. No metadata or thumbnail is attached.
+ * A memory stream, or a handle, must stay open until the image is closed. 
+ * Regions and tiles of the same image can be loaded from multiple threads at the same time.
+ * 
+ * @note Per-tile decoding requires libheif 1.19 or newer. With an older one, every image is a single tile.
+**/
+typedef struct FISIDECAR_IMAGE FISIDECAR_IMAGE;
+
+typedef struct {
+  unsigned width;           //< image size
+  unsigned height;
+  unsigned tile_width;      //< edge tiles may overhang the image
+  unsigned tile_height;
+  unsigned columns;
+  unsigned rows;
+  FREE_IMAGE_TYPE type;     //< of the loaded FIBITMAPs
+  unsigned bpp;
+} FISIDECAR_TILE_LAYOUT;
+
+DLL_API FISIDECAR_IMAGE* DLL_CALLCONV FISidecar_OpenImage(const char* filename, int flags FI_DEFAULT(0));
+DLL_API FISIDECAR_IMAGE* DLL_CALLCONV FISidecar_OpenImageFromMemory(FIMEMORY* stream, int flags FI_DEFAULT(0));
+DLL_API FISIDECAR_IMAGE* DLL_CALLCONV FISidecar_OpenImageFromHandle(FreeImageIO* io, fi_handle handle, int flags FI_DEFAULT(0));
+DLL_API void DLL_CALLCONV FISidecar_CloseImage(FISIDECAR_IMAGE* image);
+
+DLL_API BOOL DLL_CALLCONV FISidecar_GetTileLayout(FISIDECAR_IMAGE* image, FISIDECAR_TILE_LAYOUT* layout);
+
+/** @brief Loads the [left, right) x [top, bottom) part of the image (clipped to it), as FreeImage_Copy would cut it. Returns null on failure. **/
+DLL_API FIBITMAP* DLL_CALLCONV FISidecar_LoadRegion(FISIDECAR_IMAGE* image, int left, int top, int right, int bottom);
+
+/** @brief Decodes a single tile into dst, with its top-left corner at (dst_left, dst_top).
+ * 
+ * dst must be of the layout type and bpp and have room for the tile (edge tiles are clipped to the image). 
+**/
+DLL_API BOOL DLL_CALLCONV FISidecar_LoadTile(FISIDECAR_IMAGE* image, unsigned column, unsigned row, FIBITMAP* dst, int dst_left FI_DEFAULT(0), int dst_top FI_DEFAULT(0));
+
+/** @brief Receives the image in chunks, while it is being decoded - the full image is never created.
+ * 
+ * chunk is a FIBITMAP (of the layout type and bpp, no metadata), with its top-left corner at (left, top) in the image. 
+ * It is valid for the duration of the call only - it is recycled (see FISidecar_SetBitmapPool). Return FALSE to stop the load.
+ * The sink is called by one thread at a time, but not always the same one.
+**/
+typedef BOOL (DLL_CALLCONV *FISIDECAR_SINK)(FIBITMAP* chunk, unsigned left, unsigned top, void* user_data);
+
+#define FISIDECAR_SINK_ROWS                       0 //< Bands of band_height rows (the tile height, or 64, by default), top to bottom
+#define FISIDECAR_SINK_TILES                      1 //< Each tile as soon as it is done, in any order
+
+/** @brief Decodes the whole image, passing it to sink, piece by piece. Returns FALSE on failure, or if the sink stopped it. 
+ * 
+ * For grid images, only a row of tiles (FISIDECAR_SINK_ROWS) or max_threads tiles (FISIDECAR_SINK_TILES) is in memory at any time.
+ * Other images are decoded whole by libheif, then passed on without a copy of the full image - in bands, or as a single tile.
+**/
+DLL_API BOOL DLL_CALLCONV FISidecar_LoadToSink(FISIDECAR_IMAGE* image, FISIDECAR_SINK sink, void* user_data, int mode FI_DEFAULT(FISIDECAR_SINK_ROWS), unsigned band_height FI_DEFAULT(0));
+
+/** @brief Image properties, read from the container boxes only - nothing is decoded and no FIBITMAP is created.
+ * 
+ * Much cheaper than a FIF_LOAD_NOPIXELS load, for indexing many files. Describes the primary image.
+ * Cached IO (FISIDECAR_LOAD_HEIF_CACHED_IO) is always used for handles, files and memory are read directly.
+**/
+#define FISIDECAR_PROBE_MAX_METADATA 8
+
+#define FISIDECAR_PROFILE_NONE  0
+#define FISIDECAR_PROFILE_NCLX  1
+#define FISIDECAR_PROFILE_ICC   2
+
+typedef struct {
+  char type[16];            //< "Exif", "mime", etc.
+  char content_type[64];    //< for "mime", like "application/rdf+xml"
+  unsigned size;
+} FISIDECAR_METADATA_INFO;
+
+typedef struct {
+  FREE_IMAGE_FORMAT fif;    //< HEIF or AVIF (if registered)
+  unsigned width;           //< with the transformations applied (as with FISIDECAR_LOAD_HEIF_TRANSFORM)
+  unsigned height;
+  unsigned ispe_width;      //< as stored
+  unsigned ispe_height;
+  unsigned luma_bits;
+  unsigned chroma_bits;
+  BOOL has_alpha;
+  BOOL is_monochrome;
+  unsigned chroma;          //< 400, 420, 422, 444, or 0 if unknown
+  int profile;              //< FISIDECAR_PROFILE_*
+  unsigned thumbnails;
+  unsigned pages;           //< top-level images (see multipage)
+  unsigned tile_width;      //< a single tile (the stored size) for non-grid images
+  unsigned tile_height;
+  unsigned tile_columns;
+  unsigned tile_rows;
+  unsigned metadata_count;  //< all blocks, the first FISIDECAR_PROBE_MAX_METADATA are described below
+  FISIDECAR_METADATA_INFO metadata[FISIDECAR_PROBE_MAX_METADATA];
+} FISIDECAR_PROBE;
+
+DLL_API BOOL DLL_CALLCONV FISidecar_Probe(const char* filename, FISIDECAR_PROBE* info);
+DLL_API BOOL DLL_CALLCONV FISidecar_ProbeFromMemory(FIMEMORY* stream, FISIDECAR_PROBE* info);
+DLL_API BOOL DLL_CALLCONV FISidecar_ProbeFromHandle(FreeImageIO* io, fi_handle handle, FISIDECAR_PROBE* info);
+
+/** @brief Loads many files at once, spreading them over the threads of the pool (see FISidecar_SetThreadBudget).
+ * 
+ * Each item is a file name or a memory stream (if filename is null), with its load flags. 
+ * The format is detected, unless given, so any format FreeImage knows can be in the batch. 
+ * 
+ * The biggest files are started first. HEIF/AVIF files, smaller than their part of the budget (the total size / threads), 
+ * are loaded by one thread each - the parallelism is across the files. Bigger ones keep their thread limit, 
+ * and the threads, which run out of files, help with their tiles. 
+ * 
+ * Returns the number of loaded items. A failed item has a null dib and the last message of its load in error.
+**/
+typedef struct {
+  const char* filename;     //< in: the file, or
+  FIMEMORY* stream;         //<     the memory stream, if filename is null
+  int flags;                //< in: load flags
+  FREE_IMAGE_FORMAT fif;    //< in/out: FIF_UNKNOWN to detect
+  FIBITMAP* dib;            //< out: the image, owned by the caller, null on failure
+  char error[128];          //< out: empty on success
+} FISIDECAR_BATCH_ITEM;
+
+DLL_API unsigned DLL_CALLCONV FISidecar_LoadBatch(FISIDECAR_BATCH_ITEM* items, unsigned count);
+
+/** @brief Asynchronous loading with cooperative cancellation (no FreeImage-Adv needed).
+ * 
+ * FISidecar_LoadAsync queues the load and returns at once. The queued loads run in order on the shared pool (see FISidecar_SetThreadBudget), 
+ * each on a worker, which is free of other work - the asynchronous loads take no threads beyond the budget.
+ * The format is detected if fif is FIF_UNKNOWN. A memory stream must stay open until the load is finished.
+ * 
+ * FISidecar_CancelLoad asks the load to stop. HEIF/AVIF loads check it between their phases (reading, decoding, 
+ * each tile, metadata, thumbnail) - with libheif 1.19+ a running decode is interrupted too,
+ * before that it is not, so a canceled load stops within about a tile.
+ * Loads of other formats run to the end.
+ * 
+ * FISidecar_WaitLoad returns TRUE, if the load is done - 0 ms polls, FISIDECAR_WAIT_INFINITE waits until it is.
+ * FISidecar_GetLoadError returns the last message of a failed load (empty on success), or null while the load runs.
+ * FISidecar_FinishLoad waits for the load, frees the handle and returns the image - null if it failed or was canceled.
+ * Every started load must be finished.
+**/
+typedef struct FISIDECAR_ASYNC FISIDECAR_ASYNC;
+
+#define FISIDECAR_WAIT_INFINITE 0xFFFFFFFFu
+
+DLL_API FISIDECAR_ASYNC* DLL_CALLCONV FISidecar_LoadAsync(FREE_IMAGE_FORMAT fif, const char* filename, int flags FI_DEFAULT(0));
+DLL_API FISIDECAR_ASYNC* DLL_CALLCONV FISidecar_LoadFromMemoryAsync(FREE_IMAGE_FORMAT fif, FIMEMORY* stream, int flags FI_DEFAULT(0));
+DLL_API void DLL_CALLCONV FISidecar_CancelLoad(FISIDECAR_ASYNC* async);
+DLL_API BOOL DLL_CALLCONV FISidecar_WaitLoad(FISIDECAR_ASYNC* async, unsigned timeout_ms);
+DLL_API const char* DLL_CALLCONV FISidecar_GetLoadError(FISIDECAR_ASYNC* async);
+DLL_API FIBITMAP* DLL_CALLCONV FISidecar_FinishLoad(FISIDECAR_ASYNC* async);
+
+/** @brief Load statistics - where the time of a load went, per phase.
+ * 
+ * Collected for loads with FISIDECAR_LOAD_HEIF_STATS, or for all loads after FISidecar_EnableStats(TRUE). It costs a few clock reads.
+ * FISidecar_GetLoadStats returns the statistics of the last such load on the calling thread, FALSE if there was none.
+ * (Batch and asynchronous loads run on other threads, they are only in the totals.)
+ * FISidecar_GetStatsTotals returns the sums over all such loads in the process, optionally starting over.
+ * 
+ * All times are wall clock. Grid images, decoded by the plugin tile by tile, decode and copy the tiles in turn on each thread -
+ * the time of the whole tile loop is split between decode_ms and copy_ms in the ratio of their sums over the threads.
+**/
+#define FISIDECAR_IO_READER   0 //< FreeImageIO callbacks, the io_ counters apply
+#define FISIDECAR_IO_MEMORY   1 //< FIMEMORY buffer, no reads
+#define FISIDECAR_IO_MAPPED   2 //< mapped file, no reads
+
+typedef struct {
+  BOOL succeeded;
+  int fif;
+  double total_ms;
+  double read_ms;           //< parsing the container
+  double decode_ms;         //< heif_decode_image, or the tiles
+  double copy_ms;           //< into the FIBITMAP, downscaling included
+  double icc_ms;            //< the color profile, NCLX to ICC conversion included
+  double metadata_ms;
+  double thumbnail_ms;      //< decoded and attached (all its phases)
+  unsigned io_kind;         //< FISIDECAR_IO_*
+  unsigned long long io_reads;  //< calls to the FreeImageIO (after the block cache, if any)
+  unsigned long long io_seeks;
+  unsigned long long io_bytes;
+  unsigned tiles;           //< decoded by the plugin, 0 if libheif decoded the image at once
+  unsigned threads;         //< the most threads of the plugin, working at the same time (libheif's own are not counted)
+} FISIDECAR_LOAD_STATS;
+
+typedef struct {
+  unsigned long long loads;
+  unsigned long long failed;
+  double total_ms;
+  double read_ms;
+  double decode_ms;
+  double copy_ms;
+  double icc_ms;
+  double metadata_ms;
+  double thumbnail_ms;
+  unsigned long long io_reads;
+  unsigned long long io_seeks;
+  unsigned long long io_bytes;
+  unsigned long long tiles;
+} FISIDECAR_STATS_TOTALS;
+
+DLL_API void DLL_CALLCONV FISidecar_EnableStats(BOOL enable);
+DLL_API BOOL DLL_CALLCONV FISidecar_GetLoadStats(FISIDECAR_LOAD_STATS* stats);
+DLL_API void DLL_CALLCONV FISidecar_GetStatsTotals(FISIDECAR_STATS_TOTALS* totals, BOOL reset FI_DEFAULT(FALSE));
+
+/** @brief Loading without allocating the image.
+ * 
+ * FISidecar_LoadInto decodes a HEIF/AVIF image into dst, which must be of the type, size and bpp, the load would create 
+ * (see FISidecar_Probe, or load with FIF_LOAD_NOPIXELS). With FISIDECAR_LOAD_HEIF_THUMBNAIL_ONLY or scale-on-load, that is the size of the result.
+ * The metadata, ICC profile and thumbnail of dst are replaced. Returns FALSE on failure - dst might be partially overwritten then.
+ * 
+ * The bitmap pool recycles whole bitmaps between loads instead: FISidecar_RecycleBitmap (in place of FreeImage_Unload) keeps a bitmap, 
+ * and a later load, of the same type, size and bpp, takes it, instead of allocating a new one. The thumbnails, attached by a load, are recycled as well.
+ * FISidecar_SetBitmapPool sets the most memory the pool keeps (the oldest bitmaps are dropped first), 0 (the default) disables it.
+ * Recycle only bitmaps, which own their pixels (not views).
+**/
+DLL_API BOOL DLL_CALLCONV FISidecar_LoadInto(FIBITMAP* dst, FREE_IMAGE_FORMAT fif, const char* filename, int flags FI_DEFAULT(0));
+DLL_API BOOL DLL_CALLCONV FISidecar_LoadIntoFromMemory(FIBITMAP* dst, FREE_IMAGE_FORMAT fif, FIMEMORY* stream, int flags FI_DEFAULT(0));
+DLL_API void DLL_CALLCONV FISidecar_SetBitmapPool(unsigned megabytes);
+DLL_API void DLL_CALLCONV FISidecar_RecycleBitmap(FIBITMAP* dib);
+
+/** @brief Incremental loading, from a file, which is still arriving (upload, download).
+ * 
+ * The producer pushes the bytes as they come (FISidecar_PushStream) and ends the stream, when all are there - or if the transfer fails.
+ * Meanwhile, the consumer loads the parts of the image, each call waiting only for the bytes it needs:
+ * 
+ *  - FISidecar_LoadStreamHeader    - as with FIF_LOAD_NOPIXELS (size, metadata, ICC profile), as soon as the container is in 
+ *  - FISidecar_LoadStreamThumbnail - the embedded thumbnail (8 bit), as soon as its data is in, null if there is none
+ *  - FISidecar_LoadStream          - the image (with metadata, without thumbnail), once its data is in
+ * 
+ * flags are the load flags (FISIDECAR_LOAD_HEIF_*). expected_size is the size of the file, if known (Content-Length), else 0.
+ * libheif needs to know where the file ends to finish reading the container - without the size, even the header waits for the end of the stream.
+ * 
+ * The producer and the consumer can be different threads. The loads of one stream run one at a time. 
+ * End the stream, before closing it, to release a waiting load.
+**/
+typedef struct FISIDECAR_STREAM FISIDECAR_STREAM;
+
+DLL_API FISIDECAR_STREAM* DLL_CALLCONV FISidecar_OpenStream(unsigned long long expected_size, int flags FI_DEFAULT(0));
+DLL_API BOOL DLL_CALLCONV FISidecar_PushStream(FISIDECAR_STREAM* stream, const void* data, unsigned size);
+DLL_API void DLL_CALLCONV FISidecar_EndStream(FISIDECAR_STREAM* stream);
+DLL_API void DLL_CALLCONV FISidecar_CloseStream(FISIDECAR_STREAM* stream);
+DLL_API FIBITMAP* DLL_CALLCONV FISidecar_LoadStreamHeader(FISIDECAR_STREAM* stream);
+DLL_API FIBITMAP* DLL_CALLCONV FISidecar_LoadStreamThumbnail(FISIDECAR_STREAM* stream);
+DLL_API FIBITMAP* DLL_CALLCONV FISidecar_LoadStream(FISIDECAR_STREAM* stream);
+
+/** @brief Sets the output profile of FISIDECAR_LOAD_HEIF_TO_SRGB (an RGB ICC profile), for all loads. Null restores sRGB. 
+ * Returns FALSE, if the profile is not a valid RGB one, or lcms2 is not available.
+**/
+DLL_API BOOL DLL_CALLCONV FISidecar_SetOutputProfile(const void* icc, unsigned size);
+
+/** @brief Decoder backend selection, per format (FIF of HEIF or AVIF), for builds of libheif with several decoders (libde265/ffmpeg, dav1d/libaom).
+ * 
+ * FISidecar_GetDecoders fills up to count decoders, available for the format, in libheif's order of priority - the first is its default choice.
+ * Returns the number of the available ones (call with null to size the array), 0 for the other formats or libheif before 1.15.
+ * 
+ * FISidecar_SetDecoder sets the decoder (FISIDECAR_DECODER_INFO::id) of the format for all loads, FISidecar_SetThreadDecoder for the loads on
+ * the calling thread only - including the batch and asynchronous loads it starts, and taking precedence over the global one.
+ * Null or "" goes back to the global choice, or libheif's. Returns FALSE, if the decoder is not available for the format.
+ * FISidecar_DeInitialise resets both to libheif's choice.
+**/
+typedef struct {
+  char id[32];              //< to pass to FISidecar_SetDecoder, e.g. "dav1d", "aom", "libde265"
+  char name[128];           //< human-readable, with the version
+  BOOL is_default;          //< libheif's choice
+} FISIDECAR_DECODER_INFO;
+
+DLL_API unsigned DLL_CALLCONV FISidecar_GetDecoders(FREE_IMAGE_FORMAT fif, FISIDECAR_DECODER_INFO* decoders, unsigned count);
+DLL_API BOOL DLL_CALLCONV FISidecar_SetDecoder(FREE_IMAGE_FORMAT fif, const char* id);
+DLL_API BOOL DLL_CALLCONV FISidecar_SetThreadDecoder(FREE_IMAGE_FORMAT fif, const char* id);
+
 #ifdef __cplusplus
 }
 #endif
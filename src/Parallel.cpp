@@ -0,0 +1,238 @@
+#include "Parallel.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <system_error>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <iterator>
+#include <exception>
+
+namespace {
+
+struct Job
+{
+  const std::function<void(unsigned)>* body;
+  unsigned count;
+  unsigned max_helpers;
+  unsigned helpers;               //< guarded by the pool mutex
+  unsigned peak_helpers;          //< ditto, the most helpers at the same time
+  std::atomic<unsigned> next;
+  std::mutex error_mutex;         //< guards the below
+  std::exception_ptr error;       //< the first exception of a body, rethrown on the calling thread
+
+  void run() {
+    try {
+      for(auto i = this->next++; i < this->count; i = this->next++)
+        (*this->body)(i);
+    } catch(...) {
+      this->next = this->count; //< skip the rest, the job failed
+      std::lock_guard<std::mutex> lock(this->error_mutex);
+      if(! this->error)
+        this->error = std::current_exception();
+    }
+  }
+  bool has_work() const { return this->next.load(std::memory_order_relaxed) < this->count; }
+};
+
+unsigned default_budget() {
+  const auto threads = std::thread::hardware_concurrency();
+  return threads ? threads : 4;
+}
+
+class Pool
+{
+public:
+  Pool() : budget_(default_budget()), target_{} {}
+
+  ~Pool() {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      this->target_ = 0;
+    }
+    this->wake_.notify_all();
+    for(auto& worker : this->workers_) {
+#if defined(_WIN32)
+      worker.detach(); //< joining during DLL unload deadlocks on the loader lock
+#else
+      worker.join();
+#endif
+    }
+  }
+
+  unsigned budget() const { return this->budget_.load(std::memory_order_relaxed); }
+
+  void set_budget(unsigned threads) {
+    std::lock_guard<std::mutex> resize_lock(this->resize_mutex_);
+    this->budget_.store(threads ? threads : default_budget(), std::memory_order_relaxed);
+
+    // The workers are created on first use, a resize only ends the extra ones
+    std::vector<std::thread> extra;
+    {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      this->target_ = std::min<unsigned>(this->target_, std::max(this->budget() - 1, this->tasks_.empty() ? 0u : 1u));
+      if(this->workers_.size() > this->target_) {
+        std::move(this->workers_.begin() + this->target_, this->workers_.end(), std::back_inserter(extra));
+        this->workers_.resize(this->target_);
+      }
+    }
+    this->wake_.notify_all();
+    for(auto& worker : extra)
+      worker.join();
+  }
+
+  unsigned share(unsigned count, unsigned max_threads) {
+    unsigned jobs;
+    {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      jobs = unsigned(this->jobs_.size());
+    }
+    const auto fair = std::max(1u, this->budget() / (jobs + 1));
+    return std::max(1u, std::min({max_threads, count, fair}));
+  }
+
+  void run(Job& job) {
+    // Whatever happens, the job (on the stack of the caller) leaves the list, and the helpers are done with it, before returning
+    struct Retire
+    {
+      Pool& pool;
+      Job& job;
+      bool listed;
+      ~Retire() {
+        if(! this->listed)
+          return;
+        std::unique_lock<std::mutex> lock(this->pool.mutex_);
+        this->pool.jobs_.erase(std::find(this->pool.jobs_.begin(), this->pool.jobs_.end(), &this->job));
+        this->pool.finished_.wait(lock, [&] { return this->job.helpers == 0; });
+      }
+    } retire{*this, job, false};
+
+    if(job.max_helpers) {
+      this->start_workers();
+      {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        this->jobs_.push_back(&job);
+        retire.listed = true;
+      }
+      this->wake_.notify_all();
+    }
+
+    job.run(); //< the caller works on its own job
+  }
+
+  void post(std::function<void()> task) {
+    this->start_workers(1);
+
+    {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      if(this->workers_.empty())
+        throw std::system_error(std::make_error_code(std::errc::resource_unavailable_try_again), "No pool worker");
+      this->tasks_.push_back(std::move(task));
+    }
+    this->wake_.notify_one();
+  }
+
+private:
+  void start_workers(unsigned min_workers = 0) {
+    std::lock_guard<std::mutex> resize_lock(this->resize_mutex_);
+    const auto wanted = std::max(this->budget() - 1, min_workers); //< the calling threads do their part
+
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    if(this->workers_.size() >= wanted)
+      return;
+
+    this->target_ = wanted;
+    while(this->workers_.size() < wanted) {
+      try {
+        this->workers_.emplace_back(&Pool::work, this, unsigned(this->workers_.size()));
+      } catch(const std::system_error&) {
+        this->target_ = unsigned(this->workers_.size()); //< out of threads, the others will do the work
+        break;
+      }
+    }
+  }
+
+  // The job with work left and the fewest helpers, so that concurrent loads progress evenly
+  Job* pick() const {
+    Job* best{};
+    for(auto* job : this->jobs_) {
+      if(job->has_work() && job->helpers < job->max_helpers && (! best || job->helpers < best->helpers))
+        best = job;
+    }
+    return best;
+  }
+
+  void work(unsigned index) {
+    std::unique_lock<std::mutex> lock(this->mutex_);
+    while(index < this->target_) {
+      auto* job = this->pick();
+      if(! job && ! this->tasks_.empty()) {
+        // The running jobs first, then a new task - the worker is the calling thread of the task's own jobs, until it is done
+        auto task = std::move(this->tasks_.front());
+        this->tasks_.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+        continue;
+      }
+      if(! job) {
+        this->wake_.wait(lock);
+        continue;
+      }
+
+      job->peak_helpers = std::max(job->peak_helpers, ++job->helpers);
+      lock.unlock();
+      job->run();
+      lock.lock();
+
+      if(--job->helpers == 0)
+        this->finished_.notify_all();
+    }
+  }
+
+  std::atomic<unsigned> budget_;
+
+  std::mutex resize_mutex_;   //< serializes the worker creation and removal
+  std::mutex mutex_;          //< guards the below
+  std::condition_variable wake_;
+  std::condition_variable finished_;
+  std::vector<std::thread> workers_;
+  std::vector<Job*> jobs_;
+  std::deque<std::function<void()>> tasks_;  //< waiting for a worker, see parallel_post
+  unsigned target_;           //< workers with a bigger index end
+};
+
+Pool& pool() {
+  static Pool pool;
+  return pool;
+}
+
+} // namespace
+
+unsigned parallel_for(unsigned count, unsigned max_threads, const std::function<void(unsigned)>& body) {
+  const auto threads = count > 1 ? pool().share(count, max_threads) : 1;
+
+  Job job{&body, count, threads - 1, 0, 0, {0}};
+  pool().run(job);
+  if(job.error)
+    std::rethrow_exception(job.error); //< no lock needed, the helpers are done
+  return 1 + job.peak_helpers; //< ditto
+}
+
+void parallel_post(std::function<void()> task) {
+  pool().post(std::move(task));
+}
+
+unsigned parallel_share(unsigned count, unsigned max_threads) {
+  return pool().share(count, max_threads);
+}
+
+void parallel_set_budget(unsigned threads) {
+  pool().set_budget(threads);
+}
+
+unsigned parallel_budget() {
+  return pool().budget();
+}
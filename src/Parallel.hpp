@@ -0,0 +1,31 @@
+#pragma once
+
+#include <functional>
+
+/** @brief Runs body(i) for each i in [0, count), using up to max_threads threads, the calling one included.
+ *
+ * The work runs on a process-wide worker pool, shared by all loads, so that concurrent loads do not multiply the threads.
+ * The calling thread works on its own job, idle workers take indices from all running jobs (dynamically, so uneven work, tiles, is balanced).
+ * How many workers help a job depends on the pool load, see parallel_share.
+ * Returns after all the calls are done, with the number of threads, which took part (the calling one included).
+ * If body throws (on any thread), the indices not yet started are skipped, and the first exception is rethrown on the calling thread,
+ * once no thread runs the job any more.
+**/
+unsigned parallel_for(unsigned count, unsigned max_threads, const std::function<void(unsigned)>& body);
+
+/** @brief Runs task on a worker of the pool, once one is free of parallel_for jobs - returns at once.
+ *
+ * The worker runs the task to the end, being the calling thread of the task's parallel_for jobs, so the tasks take no threads
+ * beyond the budget (at least one worker runs them, even with a budget of 1). Tasks start in the order they were posted.
+ * task must not throw. Throws std::bad_alloc, or std::system_error, if there is no worker to run it.
+**/
+void parallel_post(std::function<void()> task);
+
+/** @brief The threads (the calling one included), a job of count tasks would get now - at most max_threads,
+ * at most count and an equal part of the budget, split between the running jobs and this one.
+**/
+unsigned parallel_share(unsigned count, unsigned max_threads);
+
+/** @brief Sets the threads of the pool, shared by all loads (see FISidecar_SetThreadBudget). 0 restores the default (the hardware threads). **/
+void parallel_set_budget(unsigned threads);
+unsigned parallel_budget();
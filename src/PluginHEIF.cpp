@@ -1,12 +1,35 @@
 #include "PluginHEIF.hpp"
 #include "FISidecar.h"
+#include "FIIO.hpp"
+#include "Swizzle.hpp"
+#include "Downsample.hpp"
+#include "YCbCr.hpp"
+#include "Parallel.hpp"
+#include "BitmapPool.hpp"
+#include "Startup.hpp"
 #include <cstring>
+#include <cstdarg>
+#include <cstdio>
 #include <cmath> //< std::lerp
 #include <cassert>
 #include "libheif/heif.h"
 #include <iostream>
 #include "Utilities.h"
 #include <bitset>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <system_error>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <tuple>
+#include <memory>
+#include <new>
 
 #if ! defined(FI_ADV)
 #include "unique_resource.h"
@@ -16,6 +39,41 @@
 #include "lcms2.h"
 #endif
 
+// Per-tile decoding API (heif_image_handle_decode_image_tile)
+#if defined(LIBHEIF_HAVE_VERSION)
+#if LIBHEIF_HAVE_VERSION(1, 19, 0)
+#define FISIDECAR_HAS_HEIF_TILES
+#endif
+#endif
+
+// Grid encoding (heif_context_encode_grid)
+#if defined(LIBHEIF_HAVE_VERSION)
+#if LIBHEIF_HAVE_VERSION(1, 18, 0)
+#define FISIDECAR_HAS_HEIF_ENCODE_GRID
+#endif
+#endif
+
+// Grids of any image size, the last tile row and column cropped (heif_context_add_grid_image, heif_context_add_image_tile)
+#if defined(LIBHEIF_HAVE_VERSION)
+#if LIBHEIF_HAVE_VERSION(1, 19, 0)
+#define FISIDECAR_HAS_HEIF_ADD_GRID
+#endif
+#endif
+
+// Interrupting a running decode (heif_decoding_options::cancel_decoding)
+#if defined(LIBHEIF_HAVE_VERSION)
+#if LIBHEIF_HAVE_VERSION(1, 19, 0)
+#define FISIDECAR_HAS_HEIF_CANCEL
+#endif
+#endif
+
+// Decoder selection (heif_decoding_options::decoder_id, heif_get_decoder_descriptors)
+#if defined(LIBHEIF_HAVE_VERSION)
+#if LIBHEIF_HAVE_VERSION(1, 15, 0)
+#define FISIDECAR_HAS_HEIF_DECODER_ID
+#endif
+#endif
+
 namespace {
 
 template <typename T> 
@@ -82,16 +140,47 @@ using Args = const FreeImageLoadArgs*;
 using Args = int;
 #endif
 
+// When set, the messages of the loads, running on this thread, are also kept here (the last one wins) - see LoadBatch
+thread_local std::string* s_message_sink;
+
+// When set, the loads, running on this thread, stop between their phases once it is true - see LoadAsync
+thread_local const std::atomic<bool>* s_cancel_token;
+
+// When set, the pixels of the next image, loaded on this thread, go into it (through a view) - see LoadInto
+thread_local FIBITMAP* s_target_dib;
+thread_local bool s_target_used;
+
+void captureMessage(const char* fmt, ...) {
+  char buffer[256];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buffer, sizeof(buffer), fmt, args);
+  va_end(args);
+  *s_message_sink = buffer;
+}
+
 struct output_msg_t {
 Args args;
 int format_id;
 #ifdef FI_ADV
 class Progress* progress;
+#endif
+const std::atomic<bool>* cancel; //< cooperative cancellation, null if the load can not be canceled
+FISIDECAR_LOAD_STATS* stats;     //< null, unless collected
+#ifdef FI_ADV
 template<class... Args>
-void operator()(const char* fmt, Args&&... a) const { FreeImage_OutputMessageProcCB(args->cb, format_id, fmt, std::forward<Args>(a)...); }
+void operator()(const char* fmt, Args&&... a) const {
+  if(s_message_sink)
+    captureMessage(fmt, a...);
+  FreeImage_OutputMessageProcCB(args->cb, format_id, fmt, std::forward<Args>(a)...);
+}
 #else
 template<class... Args>
-void operator()(const char* fmt, Args&&... args) const { FreeImage_OutputMessageProc(format_id, fmt, std::forward<Args>(args)...); }
+void operator()(const char* fmt, Args&&... args) const {
+  if(s_message_sink)
+    captureMessage(fmt, args...);
+  FreeImage_OutputMessageProc(format_id, fmt, std::forward<Args>(args)...);
+}
 #endif
 };
 
@@ -140,6 +229,7 @@ bool convertNCLXtoICC(const heif_color_profile_nclx& nclx, void** data, unsigned
   unique_curve curve_storage{curve, &cmsFreeToneCurve};
 
   cmsToneCurve* const curves[3] {curve, curve, curve};
+  auto ok = true;
   if(auto profile = cmsCreateRGBProfile(&whitepoint, &primaries, curves)) {
 
     auto description = cmsMLUalloc({}, 1);
@@ -153,94 +243,347 @@ bool convertNCLXtoICC(const heif_color_profile_nclx& nclx, void** data, unsigned
       *size_ = size;
       if (! *data) {
         output_msg("Out of memory for color profile");
+        ok = false;
       } else if(! cmsSaveProfileToMem(profile, *data, &size)) {
         output_msg("Failed to save ICC profile");
         free(*data);
+        *data = nullptr;
+        ok = false;
       }
     }
 
     cmsCloseProfile(profile);
   }
 
-  return true;
+  return ok;
 #else
   return false;
 #endif
 }
 
-struct FIIO
-{
-  FIIO(FreeImageIO* io, fi_handle handle) 
-    : io(io)
-    , handle(handle)
+// Serialized ICC profile, empty if none is needed
+using icc_ptr = std::shared_ptr<const std::vector<BYTE>>;
+
+// Memoized convertNCLXtoICC - real-life files use just a few combinations, so lcms runs once per combination.
+// Returns null if the conversion is not available, or failed.
+icc_ptr getICCFromNCLX(const heif_color_profile_nclx& nclx, const output_msg_t& output_msg) {
+  static const size_t max_entries = 64; //< a safety net, in practice there are a handful
+
+  const auto key = std::make_tuple(int(nclx.color_primaries), int(nclx.transfer_characteristics)
+    , nclx.color_primary_red_x, nclx.color_primary_red_y
+    , nclx.color_primary_green_x, nclx.color_primary_green_y
+    , nclx.color_primary_blue_x, nclx.color_primary_blue_y
+    , nclx.color_primary_white_x, nclx.color_primary_white_y);
+
+  static std::mutex mutex; //< guards the below
+  static std::map<decltype(key), icc_ptr> cache;
+
   {
-    const auto start_pos = io->tell_proc(handle);
-    io->seek_proc(handle, 0, SEEK_END);
-    this->file_size = io->tell_proc(handle) - start_pos;
-    io->seek_proc(handle, start_pos, SEEK_SET);
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto it = cache.find(key);
+    if(it != cache.end())
+      return it->second;
   }
-  FreeImageIO* io;
-  fi_handle handle;
 
-  int64_t file_size;
-};
+  void* data{};
+  unsigned long size{};
+  if(! convertNCLXtoICC(nclx, &data, &size, output_msg))
+    return {};
+
+  unique_mem data_storage{data};
+  const auto* bytes = static_cast<const BYTE*>(data);
+  const auto icc = std::make_shared<const std::vector<BYTE>>(bytes, bytes + (data ? size : 0));
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if(cache.size() >= max_entries)
+    cache.clear();
+  return cache.emplace(key, icc).first->second;
+}
+
+bool isCanceled(const output_msg_t& output_msg) {
+  return output_msg.cancel && output_msg.cancel->load(std::memory_order_relaxed);
+}
+
+#if defined(FISIDECAR_HAS_HEIF_CANCEL)
+int cancel_decoding(void* progress_user_data) {
+  return static_cast<const std::atomic<bool>*>(progress_user_data)->load(std::memory_order_relaxed);
+}
+#endif
+
+// Lets libheif stop a running decode, when the load is canceled (libheif 1.19+) - the checks between the phases remain the fallback.
+// The token goes in progress_user_data, so not while the FI_ADV progress has it.
+void setCancelHook(heif_decoding_options* opts, const output_msg_t& output_msg) {
+#if defined(FISIDECAR_HAS_HEIF_CANCEL)
+  if(output_msg.cancel && ! opts->progress_user_data) {
+    opts->cancel_decoding = cancel_decoding;
+    opts->progress_user_data = const_cast<std::atomic<bool>*>(output_msg.cancel);
+  }
+#else
+  (void) opts, (void) output_msg;
+#endif
+}
 
-struct FIIO_reader : heif_reader
+// --- load statistics
+
+using stats_clock = std::chrono::steady_clock;
+using stats_field = double FISIDECAR_LOAD_STATS::*;
+
+double elapsedMs(stats_clock::time_point start, stats_clock::time_point end) {
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Adds the time of its scope to a field of the statistics, if collected
+class StatsTimer
 {
-  FIIO_reader() 
-    : heif_reader{1, &get_position, &read, &seek, &wait_for_file_size}
+public:
+  StatsTimer(const output_msg_t& output_msg, stats_field field)
+    : stats_(output_msg.stats)
+    , field_(field)
+    , start_(output_msg.stats ? stats_clock::now() : stats_clock::time_point{})
   {}
+  ~StatsTimer() { this->stop(); }
 
-  static int64_t get_position(void* userdata) {
-    auto fio = static_cast<FIIO*>(userdata);
-    
-    return fio->io->tell_proc(fio->handle);
+  StatsTimer(const StatsTimer&) = delete;
+  StatsTimer& operator=(const StatsTimer&) = delete;
+
+  void stop() {
+    if(this->stats_)
+      this->stats_->*this->field_ += elapsedMs(this->start_, stats_clock::now());
+    this->stats_ = {};
+  }
+
+private:
+  FISIDECAR_LOAD_STATS* stats_;
+  stats_field field_;
+  stats_clock::time_point start_;
+};
+
+void addThreads(const output_msg_t& output_msg, unsigned threads) {
+  if(output_msg.stats)
+    output_msg.stats->threads = std::max(output_msg.stats->threads, threads);
+}
+
+std::atomic<bool> s_stats_enabled{false};
+
+thread_local bool s_has_last_stats;
+thread_local FISIDECAR_LOAD_STATS s_last_stats;
+
+std::mutex s_totals_mutex; //< guards the below
+FISIDECAR_STATS_TOTALS s_totals;
+
+void publishStats(const FISIDECAR_LOAD_STATS& stats) {
+  s_last_stats = stats;
+  s_has_last_stats = true;
+
+  std::lock_guard<std::mutex> lock(s_totals_mutex);
+  auto& totals = s_totals;
+  totals.loads++;
+  totals.failed += stats.succeeded ? 0 : 1;
+  totals.total_ms += stats.total_ms;
+  totals.read_ms += stats.read_ms;
+  totals.decode_ms += stats.decode_ms;
+  totals.copy_ms += stats.copy_ms;
+  totals.icc_ms += stats.icc_ms;
+  totals.metadata_ms += stats.metadata_ms;
+  totals.thumbnail_ms += stats.thumbnail_ms;
+  totals.io_reads += stats.io_reads;
+  totals.io_seeks += stats.io_seeks;
+  totals.io_bytes += stats.io_bytes;
+  totals.tiles += stats.tiles;
+}
+
+// --- color management (FISIDECAR_LOAD_HEIF_TO_SRGB)
+
+#if defined(FISIDECAR_HAS_LCMS)
+
+using unique_profile = unique_ptr<void, cmsBool (*)(cmsHPROFILE)>;
+using transform_ptr = std::shared_ptr<void>; //< cmsHTRANSFORM
+
+// sRGB, serialized once
+icc_ptr getSRGBProfile() {
+  static const icc_ptr srgb = [] {
+    auto icc = std::make_shared<std::vector<BYTE>>();
+    unique_profile profile{cmsCreate_sRGBProfile(), &cmsCloseProfile};
+    cmsUInt32Number size{};
+    if(profile && cmsSaveProfileToMem(profile.get(), {}, &size)) {
+      icc->resize(size);
+      if(! cmsSaveProfileToMem(profile.get(), icc->data(), &size))
+        icc->clear();
+    }
+    return icc_ptr{icc};
+  }();
+  return srgb;
+}
+
+std::mutex s_output_mutex;      //< guards the below
+icc_ptr s_output_profile;       //< null for sRGB
+unsigned s_output_generation{}; //< of the cached transforms
+
+// The output profile (sRGB, unless set) and its generation
+icc_ptr getOutputProfile(unsigned& generation) {
+  std::lock_guard<std::mutex> lock(s_output_mutex);
+  generation = s_output_generation;
+  return s_output_profile;
+}
+
+// FNV-1a of a profile - the transform cache compares the bytes only, when it matches
+uint64_t hashProfile(const std::vector<BYTE>& icc) {
+  uint64_t hash = 14695981039346656037ull;
+  for(const auto byte : icc)
+    hash = (hash ^ byte) * 1099511628211ull;
+  return hash;
+}
+
+// Memoized transforms from a source profile to the output one, per pixel format. Made with cmsFLAGS_NOCACHE, 
+// so that the threads of a load can share them.
+transform_ptr getTransform(const icc_ptr& source, const icc_ptr& target, unsigned generation, cmsUInt32Number format, const output_msg_t& output_msg) {
+  static const size_t max_entries = 32; //< a safety net, in practice there are a handful
+
+  struct Entry
+  {
+    icc_ptr source;
+    transform_ptr transform;
+  };
+
+  const auto key = std::make_tuple(hashProfile(*source), source->size(), generation, format);
+
+  static std::mutex mutex; //< guards the below
+  static std::map<decltype(key), Entry> cache;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto it = cache.find(key);
+    if(it != cache.end() && (it->second.source == source || *it->second.source == *source))
+      return it->second.transform;
   }
 
-  // The functions read(), and seek() return 0 on success.
-  // Generally, libheif will make sure that we do not read past the file size.
-  static int read(void* data,
-               size_t size,
-               void* userdata) {
-    auto fio = static_cast<FIIO*>(userdata);
+  unique_profile in{cmsOpenProfileFromMem(source->data(), cmsUInt32Number(source->size())), &cmsCloseProfile};
+  unique_profile out{cmsOpenProfileFromMem(target->data(), cmsUInt32Number(target->size())), &cmsCloseProfile};
+  if(! in || ! out || cmsGetColorSpace(in.get()) != cmsSigRgbData) {
+    output_msg("Color profile can not be converted");
+    return {};
+  }
 
-    return int(fio->io->read_proc(data, 1, size, fio->handle) != size); 
+  // In place, lcms leaves alpha (the extra channel) as it is
+  auto* transform = cmsCreateTransform(in.get(), format, out.get(), format, INTENT_PERCEPTUAL, cmsFLAGS_NOCACHE);
+  if(! transform) {
+    output_msg("Failed to create color transform");
+    return {};
   }
+  transform_ptr transform_storage{transform, &cmsDeleteTransform};
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if(cache.size() >= max_entries)
+    cache.clear();
+  cache[key] = Entry{source, transform_storage}; //< replaces a colliding profile, if any
+  return transform_storage;
+}
 
-  static int seek(int64_t position,
-               void* userdata) {
-    auto fio = static_cast<FIIO*>(userdata);
+cmsUInt32Number getTransformFormat(FIBITMAP* dib) {
+  const auto isBGR = FI_RGBA_RED == 2;
+  switch(FreeImage_GetImageType(dib)) {
+    case FIT_BITMAP:
+      switch(FreeImage_GetBPP(dib)) {
+        case 24: return isBGR ? TYPE_BGR_8 : TYPE_RGB_8;
+        case 32: return isBGR ? TYPE_BGRA_8 : TYPE_RGBA_8;
+      }
+      break;
+    case FIT_RGB16:  return TYPE_RGB_16;
+    case FIT_RGBA16: return TYPE_RGBA_16;
+    default:
+      break;
+  }
+  return 0;
+}
 
-    return fio->io->seek_proc(fio->handle, position, SEEK_SET);
+// The profile of the image - the embedded ICC, or the one, made from NCLX. Empty, if it is sRGB (or as good as), null if there is none.
+icc_ptr getSourceProfile(const heif_image_handle* himage, const output_msg_t& output_msg) {
+  switch(heif_image_handle_get_color_profile_type(himage)) {
+    case heif_color_profile_type_nclx: {
+      heif_color_profile_nclx* nclx{};
+      if(heif_image_handle_get_nclx_color_profile(himage, &nclx).code)
+        return {};
+      unique_ptr<heif_color_profile_nclx, void (*)(heif_color_profile_nclx*)> nclx_storage{nclx, &heif_nclx_color_profile_free};
+      return getICCFromNCLX(*nclx, output_msg);
+    }
+    case heif_color_profile_type_rICC:
+    case heif_color_profile_type_prof: {
+      auto icc = std::make_shared<std::vector<BYTE>>(heif_image_handle_get_raw_color_profile_size(himage));
+      if(heif_image_handle_get_raw_color_profile(himage, icc->data()).code)
+        return {};
+      return icc;
+    }
+    default:
+      return {};
   }
+}
 
-  // "When calling this function, libheif wants to make sure that it can read the file
-  // up to 'target_size'. This is useful when the file is currently downloaded and may
-  // grow with time. You may, for example, extract the image sizes even before the actual
-  // compressed image data has been completely downloaded.
-  //
-  // Even if your input files will not grow, you will have to implement at least
-  // detection whether the target_size is above the (fixed) file length
-  // (in this case, return 'size_beyond_eof')." libheif
+#endif // FISIDECAR_HAS_LCMS
 
-  // Note, this function could be used to implement cached IO (reading bigger chunks instead of 1-2 bytes at a time). 
-  // What complicates things is the use of seek to move around the file.
-  static heif_reader_grow_status wait_for_file_size(int64_t target_size, void* userdata) {
-    auto fio = static_cast<FIIO*>(userdata);
-    
-    return (target_size > fio->file_size) 
-      ? heif_reader_grow_status_size_beyond_eof 
-      : heif_reader_grow_status_size_reached;
+// Converts the pixels from the profile of the image to the output one (in bands of rows, in parallel) and attaches the latter
+void convertToOutputProfile(const heif_image_handle* himage, FIBITMAP* dib, unsigned max_threads, const output_msg_t& output_msg) {
+#if defined(FISIDECAR_HAS_LCMS)
+  unsigned generation;
+  auto target = getOutputProfile(generation);
+  auto source = getSourceProfile(himage, output_msg);
+
+  // Untagged images are taken for sRGB - already in the default output profile, which only needs to be attached
+  if(! source || source->empty()) {
+    if(! target) {
+      const auto srgb = getSRGBProfile();
+      if(! srgb->empty()) {
+        FreeImage_DestroyICCProfile(dib);
+        FreeImage_CreateICCProfile(dib, const_cast<BYTE*>(srgb->data()), long(srgb->size()));
+      }
+      return;
+    }
+    source = getSRGBProfile();
   }
-};
+  if(! target)
+    target = getSRGBProfile();
+
+  const auto format = getTransformFormat(dib);
+  if(! format || source->empty() || target->empty())
+    return;
+
+  auto transform = getTransform(source, target, generation, format, output_msg);
+  if(! transform)
+    return;
+
+  // lcms does a lot more per byte than a swizzle, so the bands are smaller
+  static const size_t min_bytes_per_band = 1 << 18;
+  const auto width = FreeImage_GetWidth(dib);
+  const auto height = FreeImage_GetHeight(dib);
+  const auto pitch = FreeImage_GetPitch(dib);
+  auto* bits = FreeImage_GetBits(dib);
+  const auto bands = unsigned(std::max<size_t>(1, std::min<size_t>({max_threads, height, size_t(pitch) * height / min_bytes_per_band})));
+  const auto rows_per_band = (height + bands - 1) / bands;
+
+  addThreads(output_msg, parallel_for(bands, bands, [&](unsigned band) {
+    const auto last = std::min(height, (band + 1) * rows_per_band);
+    for(auto y = band * rows_per_band; y < last; y++) {
+      auto* line = bits + size_t(pitch) * y;
+      cmsDoTransform(transform.get(), line, line, width);
+    }
+  }));
+
+  FreeImage_DestroyICCProfile(dib);
+  FreeImage_CreateICCProfile(dib, const_cast<BYTE*>(target->data()), long(target->size()));
+#else
+  (void) himage, (void) dib, (void) max_threads;
+  output_msg("Color management requires lcms2, pixels are left as they are.");
+#endif
+}
 
 namespace h {
 
-int s_format_id;
+int s_format_id = FIF_UNKNOWN;
 
 BOOL DLL_CALLCONV
 Validate(FreeImageIO* io, fi_handle handle)
 {
+  FIIO_observe_io(io);
+
   BYTE signature[12] = {};
 
   io->read_proc(signature, sizeof(signature), 1, handle);
@@ -256,16 +599,82 @@ Validate(FreeImageIO* io, fi_handle handle)
 
 namespace a {
 
-int s_format_id;
+int s_format_id = FIF_UNKNOWN;
 
 } // namespace a
 
+// --- decoder selection
+
+using decoder_map_t = std::map<int, std::string>; //< decoder ids, by format id
+
+std::mutex s_decoders_mutex;  //< guards the below
+decoder_map_t s_decoders;     //< libheif's choice, if not there
+
+// Bumped by ReleaseState - the ids name the decoders of the libheif instance, which is gone, the next one may not have them
+std::atomic<unsigned> s_decoders_generation{};
+
+// Override the above for the loads, running on this thread - see SetDecoder. Use threadDecoders()
+thread_local decoder_map_t s_thread_decoders;
+thread_local unsigned s_thread_decoders_generation;
+
+// The decoders of this thread, dropped if selected before ReleaseState
+decoder_map_t& threadDecoders() {
+  const auto generation = s_decoders_generation.load(std::memory_order_acquire);
+  if(s_thread_decoders_generation != generation) {
+    s_thread_decoders.clear();
+    s_thread_decoders_generation = generation;
+  }
+  return s_thread_decoders;
+}
+
+bool isOwnFormat(FREE_IMAGE_FORMAT fif) {
+  return fif != FIF_UNKNOWN && (fif == h::s_format_id || fif == a::s_format_id);
+}
+
+heif_compression_format getCompression(int format_id) {
+  return format_id == a::s_format_id ? heif_compression_AV1 : heif_compression_HEVC;
+}
+
+// The decoder id for the format - of this thread, else the global one, empty for libheif's choice
+std::string getDecoderId(int format_id) {
+  const auto& thread_decoders = threadDecoders();
+  const auto it = thread_decoders.find(format_id);
+  if(it != thread_decoders.end())
+    return it->second;
+
+  std::lock_guard<std::mutex> lock(s_decoders_mutex);
+  const auto global = s_decoders.find(format_id);
+  return global != s_decoders.end() ? global->second : std::string{};
+}
+
+// id must outlive the decoding
+void setDecoderId(heif_decoding_options* opts, const std::string& id) {
+#if defined(FISIDECAR_HAS_HEIF_DECODER_ID)
+  opts->decoder_id = id.empty() ? nullptr : id.c_str();
+#else
+  (void) opts, (void) id;
+#endif
+}
+
 BOOL DLL_CALLCONV
 returnTRUE()
 {
   return TRUE;
 }
 
+// Other bit depths and types are converted on save
+BOOL DLL_CALLCONV
+supportsExportBPP(int bpp)
+{
+  return bpp == 24 || bpp == 32;
+}
+
+BOOL DLL_CALLCONV
+supportsExportType(FREE_IMAGE_TYPE type)
+{
+  return type == FIT_BITMAP || type == FIT_RGB16 || type == FIT_RGBA16;
+}
+
 int flags(Args args) {
 #ifdef FI_ADV
   return args ? args->flags : 0;
@@ -274,6 +683,12 @@ int flags(Args args) {
 #endif
 }
 
+unsigned getMaxThreads(int flags) {
+  std::bitset<FISIDECAR_LOAD_MAXTHREADS_VALUE_SIZE> mask; 
+  mask.set(); 
+  const auto val = unsigned(flags & mask.to_ulong()); 
+  return val ? val : unsigned(FISIDECAR_LOAD_MAXTHREADS_DEFAULT);
+}
 
 #if defined(FI_ADV)
 
@@ -313,124 +728,444 @@ int on_progress(enum heif_progress_step step, int tiles_processed, void* progres
 
 #endif // FI_ADV
 
-FIBITMAP* loadFromHimage(heif_image_handle* himage, output_msg_t output_msg)
+// Pixels, as requested from libheif, and the matching FreeImage format.
+// HDR goes to FIT_RGB(A)16, scaled to the full 16 bit range
+struct PixelFormat
 {
-  const auto flags = ::flags(output_msg.args);
-  const auto isLoadHeaderOnly = flags & FIF_LOAD_NOPIXELS;
-  const auto isLoadForcedSDR  = flags & FISIDECAR_LOAD_HEIF_SDR;
-
-  using unique_opts = unique_ptr<heif_decoding_options, void (*)(heif_decoding_options*)>;
-  using unique_img  = unique_ptr<heif_image, void (*)(const heif_image*)>;
+  heif_chroma chroma;
+  FREE_IMAGE_TYPE type;
+  unsigned bpp;
+};
 
+PixelFormat getPixelFormat(const heif_image_handle* himage, bool isForcedSDR) {
   const auto hasAlpha = heif_image_handle_has_alpha_channel(himage);
   const auto isHDR = heif_image_handle_get_luma_bits_per_pixel(himage) > 8 
   || heif_image_handle_get_chroma_bits_per_pixel(himage) > 8;
 
-  const auto shouldLoadAsHDR = isHDR && ! isLoadForcedSDR;
-
-  if(shouldLoadAsHDR && ! isLoadHeaderOnly) {
-    output_msg("HEIF hdr support is not implemented. Pass FISIDECAR_LOAD_HEIF_SDR to get standard 8-bit image.");
-    return {};
-  }
+  const auto shouldLoadAsHDR = isHDR && ! isForcedSDR;
 
-  const auto target_chroma = shouldLoadAsHDR 
+  const auto chroma = shouldLoadAsHDR 
 #if defined(FREEIMAGE_BIGENDIAN)
   ? (hasAlpha ? heif_chroma_interleaved_RRGGBBAA_BE : heif_chroma_interleaved_RRGGBB_BE)
 #else
   ? (hasAlpha ? heif_chroma_interleaved_RRGGBBAA_LE : heif_chroma_interleaved_RRGGBB_LE)
 #endif
   : (hasAlpha ? heif_chroma_interleaved_RGBA : heif_chroma_interleaved_RGB);
+
+  return {chroma
+    , shouldLoadAsHDR ? (hasAlpha ? FIT_RGBA16 : FIT_RGB16) : FIT_BITMAP
+    , (hasAlpha ? 32u : 24u) * (shouldLoadAsHDR ? 2 : 1)};
+}
+
+// heif_chroma_undefined asks for the image as it is stored (for the fused YCbCr conversion), anything else for RGB
+heif_colorspace getColorspace(heif_chroma chroma) {
+  return chroma == heif_chroma_undefined ? heif_colorspace_undefined : heif_colorspace_RGB;
+}
+
+// The planes and the matrix of an image, decoded as stored - false, unless it is 8 bit YCbCr (or monochrome) with a supported matrix
+bool getYCbCrPlanes(const heif_image* img, ycbcr_planes& planes, ycbcr_matrix& matrix) {
+  const auto colorspace = heif_image_get_colorspace(img);
+  const auto chroma = heif_image_get_chroma_format(img);
+  if(colorspace != heif_colorspace_YCbCr && colorspace != heif_colorspace_monochrome)
+    return false;
+  if(heif_image_get_bits_per_pixel_range(img, heif_channel_Y) != 8)
+    return false;
+
+  planes = {};
+  int pitch;
+  if(! (planes.y = heif_image_get_plane_readonly(img, heif_channel_Y, &pitch)))
+    return false;
+  planes.y_pitch = pitch;
+
+  if(colorspace == heif_colorspace_YCbCr) {
+    if(chroma != heif_chroma_420 && chroma != heif_chroma_422 && chroma != heif_chroma_444)
+      return false;
+    if(heif_image_get_bits_per_pixel_range(img, heif_channel_Cb) != 8 || heif_image_get_bits_per_pixel_range(img, heif_channel_Cr) != 8)
+      return false;
+
+    int cr_pitch;
+    planes.cb = heif_image_get_plane_readonly(img, heif_channel_Cb, &pitch);
+    planes.cr = heif_image_get_plane_readonly(img, heif_channel_Cr, &cr_pitch);
+    if(! planes.cb || ! planes.cr || pitch != cr_pitch)
+      return false;
+    planes.cb_pitch = pitch;
+    planes.shift_x = chroma != heif_chroma_444;
+    planes.shift_y = chroma == heif_chroma_420;
+  }
+
+  // Alpha of another depth is left to libheif, rather than dropped
+  if(heif_image_has_channel(img, heif_channel_Alpha)) {
+    if(heif_image_get_bits_per_pixel_range(img, heif_channel_Alpha) != 8)
+      return false;
+    if(! (planes.alpha = heif_image_get_plane_readonly(img, heif_channel_Alpha, &pitch)))
+      return false;
+    planes.alpha_pitch = pitch;
+  }
+
+  // As libheif, BT.601 full range, if there is no profile
+  unsigned coefficients = heif_matrix_coefficients_unspecified;
+  bool full_range = true;
+  heif_color_profile_nclx* nclx{};
+  if(! heif_image_get_nclx_color_profile(img, &nclx).code && nclx) {
+    coefficients = nclx->matrix_coefficients;
+    full_range = nclx->full_range_flag != 0;
+    heif_nclx_color_profile_free(nclx);
+  }
+  return get_ycbcr_matrix(coefficients, full_range, matrix);
+}
+
+// Whether the fused conversion can be asked for, judging by the container (the stream may still disagree)
+// The handle does not tell the depth of the alpha (an auxiliary image) - getYCbCrPlanes rejects it, and the callers re-decode as RGB.
+bool canFuseYCbCr(const heif_image_handle* himage) {
+  if(heif_image_handle_get_luma_bits_per_pixel(himage) != 8 || heif_image_handle_get_chroma_bits_per_pixel(himage) > 8)
+    return false;
+
+  heif_color_profile_nclx* nclx{};
+  if(heif_image_handle_get_nclx_color_profile(himage, &nclx).code || ! nclx)
+    return true;
+
+  ycbcr_matrix matrix;
+  const auto supported = get_ycbcr_matrix(nclx->matrix_coefficients, nclx->full_range_flag != 0, matrix);
+  heif_nclx_color_profile_free(nclx);
+  return supported;
+}
+
+// Part of an image, in pixels. right and bottom are exclusive, as in FreeImage_Copy
+struct Rect
+{
+  unsigned left, top, right, bottom;
+};
+
+// copyToRegion for images, decoded as stored - converts them to RGB on the way
+bool copyYCbCrToRegion(const heif_image* img, unsigned x0, unsigned y0, FIBITMAP* dib, const Rect& region, unsigned max_threads) {
+  ycbcr_planes planes;
+  ycbcr_matrix matrix;
+  const auto dst_bpp = FreeImage_GetBPP(dib);
+  if(FreeImage_GetImageType(dib) != FIT_BITMAP || (dst_bpp != 24 && dst_bpp != 32) || ! getYCbCrPlanes(img, planes, matrix))
+    return false;
+
+  const auto left = std::max(x0, region.left);
+  const auto top = std::max(y0, region.top);
+  const auto right = std::min(x0 + unsigned(heif_image_get_width(img, heif_channel_Y)), region.right);
+  const auto bottom = std::min(y0 + unsigned(heif_image_get_height(img, heif_channel_Y)), region.bottom);
+  if(left >= right || top >= bottom)
+    return true;
+
+  const auto dst_pitch = FreeImage_GetPitch(dib);
+  const auto dst_height = FreeImage_GetHeight(dib);
+  auto* dst_line = FreeImage_GetBits(dib) + dst_pitch * (dst_height - 1 - (top - region.top)) + (left - region.left) * (dst_bpp / 8);
+  ycbcr_image(planes, matrix, left - x0, top - y0, right - left, bottom - top, dst_line, -ptrdiff_t(dst_pitch), dst_bpp, max_threads);
+  return true;
+}
+
+// Copies the part of a decoded image (placed at x0, y0), which falls into region, to the dib (covering region), flipping it vertically
+bool copyToRegion(const heif_image* img, unsigned x0, unsigned y0, FIBITMAP* dib, const Rect& region, unsigned max_threads) {
+  if(heif_image_get_colorspace(img) != heif_colorspace_RGB)
+    return copyYCbCrToRegion(img, x0, y0, dib, region, max_threads);
+
+  int src_pitch;
+  const uint8_t* src_line = heif_image_get_plane_readonly(img, heif_channel_interleaved, &src_pitch);
+  const auto src_bpp = heif_image_get_bits_per_pixel(img, heif_channel_interleaved);
+  const auto src_bits = heif_image_get_bits_per_pixel_range(img, heif_channel_interleaved);
+  const auto row = get_swizzle_row(src_bpp, FreeImage_GetBPP(dib));
+  if(! src_line || ! row)
+    return false;
+
+  // Edge tiles overhang the image, also, only part of the image might be asked for
+  const auto left = std::max(x0, region.left);
+  const auto top = std::max(y0, region.top);
+  const auto right = std::min(x0 + unsigned(heif_image_get_width(img, heif_channel_interleaved)), region.right);
+  const auto bottom = std::min(y0 + unsigned(heif_image_get_height(img, heif_channel_interleaved)), region.bottom);
+  if(left >= right || top >= bottom)
+    return true;
+
+  const auto dst_pitch = FreeImage_GetPitch(dib);
+  const auto dst_bytespp = FreeImage_GetBPP(dib) / 8;
+  const auto dst_height = FreeImage_GetHeight(dib);
+
+  src_line += ptrdiff_t(src_pitch) * (top - y0) + (left - x0) * (src_bpp / 8);
+  auto* dst_line = FreeImage_GetBits(dib) + dst_pitch * (dst_height - 1 - (top - region.top)) + (left - region.left) * dst_bytespp;
+  swizzle_image(row, src_line, src_pitch, dst_line, -ptrdiff_t(dst_pitch), right - left, bottom - top, src_bits, max_threads);
+  return true;
+}
+
+#if defined(FISIDECAR_HAS_HEIF_TILES)
+
+bool getTiling(const heif_image_handle* himage, bool transformed, heif_image_tiling& tiling) {
+  tiling = {};
+  const auto err = heif_image_handle_get_image_tiling(himage, transformed, &tiling);
+  return ! err.code && tiling.num_columns && tiling.num_rows && tiling.tile_width && tiling.tile_height;
+}
+
+// Takes a decoded tile, placed at x0, y0 in the image. Returns an error message, null on success.
+// Called from the decoding threads, at the same time.
+using tile_sink_t = std::function<const char*(const heif_image* img, unsigned x0, unsigned y0)>;
+
+// Decodes the tiles of a grid image, which intersect region, one by one, passing each to sink as soon as it is done.
+// Only max_threads tiles are alive at any time, instead of a second full-size image.
+bool decodeTiles(const heif_image_handle* himage, const heif_image_tiling& tiling, heif_chroma chroma, const heif_decoding_options* opts
+  , const Rect& region, unsigned max_threads, const tile_sink_t& sink, const output_msg_t& output_msg)
+{
+  using unique_img  = unique_ptr<heif_image, void (*)(const heif_image*)>;
+
+  const auto first_column = region.left / tiling.tile_width;
+  const auto first_row = region.top / tiling.tile_height;
+  const auto columns = std::min(tiling.num_columns, (region.right + tiling.tile_width - 1) / tiling.tile_width) - first_column;
+  const auto rows = std::min(tiling.num_rows, (region.bottom + tiling.tile_height - 1) / tiling.tile_height) - first_row;
+
+  const auto tiles = columns * rows;
   
-  auto* opts = heif_decoding_options_alloc();
-  unique_opts opts_storage{opts, &heif_decoding_options_free};
-  
+  std::mutex mutex; //< guards the below
+  std::string error;
+  unsigned tiles_done{};
+  double decode_sum{};  //< over the threads, only to split the wall clock time between the phases
+  double copy_sum{};
+  std::atomic<bool> failed{false};
+
 #if defined(FI_ADV)
-  if(output_msg.progress) {
-    opts->start_progress = start_progress;
-    opts->on_progress = on_progress;
-    opts->progress_user_data = output_msg.progress;
-  }
+  if(output_msg.progress)
+    start_progress(heif_progress_step_load_tile, int(tiles), output_msg.progress);
 #endif
-  opts->convert_hdr_to_8bit = isLoadForcedSDR;
-  opts->ignore_transformations = ! (flags & FISIDECAR_LOAD_HEIF_TRANSFORM);
-  
-  // --- get image
 
-  const auto dst_bpp = hasAlpha ? 32 : 24;
+  const auto loop_start = output_msg.stats ? stats_clock::now() : stats_clock::time_point{};
+  const auto threads = parallel_for(tiles, max_threads, [&](unsigned i) {
+    if(failed)
+      return;
 
-  FIBITMAP* dib{};
-  unique_dib dib_storage{dib};
+    const auto tile_x = first_column + i % columns;
+    const auto tile_y = first_row + i / columns;
 
-  if(isLoadHeaderOnly) {
-    const auto width = opts->ignore_transformations ? heif_image_handle_get_ispe_width(himage) : heif_image_handle_get_width(himage);
-    const auto height = opts->ignore_transformations ? heif_image_handle_get_ispe_height(himage) : heif_image_handle_get_height(himage);
-    
-    if(! (dib = FreeImage_AllocateHeader(true, width, height, dst_bpp))) {
-      output_msg(FI_MSG_ERROR_DIB_MEMORY);
-      return {};
+    const auto fail = [&](const char* message) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if(! failed.exchange(true))
+        error = message;
+    };
+
+    if(isCanceled(output_msg)) {
+      fail("Canceled");
+      return;
     }
-    dib_storage.reset(dib);
-  } else  {
+
+    const auto start = output_msg.stats ? stats_clock::now() : stats_clock::time_point{};
+
     heif_image* img;
-    auto err = heif_decode_image(himage, &img, heif_colorspace_RGB, target_chroma, opts);
+    const auto err = heif_image_handle_decode_image_tile(himage, &img, getColorspace(chroma), chroma, opts, tile_x, tile_y);
     if(err.code) {
-      output_msg(err.message);
-      return {};
+      fail(err.message);
+      return;
     }
-
     unique_img img_storage{img, &heif_image_release};
 
-    const auto width = heif_image_get_width(img, heif_channel_interleaved);
-    const auto height = heif_image_get_height(img, heif_channel_interleaved);
+    const auto decoded = output_msg.stats ? stats_clock::now() : start;
 
-    if(! (dib = FreeImage_Allocate(width, height, dst_bpp))) {
-      output_msg(FI_MSG_ERROR_DIB_MEMORY);
-      return {};
+    if(const auto* message = sink(img, tile_x * tiling.tile_width, tile_y * tiling.tile_height)) {
+      fail(message);
+      return;
     }
-    dib_storage.reset(dib);
 
-    // --- access image data
+    img_storage.reset(); //< release the tile before reporting
 
-    int src_pitch;
-    const uint8_t* src_line = heif_image_get_plane_readonly(img, heif_channel_interleaved, &src_pitch);
-    const auto src_bpp = heif_image_get_bits_per_pixel(img, heif_channel_interleaved);
+    const auto copied = output_msg.stats ? stats_clock::now() : start;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    ++tiles_done;
+    if(output_msg.stats) {
+      decode_sum += elapsedMs(start, decoded);
+      copy_sum += elapsedMs(decoded, copied);
+      output_msg.stats->tiles++;
+    }
+#if defined(FI_ADV)
+    if(output_msg.progress && ! on_progress(heif_progress_step_load_tile, int(tiles_done), output_msg.progress) && ! failed.exchange(true))
+      error = "Canceled";
+#endif
+  });
+  addThreads(output_msg, threads);
+
+  // Wall clock, as for the other paths - the tiles are decoded and copied in turn on each thread, the sums tell the split
+  if(output_msg.stats) {
+    const auto loop_ms = elapsedMs(loop_start, stats_clock::now());
+    const auto decode_part = decode_sum + copy_sum > 0 ? decode_sum / (decode_sum + copy_sum) : 1;
+    output_msg.stats->decode_ms += loop_ms * decode_part;
+    output_msg.stats->copy_ms += loop_ms * (1 - decode_part);
+  }
 
-    // --- copy image data (8bit only for now)
+  if(failed) {
+    output_msg(error.c_str());
+    return false;
+  }
+  return true;
+}
 
-    const auto dst_pitch = FreeImage_GetPitch(dib);
-    auto* dst_line = FreeImage_GetBits(dib) + dst_pitch * (height - 1);
-
-    for(unsigned y=0; y < height; y++) {
-      auto* dst_bits = dst_line;
-      auto* src_bits = src_line;
-      for(unsigned x=0; x < width; x++) {
-        dst_bits[FI_RGBA_RED]   = src_bits[0];
-        dst_bits[FI_RGBA_GREEN] = src_bits[1];
-        dst_bits[FI_RGBA_BLUE]  = src_bits[2];
-        if(hasAlpha)
-          dst_bits[FI_RGBA_ALPHA] = src_bits[3];
-        
-        dst_bits += dst_bpp/8;
-        src_bits += src_bpp/8;
+// Decodes the tiles straight into their place in the dib (covering region)
+bool decodeTiles(const heif_image_handle* himage, const heif_image_tiling& tiling, heif_chroma chroma, const heif_decoding_options* opts
+  , FIBITMAP* dib, const Rect& region, unsigned max_threads, const output_msg_t& output_msg)
+{
+  return decodeTiles(himage, tiling, chroma, opts, region, max_threads, [&](const heif_image* img, unsigned x0, unsigned y0) {
+    return copyToRegion(img, x0, y0, dib, region, 1) ? nullptr : "Unexpected tile format";
+  }, output_msg);
+}
+
+// Fused variant of the above (FISIDECAR_LOAD_HEIF_FUSED_YCBCR): the tiles are decoded as stored and converted while copied.
+// A tile, which is not 8 bit YCbCr after all (RGB, identity matrix without a container profile, alpha of another depth),
+// is decoded again as chroma, converted by libheif.
+bool decodeTilesFused(const heif_image_handle* himage, const heif_image_tiling& tiling, heif_chroma chroma, const heif_decoding_options* opts
+  , FIBITMAP* dib, const Rect& region, unsigned max_threads, const output_msg_t& output_msg)
+{
+  using unique_img  = unique_ptr<heif_image, void (*)(const heif_image*)>;
+
+  return decodeTiles(himage, tiling, heif_chroma_undefined, opts, region, max_threads, [&](const heif_image* img, unsigned x0, unsigned y0) -> const char* {
+    if(copyToRegion(img, x0, y0, dib, region, 1))
+      return nullptr;
+
+    heif_image* rgb;
+    const auto err = heif_image_handle_decode_image_tile(himage, &rgb, heif_colorspace_RGB, chroma, opts, x0 / tiling.tile_width, y0 / tiling.tile_height);
+    if(err.code)
+      return err.message;
+    unique_img rgb_storage{rgb, &heif_image_release};
+
+    return copyToRegion(rgb, x0, y0, dib, region, 1) ? nullptr : "Unexpected tile format";
+  }, output_msg);
+}
+
+// Downscaled variant of the above: decodes one row of tiles at a time (in parallel) and streams its rows through the box filter.
+// Only a row of tiles is alive at any time, the full size image is never created.
+bool decodeTilesScaled(const heif_image_handle* himage, const heif_image_tiling& tiling, heif_chroma chroma, const heif_decoding_options* opts
+  , FIBITMAP* dib, unsigned factor, unsigned max_threads, const output_msg_t& output_msg)
+{
+  using unique_img  = unique_ptr<heif_image, void (*)(const heif_image*)>;
+
+  const auto width = tiling.image_width;
+  const auto height = tiling.image_height;
+  const auto dst_height = FreeImage_GetHeight(dib);
+
+  std::vector<unique_img> tiles;
+  std::vector<std::string> errors(tiling.num_columns);
+  std::unique_ptr<BoxDownsampler> sampler;
+  swizzle_row_t row{};
+  unsigned src_bits{};
+  unsigned dst_y{};
+
+#if defined(FI_ADV)
+  if(output_msg.progress)
+    start_progress(heif_progress_step_load_tile, int(tiling.num_columns * tiling.num_rows), output_msg.progress);
+#endif
+
+  for(unsigned tile_y = 0; tile_y < tiling.num_rows; tile_y++) {
+    if(isCanceled(output_msg)) {
+      output_msg("Canceled");
+      return false;
+    }
+
+    tiles.clear();
+    for(unsigned i = 0; i < tiling.num_columns; i++)
+      tiles.emplace_back(nullptr, &heif_image_release);
+
+    StatsTimer decode_timer{output_msg, &FISIDECAR_LOAD_STATS::decode_ms};
+    addThreads(output_msg, parallel_for(tiling.num_columns, max_threads, [&](unsigned tile_x) {
+      heif_image* img;
+      const auto err = heif_image_handle_decode_image_tile(himage, &img, heif_colorspace_RGB, chroma, opts, tile_x, tile_y);
+      if(err.code)
+        errors[tile_x] = err.message;
+      else
+        tiles[tile_x].reset(img);
+    }));
+    decode_timer.stop();
+    if(output_msg.stats)
+      output_msg.stats->tiles += tiling.num_columns;
+
+    StatsTimer copy_timer{output_msg, &FISIDECAR_LOAD_STATS::copy_ms};
+
+    for(unsigned tile_x = 0; tile_x < tiling.num_columns; tile_x++) {
+      if(! tiles[tile_x]) {
+        output_msg(errors[tile_x].c_str());
+        return false;
       }
+    }
 
-      dst_line -= dst_pitch;
-      src_line += src_pitch;
+    if(! sampler) {
+      const auto* img = tiles.front().get();
+      const auto src_bpp = heif_image_get_bits_per_pixel(img, heif_channel_interleaved);
+      src_bits = heif_image_get_bits_per_pixel_range(img, heif_channel_interleaved);
+      row = get_swizzle_row(src_bpp, FreeImage_GetBPP(dib));
+      if(! row) {
+        output_msg("Unexpected tile format");
+        return false;
+      }
+      sampler.reset(new BoxDownsampler(width, height, src_bpp, src_bits, factor));
     }
-  } 
 
-  // --- get color profile
+    // Edge tiles overhang the image
+    const auto y0 = tile_y * tiling.tile_height;
+    const auto band_height = std::min(tiling.tile_height, height - std::min(height, y0));
+
+    for(unsigned y = 0; y < band_height; y++) {
+      for(unsigned tile_x = 0; tile_x < tiling.num_columns; tile_x++) {
+        const auto* img = tiles[tile_x].get();
+        const auto x0 = tile_x * tiling.tile_width;
+        const auto tile_width = std::min<unsigned>(heif_image_get_width(img, heif_channel_interleaved), width - std::min(width, x0));
+        if(! tile_width || y >= unsigned(heif_image_get_height(img, heif_channel_interleaved)))
+          continue;
+
+        int src_pitch;
+        const uint8_t* src_line = heif_image_get_plane_readonly(img, heif_channel_interleaved, &src_pitch);
+        sampler->add(src_line + src_pitch * ptrdiff_t(y), x0, tile_width);
+      }
 
-  // Note, we get it from himage, because in real-life photos, img does not have one (libheif issue?)
-  // Also, to have a profile in header-only is consitent to the other plugins
+      if(const auto* out = sampler->next_row()) {
+        if(dst_y < dst_height)
+          row(out, FreeImage_GetScanLine(dib, int(dst_height - 1 - dst_y)), sampler->width(), src_bits);
+        ++dst_y;
+      }
+    }
 
-  const auto profile_type = heif_image_handle_get_color_profile_type(himage);
-  switch(profile_type)
-  {
-    case heif_color_profile_type_not_present:
-    break;
-    case heif_color_profile_type_nclx:
-    {
+#if defined(FI_ADV)
+    if(output_msg.progress && ! on_progress(heif_progress_step_load_tile, int((tile_y + 1) * tiling.num_columns), output_msg.progress)) {
+      output_msg("Canceled");
+      return false;
+    }
+#endif
+  }
+
+  return true;
+}
+
+#endif // FISIDECAR_HAS_HEIF_TILES
+
+// Returns the handle of the first thumbnail, or null if there is none. Release with heif_image_handle_release.
+heif_image_handle* getThumbnail(const heif_image_handle* himage, const output_msg_t& output_msg)
+{
+  static const auto idsCount = 1; //< it is usually just one
+  heif_item_id ids[idsCount];
+
+  const auto thumbsCount = heif_image_handle_get_number_of_thumbnails(himage);
+  if(! thumbsCount)
+    return {};
+
+  if(thumbsCount > 1) {
+    output_msg("Warning: Thumbs beyond the first are ignored.");
+  }
+
+  (void) heif_image_handle_get_list_of_thumbnail_IDs(himage, ids, idsCount);
+
+  heif_image_handle* hthumb{};
+  const auto err = heif_image_handle_get_thumbnail(himage, *ids, &hthumb);
+  assert(! err.code);
+  (void) err;
+
+  return hthumb;
+}
+
+// Note, we get it from himage, because in real-life photos, img does not have one (libheif issue?)
+// Also, to have a profile in header-only is consitent to the other plugins
+void addColorProfile(const heif_image_handle* himage, FIBITMAP* dib, int flags, const output_msg_t& output_msg)
+{
+  const auto profile_type = heif_image_handle_get_color_profile_type(himage);
+  switch(profile_type)
+  {
+    case heif_color_profile_type_not_present:
+    break;
+    case heif_color_profile_type_nclx:
+    {
       const auto shouldConvertToICC
 #ifdef FISIDECAR_HAS_LCMS
       = (flags & FISIDECAR_LOAD_HEIF_NCLX_TO_ICC);
@@ -443,12 +1178,10 @@ FIBITMAP* loadFromHimage(heif_image_handle* himage, output_msg_t output_msg)
         if(err.code) {
           output_msg("Failed to get_nclx_color_profile");
         } else {
-          void* data{};
-          unsigned long size{};
-          if(convertNCLXtoICC(*nclx, &data, &size, output_msg) && data) {
-            FreeImage_CreateICCProfile(dib, data, size);
-            free(data);
-          }
+          unique_ptr<heif_color_profile_nclx, void (*)(heif_color_profile_nclx*)> nclx_storage{nclx, &heif_nclx_color_profile_free};
+          const auto icc = getICCFromNCLX(*nclx, output_msg);
+          if(icc && ! icc->empty())
+            FreeImage_CreateICCProfile(dib, const_cast<BYTE*>(icc->data()), long(icc->size()));
         }
       } else {
         output_msg("NCLX color profile ignored.");
@@ -469,200 +1202,1970 @@ FIBITMAP* loadFromHimage(heif_image_handle* himage, output_msg_t output_msg)
         FreeImage_CreateICCProfile(dib, data, size);
       }
     }
-    break;
+    break;
+  }
+}
+
+// Number of tiles, which can be decoded in parallel, fallback if unknown
+unsigned getTileCount(const heif_image_handle* himage, unsigned fallback) {
+#if defined(FISIDECAR_HAS_HEIF_TILES)
+  heif_image_tiling tiling;
+  if(getTiling(himage, false, tiling))
+    return tiling.num_columns * tiling.num_rows;
+#endif
+  (void) himage;
+  return fallback;
+}
+
+// Dimensions, as they will be decoded - with or without the transformations (rotation, crop, etc.)
+std::pair<unsigned, unsigned> getSize(const heif_image_handle* himage, bool transformed) {
+  return transformed
+    ? std::make_pair(unsigned(heif_image_handle_get_width(himage)), unsigned(heif_image_handle_get_height(himage)))
+    : std::make_pair(unsigned(heif_image_handle_get_ispe_width(himage)), unsigned(heif_image_handle_get_ispe_height(himage)));
+}
+
+// Requested size for scale-on-load (FISIDECAR_LOAD_HEIF_SIZE), 0 if none
+unsigned getRequestedSize(int flags) {
+  return unsigned(flags & FISIDECAR_LOAD_HEIF_SIZE_MASK) >> FISIDECAR_LOAD_HEIF_SIZE_SHIFT;
+}
+
+// The dib to decode into - a view of the target of LoadInto, a pooled one, or a new one
+FIBITMAP* allocateDib(FREE_IMAGE_TYPE type, unsigned width, unsigned height, unsigned bpp, const output_msg_t& output_msg) {
+  if(auto* target = s_target_dib) {
+    s_target_dib = {}; //< just the image, not its thumbnail
+
+    if(FreeImage_GetImageType(target) != type || FreeImage_GetWidth(target) != width || FreeImage_GetHeight(target) != height 
+      || FreeImage_GetBPP(target) != bpp) 
+    {
+      output_msg("Destination does not match the image (%ux%u, type %d, %u bpp)", width, height, int(type), bpp);
+      return {};
+    }
+    auto* view = FreeImage_CreateView(target, 0, 0, width, height);
+    if(! view)
+      output_msg(FI_MSG_ERROR_DIB_MEMORY);
+    s_target_used = view != nullptr;
+    return view;
+  }
+
+  if(auto* dib = bitmap_pool_acquire(type, width, height, bpp))
+    return dib;
+
+  auto* dib = FreeImage_AllocateT(type, int(width), int(height), int(bpp));
+  if(! dib)
+    output_msg(FI_MSG_ERROR_DIB_MEMORY);
+  return dib;
+}
+
+FIBITMAP* loadFromHimage(heif_image_handle* himage, unsigned max_threads, output_msg_t output_msg)
+{
+  const auto flags = ::flags(output_msg.args);
+  const auto isLoadHeaderOnly = flags & FIF_LOAD_NOPIXELS;
+  const auto isLoadForcedSDR  = flags & FISIDECAR_LOAD_HEIF_SDR;
+
+  using unique_opts = unique_ptr<heif_decoding_options, void (*)(heif_decoding_options*)>;
+  using unique_img  = unique_ptr<heif_image, void (*)(const heif_image*)>;
+
+  const auto format = getPixelFormat(himage, isLoadForcedSDR);
+  const auto target_chroma = format.chroma;
+  
+  auto* opts = heif_decoding_options_alloc();
+  unique_opts opts_storage{opts, &heif_decoding_options_free};
+  
+#if defined(FI_ADV)
+  if(output_msg.progress) {
+    opts->start_progress = start_progress;
+    opts->on_progress = on_progress;
+    opts->progress_user_data = output_msg.progress;
+  }
+#endif
+  setCancelHook(opts, output_msg);
+  opts->convert_hdr_to_8bit = isLoadForcedSDR;
+  opts->ignore_transformations = ! (flags & FISIDECAR_LOAD_HEIF_TRANSFORM);
+
+  const auto decoder_id = getDecoderId(output_msg.format_id);
+  setDecoderId(opts, decoder_id);
+  
+  // --- get image
+
+  const auto dst_type = format.type;
+  const auto dst_bpp = format.bpp;
+
+  // Scale-on-load, by an integer factor, applied while copying into the dib
+  const auto size = getSize(himage, ! opts->ignore_transformations);
+  const auto factor = downsample_factor(size.first, size.second, getRequestedSize(flags));
+
+  // Fused conversion: decoded as stored (YCbCr), converted to RGB while copied into the dib - no libheif conversion pass
+  auto isFused = (flags & FISIDECAR_LOAD_HEIF_FUSED_YCBCR) && ! isLoadHeaderOnly && factor == 1 
+    && dst_type == FIT_BITMAP && canFuseYCbCr(himage);
+
+#if defined(FISIDECAR_HAS_HEIF_TILES)
+  heif_image_tiling tiling;
+  const auto isTiled = ! isLoadHeaderOnly && opts->ignore_transformations
+    && getTiling(himage, false, tiling) && tiling.num_columns * tiling.num_rows > 1;
+#endif
+
+  FIBITMAP* dib{};
+  unique_dib dib_storage{dib};
+
+  if(isLoadHeaderOnly) {
+    const auto width = downsampled_size(size.first, factor);
+    const auto height = downsampled_size(size.second, factor);
+    
+    if(! (dib = FreeImage_AllocateHeaderT(true, dst_type, width, height, dst_bpp))) {
+      output_msg(FI_MSG_ERROR_DIB_MEMORY);
+      return {};
+    }
+    dib_storage.reset(dib);
+#if defined(FISIDECAR_HAS_HEIF_TILES)
+  } else if(isTiled) {
+    // Grid images are decoded tile by tile, straight into the dib
+
+    const auto width = downsampled_size(tiling.image_width, factor);
+    const auto height = downsampled_size(tiling.image_height, factor);
+
+    if(! (dib = allocateDib(dst_type, width, height, dst_bpp, output_msg)))
+      return {};
+    dib_storage.reset(dib);
+
+    opts->start_progress = {};
+    opts->on_progress = {};
+    opts->progress_user_data = {};
+    setCancelHook(opts, output_msg);
+
+    const auto ok = factor > 1
+      ? decodeTilesScaled(himage, tiling, target_chroma, opts, dib, factor, max_threads, output_msg)
+      : isFused
+        ? decodeTilesFused(himage, tiling, target_chroma, opts, dib, Rect{0, 0, width, height}, max_threads, output_msg)
+        : decodeTiles(himage, tiling, target_chroma, opts, dib, Rect{0, 0, width, height}, max_threads, output_msg);
+    if(! ok)
+      return {};
+#endif
+  } else {
+    StatsTimer decode_timer{output_msg, &FISIDECAR_LOAD_STATS::decode_ms};
+    heif_image* img;
+    const auto decode_chroma = isFused ? heif_chroma_undefined : target_chroma;
+    auto err = heif_decode_image(himage, &img, getColorspace(decode_chroma), decode_chroma, opts);
+    if(err.code) {
+      output_msg(err.message);
+      return {};
+    }
+    unique_img img_storage{img, &heif_image_release};
+
+    // Stored as something else after all (RGB, 4:0:0 with an odd matrix, ...), libheif converts it
+    ycbcr_planes planes;
+    ycbcr_matrix matrix;
+    if(isFused && ! getYCbCrPlanes(img, planes, matrix)) {
+      isFused = false;
+      img_storage.reset();
+      if((err = heif_decode_image(himage, &img, heif_colorspace_RGB, target_chroma, opts)).code) {
+        output_msg(err.message);
+        return {};
+      }
+      img_storage.reset(img);
+    }
+    decode_timer.stop();
+
+    if(isCanceled(output_msg)) {
+      output_msg("Canceled");
+      return {};
+    }
+
+    const auto channel = isFused ? heif_channel_Y : heif_channel_interleaved;
+    const auto width = unsigned(heif_image_get_width(img, channel));
+    const auto height = unsigned(heif_image_get_height(img, channel));
+    const auto dst_width = downsampled_size(width, factor);
+    const auto dst_height = downsampled_size(height, factor);
+
+    if(! (dib = allocateDib(dst_type, dst_width, dst_height, dst_bpp, output_msg)))
+      return {};
+    dib_storage.reset(dib);
+
+    const auto dst_pitch = FreeImage_GetPitch(dib);
+    auto* dst_line = FreeImage_GetBits(dib) + dst_pitch * (dst_height - 1);
+
+    if(isFused) {
+      // --- convert and copy image data in one pass, flipping it vertically
+
+      StatsTimer copy_timer{output_msg, &FISIDECAR_LOAD_STATS::copy_ms};
+      addThreads(output_msg, ycbcr_image(planes, matrix, 0, 0, width, height, dst_line, -ptrdiff_t(dst_pitch), dst_bpp, max_threads));
+    } else {
+      // --- access image data
+
+      int src_pitch;
+      const uint8_t* src_line = heif_image_get_plane_readonly(img, heif_channel_interleaved, &src_pitch);
+      const auto src_bpp = heif_image_get_bits_per_pixel(img, heif_channel_interleaved);
+      const auto src_bits = heif_image_get_bits_per_pixel_range(img, heif_channel_interleaved);
+
+      // --- copy image data, flipping it vertically (and downsampling it, if requested)
+
+      const auto row = get_swizzle_row(src_bpp, dst_bpp);
+      if(! row) {
+        output_msg("Unexpected source format (%d bpp)", src_bpp);
+        return {};
+      }
+
+      StatsTimer copy_timer{output_msg, &FISIDECAR_LOAD_STATS::copy_ms};
+      addThreads(output_msg, factor > 1
+        ? downsample_image(row, src_line, src_pitch, dst_line, -ptrdiff_t(dst_pitch), width, height, src_bpp, src_bits, factor, max_threads)
+        : swizzle_image(row, src_line, src_pitch, dst_line, -ptrdiff_t(dst_pitch), width, height, src_bits, max_threads));
+    }
+  } 
+
+  // --- get color profile
+
+  StatsTimer icc_timer{output_msg, &FISIDECAR_LOAD_STATS::icc_ms};
+  addColorProfile(himage, dib, flags, output_msg);
+  if((flags & FISIDECAR_LOAD_HEIF_TO_SRGB) && ! isLoadHeaderOnly)
+    convertToOutputProfile(himage, dib, max_threads, output_msg);
+  icc_timer.stop();
+
+  return dib_storage.release();
+}
+
+// Exif and XMP of the image, attached to the dib
+void loadMetadata(const heif_image_handle* himage, FIBITMAP* dib, const output_msg_t& output_msg)
+{
+  StatsTimer metadata_timer{output_msg, &FISIDECAR_LOAD_STATS::metadata_ms};
+
+  static const auto idsCount = 5; //< made-up number, really
+  heif_item_id ids[idsCount];
+  unique_arr<heif_item_id> ids_storage;
+  heif_item_id* items = ids;
+
+  const char* filter = {};
+  const auto itemsCount = heif_image_handle_get_number_of_metadata_blocks(himage, filter);
+  if(itemsCount > idsCount) {
+    items = new heif_item_id[itemsCount];
+    ids_storage.reset(items);
+  }
+
+  (void) heif_image_handle_get_list_of_metadata_block_IDs(himage, filter, items, itemsCount);
+
+  for(const auto* it = items; it != items + itemsCount; it++) {
+    const auto type = std::string(heif_image_handle_get_metadata_type(himage, *it)); //< We count on SSO this to be cheap                                                           //<
+
+    if(type == "Exif") {
+      auto block = get_metadata_block(*himage, *it);
+
+      if(! block.first) {
+        output_msg("Out of memory for %s block", type.c_str()); 
+      } else {
+        // First 4 bytes are the offset into the block where the data starts
+        // (https://github.com/strukturag/libheif/issues/269#issuecomment-667149770)
+        const auto size = block.second;
+        const auto* const data = static_cast<unsigned char*>(block.first.get());
+        assert(size > 4);
+        const auto offset = unsigned(data[0] << 4) | (data[1] << 3) | (data[2] << 2) | data[3];
+        
+        if(size > (4 + offset)) {
+
+          // ### However, where the data starts is the byte order (TIFF header), 
+          // skiping over the "exif\0\0" signature, if any. 
+          // This creates problems: 
+          //  - libexif fails to load such blocks (https://github.com/libexif/libexif/issues/58)
+          //  - FreeImage fails to save such blocks in JPEG and others.
+          // DO THE UGLY THING and preped a signatire.
+
+          const auto sizeofSig = sizeof("Exif\0\0") - 1;
+          const auto new_size = sizeofSig + (size - (4 + offset));
+          const auto new_data = static_cast<unsigned char*>(malloc(new_size));
+
+          if(! new_data) {
+            output_msg("Out of memory for %s block", type.c_str()); 
+          } else {
+            memcpy(new_data, "Exif\0\0", sizeofSig);
+            memcpy(new_data + sizeofSig, data + (4 + offset), new_size - sizeofSig);
+
+            block.second = new_size;
+            block.first.reset(new_data);
+
+            addExif(dib, block.first.get(), block.second);
+          }
+        }
+      }
+    } else if(type == "mime" && heif_image_handle_get_metadata_content_type(himage, *it) == std::string("application/rdf+xml")) {
+      const auto block = get_metadata_block(*himage, *it);
+
+      if(! block.first) 
+        output_msg("Out of memory for XMP block"); 
+      else 
+        addXMP(dib, block.first.get(), block.second);
+    } else {
+      output_msg("metadata of type %s not implemented", type.c_str());
+    }
+  }
+}
+
+// --- multipage
+
+// A parsed file, the data of open_proc. The pages are the top-level images, the primary one first.
+// FreeImage calls open_proc and close_proc around each page load (and page count), so the document of a multipage file
+// is parked on close and picked up again on the next open of the same file, instead of parsing it for every page (see DocumentCache).
+// Only documents used as multipage (page count, page load) are parked - not those of plain loads - and only mapped files and
+// FreeImage memory buffers, which can be recognized when opened again (a handle of other FreeImageIO has no identity).
+struct Document
+{
+  using unique_ctx    = unique_ptr<heif_context, void (*)(heif_context*)>;
+
+  Document()
+    : ctx{nullptr, &heif_context_free}
+    , hasFileId{}
+    , fileId{}
+    , offset{}
+    , isMultipage{}
+  {}
+
+  heif_error parse(FreeImageIO* io, fi_handle handle, bool cached);
+  bool isParsed() const { return bool(this->ctx); }
+  bool isParkable() const { 
+    return this->isMultipage && this->isParsed() && this->hasFileId && this->source->kind() != FIIO_source::kind_reader && this->pages.size() > 1; 
+  }
+
+  std::unique_ptr<FIIO_source> source; //< must outlive ctx
+  unique_ctx ctx;
+  std::vector<heif_item_id> pages;
+
+  bool hasFileId;
+  FIIO_file_id fileId;
+  long offset;
+  bool isMultipage; //< used by PageCount, or Load of a page
+};
+
+heif_error Document::parse(FreeImageIO* io, fi_handle handle, bool cached) {
+  this->source.reset(new FIIO_source(io, handle, cached));
+  this->ctx.reset(libheif_context_alloc());
+
+  auto err = this->source->read(this->ctx.get());
+  if(err.code) {
+    this->ctx.reset();
+    return err;
+  }
+
+  const auto count = heif_context_get_number_of_top_level_images(this->ctx.get());
+  this->pages.resize(size_t(std::max(count, 0)));
+  heif_context_get_list_of_top_level_image_IDs(this->ctx.get(), this->pages.data(), count);
+
+  heif_item_id primary;
+  if(! heif_context_get_primary_image_ID(this->ctx.get(), &primary).code) {
+    const auto it = std::find(this->pages.begin(), this->pages.end(), primary);
+    if(it != this->pages.end())
+      std::rotate(this->pages.begin(), it, it + 1);
+  }
+  return err;
+}
+
+// The parked documents of multipage bitmaps, between their page loads, keyed by the identity of the file (or memory buffer) and the offset.
+// FreeImage does not tell the plugin, when a multipage bitmap is closed, so a document is released after idle_time unused,
+// or by flush (FISidecar_DeInitialise). Each open takes a document out, each close puts it back - the bitmaps, open at the same time, 
+// have their own (two of the same file included), instead of evicting each other.
+class DocumentCache
+{
+public:
+  DocumentCache() : reaping_{}, stop_{} {}
+
+  ~DocumentCache() {
+#if defined(_WIN32)
+    // Joining during DLL unload deadlocks on the loader lock
+    std::vector<Entry> entries;
+    {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      this->stop_ = true;
+      entries.swap(this->entries_);
+    }
+    this->wake_.notify_all();
+    if(this->reaper_.joinable())
+      this->reaper_.detach();
+#else
+    this->flush();
+#endif
+  }
+
+  std::unique_ptr<Document> take(const FIIO_file_id& id, long offset) {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    const auto it = std::find_if(this->entries_.begin(), this->entries_.end(), [&](const Entry& entry) {
+      return entry.doc->fileId == id && entry.doc->offset == offset;
+    });
+    if(it == this->entries_.end())
+      return {};
+
+    auto doc = std::move(it->doc);
+    this->entries_.erase(it);
+    return doc;
+  }
+
+  void park(std::unique_ptr<Document> doc) {
+    std::unique_ptr<Document> dropped; //< released after the lock
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    if(this->entries_.size() >= max_documents) {
+      const auto oldest = std::min_element(this->entries_.begin(), this->entries_.end(), [](const Entry& l, const Entry& r) { return l.expiry < r.expiry; });
+      dropped = std::move(oldest->doc);
+      this->entries_.erase(oldest);
+    }
+    if(this->startReaper()) //< else it would never expire
+      this->entries_.push_back(Entry{std::move(doc), cache_clock::now() + idle_time});
+  }
+
+  // Releases all documents, now
+  void flush() {
+    std::vector<Entry> entries;
+    std::thread reaper;
+    {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      this->stop_ = true;
+      entries.swap(this->entries_);
+      reaper.swap(this->reaper_);
+    }
+    this->wake_.notify_all();
+    if(reaper.joinable())
+      reaper.join();
+
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->stop_ = false;
+    if(! this->entries_.empty()) //< parked meanwhile, the old reaper did not take them
+      this->startReaper();
+  }
+
+private:
+  using cache_clock = std::chrono::steady_clock;
+
+  static const size_t max_documents = 16;
+  static constexpr std::chrono::seconds idle_time{2};
+
+  struct Entry
+  {
+    std::unique_ptr<Document> doc;
+    cache_clock::time_point expiry;
+  };
+
+  // Under the lock. The reaper ends, when there is nothing left to expire
+  bool startReaper() {
+    if(this->reaping_)
+      return true;
+    if(this->reaper_.joinable())
+      this->reaper_.join(); //< ended, it cleared reaping_ last
+    try {
+      this->reaper_ = std::thread(&DocumentCache::reap, this);
+    } catch(const std::system_error&) {
+      return false;
+    }
+    this->reaping_ = true;
+    return true;
+  }
+
+  void reap() {
+    std::unique_lock<std::mutex> lock(this->mutex_);
+    while(! this->stop_ && ! this->entries_.empty()) {
+      const auto next = std::min_element(this->entries_.begin(), this->entries_.end(), [](const Entry& l, const Entry& r) { return l.expiry < r.expiry; })->expiry;
+      this->wake_.wait_until(lock, next);
+
+      std::vector<std::unique_ptr<Document>> expired;
+      const auto now = cache_clock::now();
+      for(auto it = this->entries_.begin(); it != this->entries_.end();) {
+        if(it->expiry <= now) {
+          expired.push_back(std::move(it->doc));
+          it = this->entries_.erase(it);
+        } else {
+          ++it;
+        }
+      }
+
+      lock.unlock();
+      expired.clear(); //< unmapping and freeing the contexts, without blocking the loads
+      lock.lock();
+    }
+    this->reaping_ = false;
+  }
+
+  std::mutex mutex_;            //< guards the below
+  std::condition_variable wake_;
+  std::vector<Entry> entries_;
+  std::thread reaper_;
+  bool reaping_;                //< the reaper runs
+  bool stop_;
+};
+
+constexpr std::chrono::seconds DocumentCache::idle_time;
+
+DocumentCache& documents() {
+  static DocumentCache cache;
+  return cache;
+}
+
+// The statistics of a load (FISIDECAR_LOAD_HEIF_STATS), published however the load ends.
+// The IO counters are those of this load only - a parked document has been read before.
+class LoadStats
+{
+public:
+  LoadStats(output_msg_t& output_msg, const Document& doc)
+    : enabled_((::flags(output_msg.args) & FISIDECAR_LOAD_HEIF_STATS) || s_stats_enabled.load(std::memory_order_relaxed))
+    , stats_{}
+    , doc_(doc)
+    , io_start_{}
+    , start_(stats_clock::now())
+  {
+    if(! this->enabled_)
+      return;
+
+    output_msg.stats = &this->stats_;
+    this->stats_.fif = output_msg.format_id;
+    if(doc.source && doc.source->fio())
+      this->io_start_ = doc.source->fio()->counters;
+  }
+
+  ~LoadStats() {
+    if(! this->enabled_)
+      return;
+
+    this->stats_.total_ms = elapsedMs(this->start_, stats_clock::now());
+    if(const auto* source = this->doc_.source.get()) {
+      this->stats_.io_kind = source->kind() == FIIO_source::kind_memory ? FISIDECAR_IO_MEMORY 
+        : source->kind() == FIIO_source::kind_mapped ? FISIDECAR_IO_MAPPED : FISIDECAR_IO_READER;
+      if(const auto* fio = source->fio()) {
+        this->stats_.io_reads = fio->counters.reads - this->io_start_.reads;
+        this->stats_.io_seeks = fio->counters.seeks - this->io_start_.seeks;
+        this->stats_.io_bytes = fio->counters.bytes_read - this->io_start_.bytes_read;
+      }
+    }
+    publishStats(this->stats_);
+  }
+
+  LoadStats(const LoadStats&) = delete;
+  LoadStats& operator=(const LoadStats&) = delete;
+
+  void succeeded() { this->stats_.succeeded = TRUE; }
+
+private:
+  bool enabled_;
+  FISIDECAR_LOAD_STATS stats_;
+  const Document& doc_;
+  FIIO_counters io_start_;
+  stats_clock::time_point start_;
+};
+
+void* DLL_CALLCONV
+Open(FreeImageIO* io, fi_handle handle, BOOL read)
+{
+  if(! read)
+    return {};
+
+  try {
+    std::unique_ptr<Document> doc{new Document};
+    if(auto* file = FIIO_get_file(io, handle))
+      doc->hasFileId = FIIO_get_file_id(file, doc->fileId);
+    else if(auto* stream = FIIO_get_memory(io, handle))
+      doc->hasFileId = FIIO_get_memory_id(stream, doc->fileId);
+
+    if(doc->hasFileId) {
+      doc->offset = io->tell_proc(handle);
+      if(auto parked = documents().take(doc->fileId, doc->offset))
+        return parked.release();
+    }
+    return doc.release();
+  } catch (const std::exception&) {
+    return {};
+  }
+}
+
+void DLL_CALLCONV
+Close(FreeImageIO* io, fi_handle handle, void* data)
+{
+  std::unique_ptr<Document> doc{static_cast<Document*>(data)};
+  if(doc && doc->isParkable())
+    documents().park(std::move(doc));
+}
+
+int DLL_CALLCONV
+PageCount(FreeImageIO* io, fi_handle handle, void* data)
+{
+  auto* doc = static_cast<Document*>(data);
+  if(! doc)
+    return 0;
+
+  doc->isMultipage = true;
+  try {
+    if(! doc->isParsed() && doc->parse(io, handle, false).code)
+      return 0;
+  } catch (const std::exception&) {
+    return 0;
+  }
+  return int(doc->pages.size());
+}
+
+FIBITMAP* DLL_CALLCONV
+Load(FreeImageIO* io, fi_handle handle, int page, Args args, void* data)
+{
+  using unique_himage = unique_ptr<heif_image_handle, void (*)(const heif_image_handle*)>;
+
+  assert(io);
+  assert(handle);
+
+  const FirstLoadTimer first_load_timer;
+
+  const auto format_id = [&]{ 
+    const auto start_pos = io->tell_proc(handle);
+    const auto format_id = h::Validate(io, handle) ? h::s_format_id : a::s_format_id;
+    io->seek_proc(handle, start_pos, SEEK_SET);
+    return format_id;
+  }(); //< invoke
+
+  const auto max_threads = getMaxThreads(::flags(args));
+
+  const auto thumbnail_mode = ::flags(args) & FISIDECAR_LOAD_HEIF_THUMBNAIL_MASK;
+
+  auto output_msg = output_msg_t{args, format_id};
+  output_msg.cancel = s_cancel_token;
+
+  // Checked between the phases (and tiles), and by libheif during a decode with 1.19+ (setCancelHook)
+  const auto canceled = [&] {
+    if(! isCanceled(output_msg))
+      return false;
+    output_msg("Canceled");
+    return true;
+  };
+
+  try {
+#if defined(FI_ADV)
+    FIProgress progress(args->cbOption, args->cb, FI_OP_LOAD, format_id);
+    if(progress.isCanceled()) {
+      return {};
+    }
+#endif
+    Document local_doc;
+    auto* doc = data ? static_cast<Document*>(data) : &local_doc;
+    if(page >= 0)
+      doc->isMultipage = true;
+
+    LoadStats load_stats{output_msg, *doc};
+
+    if(canceled())
+      return {};
+
+    // --- read file, unless already parsed (open_proc)
+
+    if(! doc->isParsed()) {
+      StatsTimer read_timer{output_msg, &FISIDECAR_LOAD_STATS::read_ms};
+      const auto err = doc->parse(io, handle, ::flags(args) & FISIDECAR_LOAD_HEIF_CACHED_IO);
+      if(err.code) {
+        output_msg(err.message);
+        return {};
+      }
+    }
+
+    if(canceled())
+      return {};
+
+    auto* ctx = doc->ctx.get();
+    
+    // --- get handle to the image - the primary one, or the requested page
+    
+    if(page >= int(doc->pages.size())) {
+      output_msg("Invalid page %d", page);
+      return {};
+    }
+
+    heif_image_handle* himage;
+    const auto err = page < 0
+      ? heif_context_get_primary_image_handle(ctx, &himage)
+      : heif_context_get_image_handle(ctx, doc->pages[size_t(page)], &himage);
+
+    if(err.code) {
+      output_msg(err.message);
+      return {};
+    }
+    unique_himage himage_storage{himage, &heif_image_handle_release};
+
+    // libheif decodes grids with its own threads (when we do not), limit them to the share of the shared budget
+    ::call_context_set_max_decoding_threads(ctx, int(parallel_share(getTileCount(himage, max_threads), max_threads)));
+
+    // --- in thumbnail-only mode, the thumbnail (if any) takes the place of the primary image, which is never decoded
+    // With scale-on-load, the same happens if the thumbnail is big enough for the requested size
+
+    heif_image_handle* hsource = himage;
+    unique_himage hsource_storage{nullptr, &heif_image_handle_release};
+    if(thumbnail_mode == FISIDECAR_LOAD_HEIF_THUMBNAIL_ONLY) {
+      if(auto* hthumb = getThumbnail(himage, output_msg)) {
+        hsource_storage.reset(hthumb);
+        hsource = hthumb;
+      }
+    } else if(const auto requested_size = getRequestedSize(::flags(args))) {
+      if(auto* hthumb = getThumbnail(himage, output_msg)) {
+        hsource_storage.reset(hthumb);
+        const auto size = getSize(hthumb, ::flags(args) & FISIDECAR_LOAD_HEIF_TRANSFORM);
+        if(std::max(size.first, size.second) >= requested_size)
+          hsource = hthumb;
+      }
+    }
+
+    // --- decode image and get profile
+#if defined(FI_ADV)
+    static const auto read_end_progress = .3;
+    static const auto decode_end_progress = .9;
+    if(! progress.reportProgress(read_end_progress))
+      return {};
+
+    Progress progress_decode{&progress, read_end_progress, decode_end_progress}; 
+    output_msg.progress = &progress_decode; 
+#endif
+    auto dib = loadFromHimage(hsource, max_threads, output_msg);
+    if(! dib)
+      return {};
+
+    unique_dib dib_storage{dib};
+
+    if(canceled())
+      return {};
+    
+    // --- get metadata
+
+    loadMetadata(himage, dib, output_msg);
+
+    // --- get thumb
+
+    // Header-only loads stay header-only, unless the thumbnail is explicitly asked for.
+    // (FreeImage drops thumbnails without pixels, so there is no header-only thumbnail either.)
+    // Neither is it attached, when it is the image itself.
+    const auto shouldLoadThumbnail = hsource == himage && (thumbnail_mode == FISIDECAR_LOAD_HEIF_THUMBNAIL_ALWAYS
+      || (thumbnail_mode == FISIDECAR_LOAD_HEIF_THUMBNAIL_DEFAULT && ! (::flags(args) & FIF_LOAD_NOPIXELS)));
+
+    if(canceled())
+      return {};
+
+    if(shouldLoadThumbnail) {
+      StatsTimer thumbnail_timer{output_msg, &FISIDECAR_LOAD_STATS::thumbnail_ms};
+      if(auto* hthumb = getThumbnail(himage, output_msg)) {
+        unique_himage himage_storage{hthumb, &heif_image_handle_release};
+
+#if defined(FI_ADV)
+        if(! progress.reportProgress(decode_end_progress)) {
+          return {};
+        }
+
+        FreeImageLoadArgs thArgs{*args};
+        thArgs.flags &= ~(FIF_LOAD_NOPIXELS | FISIDECAR_LOAD_HEIF_SIZE_MASK);
+        thArgs.flags |= FISIDECAR_LOAD_HEIF_SDR; //< thumbnails are for display, keep them 8bit
+        output_msg.args = &thArgs; 
+        output_msg.progress = {};  
+#else
+        output_msg.args &= ~(FIF_LOAD_NOPIXELS | FISIDECAR_LOAD_HEIF_SIZE_MASK);
+        output_msg.args |= FISIDECAR_LOAD_HEIF_SDR; //< thumbnails are for display, keep them 8bit
+#endif
+        output_msg.stats = {}; //< its phases are all in thumbnail_ms
+        auto thumb = loadFromHimage(hthumb, max_threads, output_msg);
+        if(! thumb && isCanceled(output_msg))
+          return {};
+        FreeImage_SetThumbnail(dib, thumb); //< a copy
+        bitmap_pool_release(thumb);
+      }
+    }
+
+    load_stats.succeeded();
+    return dib_storage.release();
+
+  } catch (const std::exception& e) { //< std::bad_alloc to the very least, probably others fom libheif
+    output_msg(e.what());
+    return {};
+  }
+}
+
+// Load arguments for the entry points, other than Load (no callbacks)
+struct LocalArgs
+{
+#if defined(FI_ADV)
+  explicit LocalArgs(int flags) : args{} { this->args.flags = flags; }
+  Args get() const { return &this->args; }
+
+  FreeImageLoadArgs args;
+#else
+  explicit LocalArgs(int flags) : args(flags) {}
+  Args get() const { return this->args; }
+
+  Args args;
+#endif
+};
+
+// HEIF or AVIF, by the main brand - for the messages
+template<class Source>
+int getFormatId(Source& source) {
+  BYTE signature[12] = {};
+  source.peek(signature, sizeof(signature));
+
+  const auto brand = heif_read_main_brand(signature, sizeof(signature));
+  return brand == heif_fourcc_to_brand("avif") || brand == heif_fourcc_to_brand("avis") ? a::s_format_id : h::s_format_id;
+}
+
+// --- saving
+
+using unique_img = unique_ptr<heif_image, void (*)(const heif_image*)>;
+
+// The part of the dib at x0, y0 (from the top) as an interleaved image - 8 bit RGB(A), or 10 bit for FIT_RGB(A)16.
+// A bigger plane_width, plane_height (an edge tile of a grid) is padded by repeating the last column and row.
+heif_error createImage(FIBITMAP* dib, unsigned x0, unsigned y0, unsigned width, unsigned height, const FIICCPROFILE* icc, unsigned max_threads, unique_img& img
+  , unsigned plane_width = 0, unsigned plane_height = 0) 
+{
+  plane_width = std::max(plane_width, width);
+  plane_height = std::max(plane_height, height);
+
+  const auto type = FreeImage_GetImageType(dib);
+  const auto bpp = FreeImage_GetBPP(dib);
+  const auto hasAlpha = bpp == 32 || type == FIT_RGBA16;
+  const auto isHDR = type != FIT_BITMAP;
+  const auto bits = isHDR ? 10 : 8;
+
+  const auto chroma = isHDR 
+#if defined(FREEIMAGE_BIGENDIAN)
+  ? (hasAlpha ? heif_chroma_interleaved_RRGGBBAA_BE : heif_chroma_interleaved_RRGGBB_BE)
+#else
+  ? (hasAlpha ? heif_chroma_interleaved_RRGGBBAA_LE : heif_chroma_interleaved_RRGGBB_LE)
+#endif
+  : (hasAlpha ? heif_chroma_interleaved_RGBA : heif_chroma_interleaved_RGB);
+
+  heif_image* out{};
+  auto err = heif_image_create(int(plane_width), int(plane_height), heif_colorspace_RGB, chroma, &out);
+  img.reset(out);
+  if(err.code)
+    return err;
+
+  err = heif_image_add_plane(out, heif_channel_interleaved, int(plane_width), int(plane_height), bits);
+  if(err.code)
+    return err;
+
+  int dst_pitch;
+  auto* dst_line = heif_image_get_plane(out, heif_channel_interleaved, &dst_pitch);
+  const auto src_pitch = FreeImage_GetPitch(dib);
+  const auto* src_line = FreeImage_GetScanLine(dib, int(FreeImage_GetHeight(dib) - 1 - y0)) + x0 * (bpp / 8);
+  swizzle_image(get_unswizzle_row(bpp), src_line, -ptrdiff_t(src_pitch), dst_line, dst_pitch, width, height, bits, max_threads);
+
+  // --- padding
+  const auto dst_bytespp = (hasAlpha ? 4u : 3u) * (isHDR ? 2u : 1u);
+  for(auto y = 0u; y < height && plane_width > width; y++) {
+    auto* line = dst_line + ptrdiff_t(dst_pitch) * y;
+    for(auto x = width; x < plane_width; x++)
+      memcpy(line + x * dst_bytespp, line + (width - 1) * dst_bytespp, dst_bytespp);
+  }
+  for(auto y = height; y < plane_height; y++)
+    memcpy(dst_line + ptrdiff_t(dst_pitch) * y, dst_line + ptrdiff_t(dst_pitch) * (height - 1), plane_width * dst_bytespp);
+
+  if(icc && icc->data && icc->size)
+    err = heif_image_set_raw_color_profile(out, "prof", icc->data, icc->size);
+  return err;
+}
+
+// Grid tiles all have the same size, so look for a count, which splits size evenly into even tiles, near tile_size. 0 if there is none
+unsigned getGridTiles(unsigned size, unsigned tile_size) {
+  const auto min_tiles = (size + tile_size - 1) / tile_size;
+  for(auto tiles = min_tiles; tiles <= min_tiles * 2 && tiles <= 256; ++tiles) {
+    if(size % tiles == 0 && (size / tiles) % 2 == 0)
+      return tiles;
+  }
+  return 0;
+}
+
+void configureEncoder(heif_encoder* encoder, int flags) {
+  if(flags & FISIDECAR_SAVE_HEIF_LOSSLESS) {
+    heif_encoder_set_lossless(encoder, 1);
+    heif_encoder_set_parameter_string(encoder, "chroma", "444");
+  } else if(const auto quality = flags & FISIDECAR_SAVE_HEIF_QUALITY_MASK) {
+    heif_encoder_set_lossy_quality(encoder, std::min(quality, 100));
+  }
+
+  // aom, rav1e and svt take "speed", x265 takes "preset" - the one, the encoder does not know, fails harmlessly
+  if(const auto preset = (flags & FISIDECAR_SAVE_HEIF_SPEED_MASK) >> 16) {
+    static const int speeds[] = {0, 7, 9, 2};
+    static const char* const presets[] = {nullptr, "veryfast", "ultrafast", "slow"};
+    heif_encoder_set_parameter_integer(encoder, "speed", speeds[preset]);
+    heif_encoder_set_parameter_string(encoder, "preset", presets[preset]);
+  }
+
+  if(const auto threads = (flags >> 8) & 0xFF) {
+    if(heif_encoder_set_parameter_integer(encoder, "threads", threads).code)
+      heif_encoder_set_parameter_string(encoder, "x265:pools", std::to_string(threads).c_str());
+  }
+}
+
+void addMetadata(heif_context* ctx, const heif_image_handle* himage, FIBITMAP* dib) {
+  FITAG* tag{};
+  if(FreeImage_GetMetadata(FIMD_EXIF_RAW, dib, "ExifRaw", &tag) && FreeImage_GetTagLength(tag)) {
+    // The reverse of loading - drop the "Exif\0\0" signature, libheif wants the TIFF header first
+    const auto* data = static_cast<const BYTE*>(FreeImage_GetTagValue(tag));
+    auto size = size_t(FreeImage_GetTagLength(tag));
+    const auto sizeofSig = sizeof("Exif\0\0") - 1;
+    if(size > sizeofSig && ! memcmp(data, "Exif\0\0", sizeofSig)) {
+      data += sizeofSig;
+      size -= sizeofSig;
+    }
+    heif_context_add_exif_metadata(ctx, himage, data, int(size));
+  }
+  if(FreeImage_GetMetadata(FIMD_XMP, dib, "XMLPacket", &tag) && FreeImage_GetTagLength(tag)) {
+    heif_context_add_XMP_metadata(ctx, himage, FreeImage_GetTagValue(tag), int(FreeImage_GetTagLength(tag)));
+  }
+}
+
+BOOL save(FreeImageIO* io, FIBITMAP* dib, fi_handle handle, int flags, heif_compression_format compression, int format_id)
+{
+  using unique_ctx      = unique_ptr<heif_context, void (*)(heif_context*)>;
+  using unique_encoder  = unique_ptr<heif_encoder, void (*)(heif_encoder*)>;
+  using unique_options  = unique_ptr<heif_encoding_options, void (*)(heif_encoding_options*)>;
+  using unique_nclx     = unique_ptr<heif_color_profile_nclx, void (*)(heif_color_profile_nclx*)>;
+  using unique_himage   = unique_ptr<heif_image_handle, void (*)(const heif_image_handle*)>;
+
+  const LocalArgs args{flags};
+  const auto output_msg = output_msg_t{args.get(), format_id};
+
+  if(! io || ! handle || ! dib || ! FreeImage_HasPixels(dib)) {
+    return FALSE;
+  }
+
+  // The thread limit of the encoder bounds the conversion too
+  const auto threads = unsigned((flags >> 8) & 0xFF);
+  const auto max_threads = threads ? threads : unsigned(FISIDECAR_LOAD_MAXTHREADS_DEFAULT);
+
+  try {
+    // Other than RGB(A), 8 or 16 bit, is converted to 24 bit
+    auto* src = dib;
+    unique_dib converted{nullptr};
+    const auto type = FreeImage_GetImageType(dib);
+    const auto bpp = FreeImage_GetBPP(dib);
+    if(! ((type == FIT_BITMAP && (bpp == 24 || bpp == 32)) || type == FIT_RGB16 || type == FIT_RGBA16)) {
+      converted.reset(type == FIT_BITMAP ? FreeImage_ConvertTo24Bits(dib) : FreeImage_ConvertToStandardType(dib, TRUE));
+      if(converted && FreeImage_GetBPP(converted.get()) != 24)
+        converted.reset(FreeImage_ConvertTo24Bits(converted.get()));
+      if(! converted) {
+        output_msg("Unsupported image type (%d, %d bpp)", int(type), int(bpp));
+        return FALSE;
+      }
+      src = converted.get();
+    }
+    const auto* icc = FreeImage_GetICCProfile(dib);
+    const auto width = FreeImage_GetWidth(src);
+    const auto height = FreeImage_GetHeight(src);
+
+    unique_ctx ctx{libheif_context_alloc(), &heif_context_free};
+
+    heif_encoder* encoder_ptr{};
+    auto err = heif_context_get_encoder_for_format(ctx.get(), compression, &encoder_ptr);
+    unique_encoder encoder{encoder_ptr, &heif_encoder_release};
+    if(err.code) {
+      output_msg(err.message);
+      return FALSE;
+    }
+    configureEncoder(encoder.get(), flags);
+
+    unique_options options{heif_encoding_options_alloc(), &heif_encoding_options_free};
+    unique_nclx nclx{nullptr, &heif_nclx_color_profile_free};
+    if(flags & FISIDECAR_SAVE_HEIF_LOSSLESS) {
+      // Lossless only when the pixels are not converted to YCbCr
+      nclx.reset(heif_nclx_color_profile_alloc());
+      nclx->matrix_coefficients = heif_matrix_coefficients_RGB_GBR;
+      nclx->full_range_flag = 1;
+      options->output_nclx_profile = nclx.get();
+    }
+
+    heif_image_handle* himage_ptr{};
+    auto columns = 0u, rows = 0u;
+#if defined(FISIDECAR_HAS_HEIF_ADD_GRID)
+    auto isPadded = false;
+#endif
+#if defined(FISIDECAR_HAS_HEIF_ENCODE_GRID)
+    if(flags & FISIDECAR_SAVE_HEIF_TILED) {
+      columns = getGridTiles(width, FISIDECAR_SAVE_HEIF_TILE_SIZE);
+      rows = getGridTiles(height, FISIDECAR_SAVE_HEIF_TILE_SIZE);
+#if defined(FISIDECAR_HAS_HEIF_ADD_GRID)
+      // No even split - tiles of the nominal size, the last row and column overhang the image and are cropped by the grid
+      if(! columns || ! rows) {
+        columns = (width + FISIDECAR_SAVE_HEIF_TILE_SIZE - 1) / FISIDECAR_SAVE_HEIF_TILE_SIZE;
+        rows = (height + FISIDECAR_SAVE_HEIF_TILE_SIZE - 1) / FISIDECAR_SAVE_HEIF_TILE_SIZE;
+        isPadded = true;
+      }
+#endif
+      if(! columns || ! rows || columns * rows == 1) {
+        if(columns * rows != 1)
+          output_msg("No even tile size for %ux%u, saving as a single image (padded grids need libheif 1.19)", width, height);
+        columns = rows = 0;
+      }
+    }
+#else
+    if(flags & FISIDECAR_SAVE_HEIF_TILED)
+      output_msg("Grid encoding needs libheif 1.18, saving as a single image");
+#endif
+
+    if(! columns) {
+      unique_img img{nullptr, &heif_image_release};
+      err = createImage(src, 0, 0, width, height, icc, max_threads, img);
+      if(! err.code)
+        err = heif_context_encode_image(ctx.get(), img.get(), encoder.get(), options.get(), &himage_ptr);
+    }
+#if defined(FISIDECAR_HAS_HEIF_ENCODE_GRID)
+#if defined(FISIDECAR_HAS_HEIF_ADD_GRID)
+    else if(isPadded) {
+      const auto tile_size = unsigned(FISIDECAR_SAVE_HEIF_TILE_SIZE);
+      err = heif_context_add_grid_image(ctx.get(), width, height, columns, rows, options.get(), &himage_ptr);
+
+      // A row of tiles at a time, prepared in parallel, libheif encodes them one by one, each with the encoder threads
+      std::vector<unique_img> tiles;
+      for(auto tile_y = 0u; tile_y < rows && ! err.code; tile_y++) {
+        tiles.clear();
+        for(auto i = 0u; i < columns; ++i)
+          tiles.emplace_back(nullptr, &heif_image_release);
+
+        std::mutex mutex; //< guards the below
+        heif_error tile_err{heif_error_Ok, heif_suberror_Unspecified, "Success"};
+        parallel_for(columns, max_threads, [&](unsigned tile_x) {
+          const auto x0 = tile_x * tile_size, y0 = tile_y * tile_size;
+          auto e = createImage(src, x0, y0, std::min(tile_size, width - x0), std::min(tile_size, height - y0), icc, 1, tiles[tile_x], tile_size, tile_size);
+          if(! e.code && nclx) //< the tiles are encoded without the options
+            e = heif_image_set_nclx_color_profile(tiles[tile_x].get(), nclx.get());
+          if(e.code) {
+            std::lock_guard<std::mutex> lock(mutex);
+            tile_err = e;
+          }
+        });
+
+        err = tile_err;
+        for(auto tile_x = 0u; tile_x < columns && ! err.code; tile_x++)
+          err = heif_context_add_image_tile(ctx.get(), himage_ptr, tile_x, tile_y, tiles[tile_x].get(), encoder.get());
+      }
+    }
+#endif
+    else {
+      // The tiles are prepared in parallel, libheif encodes them one by one, each with the encoder threads
+      const auto tile_width = width / columns;
+      const auto tile_height = height / rows;
+      std::vector<unique_img> tiles;
+      tiles.reserve(columns * rows);
+      for(auto i = 0u; i < columns * rows; ++i)
+        tiles.emplace_back(nullptr, &heif_image_release);
+
+      std::mutex mutex; //< guards the below
+      heif_error tile_err{heif_error_Ok, heif_suberror_Unspecified, "Success"};
+      parallel_for(columns * rows, max_threads, [&](unsigned i) {
+        const auto e = createImage(src, (i % columns) * tile_width, (i / columns) * tile_height, tile_width, tile_height, icc, 1, tiles[i]);
+        if(e.code) {
+          std::lock_guard<std::mutex> lock(mutex);
+          tile_err = e;
+        }
+      });
+
+      err = tile_err;
+      if(! err.code) {
+        std::vector<heif_image*> grid(tiles.size());
+        std::transform(tiles.begin(), tiles.end(), grid.begin(), [](const unique_img& tile) { return tile.get(); });
+        err = heif_context_encode_grid(ctx.get(), grid.data(), uint16_t(rows), uint16_t(columns), encoder.get(), options.get(), &himage_ptr);
+      }
+    }
+#endif
+    unique_himage himage{himage_ptr, &heif_image_handle_release};
+    if(err.code) {
+      output_msg(err.message);
+      return FALSE;
+    }
+
+    addMetadata(ctx.get(), himage.get(), dib);
+
+    FIIO_writer writer{io, handle};
+    err = heif_context_write(ctx.get(), &writer, &writer);
+    if(err.code) {
+      output_msg(err.message);
+      return FALSE;
+    }
+    return TRUE;
+
+  } catch (const std::exception& e) {
+    output_msg(e.what());
+    return FALSE;
+  }
+}
+
+} // namespace
+
+// --- region and tile decoding
+
+struct FISIDECAR_IMAGE
+{
+  using unique_ctx    = unique_ptr<heif_context, void (*)(heif_context*)>;
+  using unique_himage = unique_ptr<heif_image_handle, void (*)(const heif_image_handle*)>;
+  using unique_file   = unique_ptr<FILE, int (*)(FILE*)>;
+
+  explicit FISIDECAR_IMAGE(int flags)
+    : file{nullptr, &fclose}
+    , ctx{nullptr, &heif_context_free}
+    , himage{nullptr, &heif_image_handle_release}
+    , max_threads(getMaxThreads(flags))
+    , format_id{}
+    , layout{}
+    , format{}
+#if defined(FISIDECAR_HAS_HEIF_TILES)
+    , tiling{}
+#endif
+    , isTiled{}
+    , args{flags}
+  {}
+
+  output_msg_t output_msg() const {
+    return output_msg_t{this->args.get(), this->format_id};
+  }
+
+  bool open(std::unique_ptr<FIIO_source> source);
+
+  unique_file file;                     //< for images, opened by file name
+  std::unique_ptr<FIIO_source> source;  //< must outlive ctx
+  unique_ctx ctx;
+  unique_himage himage;
+
+  unsigned max_threads;
+  int format_id;
+  FISIDECAR_TILE_LAYOUT layout;
+  PixelFormat format;
+#if defined(FISIDECAR_HAS_HEIF_TILES)
+  heif_image_tiling tiling;
+#endif
+  bool isTiled;
+  LocalArgs args;
+};
+
+bool FISIDECAR_IMAGE::open(std::unique_ptr<FIIO_source> source) {
+  this->source = std::move(source);
+  this->format_id = getFormatId(*this->source);
+  const auto output_msg = this->output_msg();
+
+  this->ctx.reset(libheif_context_alloc());
+  ::call_context_set_max_decoding_threads(this->ctx.get(), int(this->max_threads));
+
+  auto err = this->source->read(this->ctx.get());
+  if(err.code) {
+    output_msg(err.message);
+    return false;
+  }
+
+  heif_image_handle* himage;
+  err = heif_context_get_primary_image_handle(this->ctx.get(), &himage);
+  if(err.code) {
+    output_msg(err.message);
+    return false;
+  }
+  this->himage.reset(himage);
+
+  this->format = getPixelFormat(himage, ::flags(output_msg.args) & FISIDECAR_LOAD_HEIF_SDR);
+
+  const auto size = getSize(himage, false);
+  this->layout = {size.first, size.second, size.first, size.second, 1, 1, this->format.type, this->format.bpp};
+
+#if defined(FISIDECAR_HAS_HEIF_TILES)
+  if((this->isTiled = getTiling(himage, false, this->tiling))) {
+    this->layout.tile_width = this->tiling.tile_width;
+    this->layout.tile_height = this->tiling.tile_height;
+    this->layout.columns = this->tiling.num_columns;
+    this->layout.rows = this->tiling.num_rows;
+  }
+#endif
+  return true;
+}
+
+namespace {
+
+FISIDECAR_IMAGE* openImage(FISIDECAR_IMAGE* image, FIIO_source* source) {
+  std::unique_ptr<FISIDECAR_IMAGE> image_storage{image};
+  std::unique_ptr<FIIO_source> source_storage{source};
+  if(! image || ! source)
+    return {};
+
+  try {
+    return image->open(std::move(source_storage)) ? image_storage.release() : nullptr;
+  } catch (const std::exception& e) {
+    image->output_msg()(e.what());
+    return {};
+  }
+}
+
+// Decodes the tiles (or the whole image), intersecting region, into dib (covering region)
+bool decodeRegion(const FISIDECAR_IMAGE* image, FIBITMAP* dib, const Rect& region) {
+  using unique_opts = unique_ptr<heif_decoding_options, void (*)(heif_decoding_options*)>;
+  using unique_img  = unique_ptr<heif_image, void (*)(const heif_image*)>;
+
+  const auto output_msg = image->output_msg();
+
+  auto* opts = heif_decoding_options_alloc();
+  unique_opts opts_storage{opts, &heif_decoding_options_free};
+  opts->convert_hdr_to_8bit = ::flags(output_msg.args) & FISIDECAR_LOAD_HEIF_SDR;
+  opts->ignore_transformations = true;
+
+  const auto decoder_id = getDecoderId(image->format_id);
+  setDecoderId(opts, decoder_id);
+
+#if defined(FISIDECAR_HAS_HEIF_TILES)
+  if(image->isTiled)
+    return decodeTiles(image->himage.get(), image->tiling, image->format.chroma, opts, dib, region, image->max_threads, output_msg);
+#endif
+
+  heif_image* img;
+  const auto err = heif_decode_image(image->himage.get(), &img, heif_colorspace_RGB, image->format.chroma, opts);
+  if(err.code) {
+    output_msg(err.message);
+    return false;
+  }
+  unique_img img_storage{img, &heif_image_release};
+
+  if(! copyToRegion(img, 0, 0, dib, region, image->max_threads)) {
+    output_msg("Unexpected source format");
+    return false;
+  }
+  return true;
+}
+
+} // namespace
+
+FISIDECAR_IMAGE* OpenImage(const char* filename, int flags) {
+  auto* image = new (std::nothrow) FISIDECAR_IMAGE(flags);
+  if(! image)
+    return {};
+
+  image->file.reset(filename ? fopen(filename, "rb") : nullptr);
+  if(! image->file) {
+    image->output_msg()("Failed to open file %s", filename ? filename : "");
+    delete image;
+    return {};
+  }
+  return openImage(image, new (std::nothrow) FIIO_source(image->file.get(), flags & FISIDECAR_LOAD_HEIF_CACHED_IO));
+}
+
+FISIDECAR_IMAGE* OpenImage(FIMEMORY* stream, int flags) {
+  if(! stream)
+    return {};
+  return openImage(new (std::nothrow) FISIDECAR_IMAGE(flags), new (std::nothrow) FIIO_source(stream));
+}
+
+FISIDECAR_IMAGE* OpenImage(FreeImageIO* io, fi_handle handle, int flags) {
+  if(! io || ! handle)
+    return {};
+  return openImage(new (std::nothrow) FISIDECAR_IMAGE(flags), new (std::nothrow) FIIO_source(io, handle, flags & FISIDECAR_LOAD_HEIF_CACHED_IO));
+}
+
+void CloseImage(FISIDECAR_IMAGE* image) {
+  delete image;
+}
+
+BOOL GetTileLayout(const FISIDECAR_IMAGE* image, FISIDECAR_TILE_LAYOUT* layout) {
+  if(! image || ! layout)
+    return FALSE;
+
+  *layout = image->layout;
+  return TRUE;
+}
+
+FIBITMAP* LoadRegion(FISIDECAR_IMAGE* image, int left, int top, int right, int bottom) {
+  if(! image)
+    return {};
+
+  const auto output_msg = image->output_msg();
+
+  const auto clip = [](int v, unsigned size) { return unsigned(std::min<int64_t>(std::max(v, 0), size)); };
+  const Rect region{clip(left, image->layout.width), clip(top, image->layout.height), clip(right, image->layout.width), clip(bottom, image->layout.height)};
+  if(region.left >= region.right || region.top >= region.bottom) {
+    output_msg("Empty region");
+    return {};
+  }
+
+  try {
+    auto* dib = allocateDib(image->format.type, region.right - region.left, region.bottom - region.top, image->format.bpp, output_msg);
+    if(! dib)
+      return {};
+    unique_dib dib_storage{dib};
+
+    if(! decodeRegion(image, dib, region))
+      return {};
+
+    addColorProfile(image->himage.get(), dib, ::flags(output_msg.args), output_msg);
+    return dib_storage.release();
+
+  } catch (const std::exception& e) {
+    output_msg(e.what());
+    return {};
+  }
+}
+
+BOOL LoadTile(FISIDECAR_IMAGE* image, unsigned column, unsigned row, FIBITMAP* dst, int dst_left, int dst_top) {
+  if(! image || ! dst)
+    return FALSE;
+
+  const auto output_msg = image->output_msg();
+  const auto& layout = image->layout;
+
+  if(column >= layout.columns || row >= layout.rows || dst_left < 0 || dst_top < 0) {
+    output_msg("Invalid tile");
+    return FALSE;
+  }
+  if(FreeImage_GetImageType(dst) != layout.type || FreeImage_GetBPP(dst) != layout.bpp) {
+    output_msg("Tile destination of unexpected type");
+    return FALSE;
+  }
+
+  const auto x0 = column * layout.tile_width;
+  const auto y0 = row * layout.tile_height;
+  const Rect region{x0, y0, std::min(x0 + layout.tile_width, layout.width), std::min(y0 + layout.tile_height, layout.height)};
+  const auto right = unsigned(dst_left) + (region.right - region.left);
+  const auto bottom = unsigned(dst_top) + (region.bottom - region.top);
+
+  try {
+    // A view of the destination, covering just the tile
+    unique_dib view{(right <= FreeImage_GetWidth(dst) && bottom <= FreeImage_GetHeight(dst))
+      ? FreeImage_CreateView(dst, unsigned(dst_left), unsigned(dst_top), right, bottom) 
+      : nullptr};
+    if(! view) {
+      output_msg("Tile destination too small");
+      return FALSE;
+    }
+
+    return decodeRegion(image, view.get(), region) ? TRUE : FALSE;
+
+  } catch (const std::exception& e) {
+    output_msg(e.what());
+    return FALSE;
+  }
+}
+
+// --- streaming to a sink
+
+namespace {
+
+using unique_chunk = unique_ptr<FIBITMAP, void (*)(FIBITMAP*)>;
+
+struct SinkTarget
+{
+  FISIDECAR_SINK sink;
+  void* user_data;
+  std::mutex mutex; //< the sink is called by one thread at a time
+};
+
+// A bitmap for a part of the image - taken from the pool and returned to it, once passed to the sink
+unique_chunk allocateChunk(const FISIDECAR_IMAGE* image, const Rect& region) {
+  const auto width = region.right - region.left;
+  const auto height = region.bottom - region.top;
+
+  auto* chunk = bitmap_pool_acquire(image->format.type, width, height, image->format.bpp);
+  if(! chunk)
+    chunk = FreeImage_AllocateT(image->format.type, int(width), int(height), int(image->format.bpp));
+  return unique_chunk{chunk, &bitmap_pool_release};
+}
+
+// Copies the part of the decoded images (placed at x0, y0), which falls into region, to a chunk and passes it to the sink.
+// Returns an error message, null on success
+const char* sinkRegion(const FISIDECAR_IMAGE* image, const std::vector<std::tuple<const heif_image*, unsigned, unsigned>>& imgs
+  , const Rect& region, SinkTarget& target, unsigned max_threads)
+{
+  auto chunk = allocateChunk(image, region);
+  if(! chunk)
+    return FI_MSG_ERROR_DIB_MEMORY;
+
+  for(const auto& img : imgs) {
+    if(! copyToRegion(std::get<0>(img), std::get<1>(img), std::get<2>(img), chunk.get(), region, max_threads))
+      return "Unexpected source format";
+  }
+
+  std::lock_guard<std::mutex> lock(target.mutex);
+  return target.sink(chunk.get(), region.left, region.top, target.user_data) ? nullptr : "Canceled";
+}
+
+#if defined(FISIDECAR_HAS_HEIF_TILES)
+
+// Decodes a row of tiles at a time (in parallel) and passes it on in bands, top to bottom
+bool sinkTileRows(const FISIDECAR_IMAGE* image, const heif_decoding_options* opts, unsigned band_height, SinkTarget& target) {
+  using unique_img  = unique_ptr<heif_image, void (*)(const heif_image*)>;
+
+  const auto output_msg = image->output_msg();
+  const auto& tiling = image->tiling;
+  const auto width = image->layout.width;
+  const auto height = image->layout.height;
+
+  std::vector<unique_img> tiles;
+  std::vector<std::string> errors(tiling.num_columns);
+  std::vector<std::tuple<const heif_image*, unsigned, unsigned>> imgs;
+
+  for(unsigned tile_y = 0; tile_y < tiling.num_rows; tile_y++) {
+    if(isCanceled(output_msg)) {
+      output_msg("Canceled");
+      return false;
+    }
+
+    tiles.clear();
+    for(unsigned i = 0; i < tiling.num_columns; i++)
+      tiles.emplace_back(nullptr, &heif_image_release);
+
+    parallel_for(tiling.num_columns, image->max_threads, [&](unsigned tile_x) {
+      heif_image* img;
+      const auto err = heif_image_handle_decode_image_tile(image->himage.get(), &img, heif_colorspace_RGB, image->format.chroma, opts, tile_x, tile_y);
+      if(err.code)
+        errors[tile_x] = err.message;
+      else
+        tiles[tile_x].reset(img);
+    });
+
+    imgs.clear();
+    for(unsigned tile_x = 0; tile_x < tiling.num_columns; tile_x++) {
+      if(! tiles[tile_x]) {
+        output_msg(errors[tile_x].c_str());
+        return false;
+      }
+      imgs.emplace_back(tiles[tile_x].get(), tile_x * tiling.tile_width, tile_y * tiling.tile_height);
+    }
+
+    // Edge tiles overhang the image
+    const auto y0 = tile_y * tiling.tile_height;
+    const auto y1 = std::min(y0 + tiling.tile_height, height);
+    for(auto top = y0; top < y1; top += band_height) {
+      if(const auto* message = sinkRegion(image, imgs, Rect{0, top, width, std::min(top + band_height, y1)}, target, 1)) {
+        output_msg(message);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+#endif // FISIDECAR_HAS_HEIF_TILES
+
+} // namespace
+
+BOOL LoadToSink(FISIDECAR_IMAGE* image, FISIDECAR_SINK sink, void* user_data, int mode, unsigned band_height) {
+  using unique_opts = unique_ptr<heif_decoding_options, void (*)(heif_decoding_options*)>;
+  using unique_img  = unique_ptr<heif_image, void (*)(const heif_image*)>;
+
+  if(! image || ! sink)
+    return FALSE;
+
+  static const unsigned default_band_height = 64;
+
+  const auto output_msg = image->output_msg();
+  const auto& layout = image->layout;
+  SinkTarget target{sink, user_data, {}};
+
+  try {
+    auto* opts = heif_decoding_options_alloc();
+    unique_opts opts_storage{opts, &heif_decoding_options_free};
+    opts->convert_hdr_to_8bit = ::flags(output_msg.args) & FISIDECAR_LOAD_HEIF_SDR;
+    opts->ignore_transformations = true;
+
+    const auto decoder_id = getDecoderId(image->format_id);
+    setDecoderId(opts, decoder_id);
+
+#if defined(FISIDECAR_HAS_HEIF_TILES)
+    if(image->isTiled) {
+      if(mode == FISIDECAR_SINK_ROWS)
+        return sinkTileRows(image, opts, band_height ? band_height : layout.tile_height, target) ? TRUE : FALSE;
+
+      // Each tile, as soon as it is decoded - in any order
+      const Rect all{0, 0, layout.width, layout.height};
+      return decodeTiles(image->himage.get(), image->tiling, image->format.chroma, opts, all, image->max_threads
+        , [&](const heif_image* img, unsigned x0, unsigned y0) {
+          const Rect tile{x0, y0, std::min(x0 + layout.tile_width, layout.width), std::min(y0 + layout.tile_height, layout.height)};
+          return sinkRegion(image, {std::make_tuple(img, x0, y0)}, tile, target, 1);
+        }, output_msg) ? TRUE : FALSE;
+    }
+#endif
+
+    // A single tile - decoded whole, then passed on in bands (as the tile, in FISIDECAR_SINK_TILES mode)
+    heif_image* img;
+    const auto err = heif_decode_image(image->himage.get(), &img, heif_colorspace_RGB, image->format.chroma, opts);
+    if(err.code) {
+      output_msg(err.message);
+      return FALSE;
+    }
+    unique_img img_storage{img, &heif_image_release};
+
+    const auto rows = mode == FISIDECAR_SINK_ROWS ? (band_height ? band_height : default_band_height) : layout.height;
+    for(unsigned top = 0; top < layout.height; top += rows) {
+      if(isCanceled(output_msg)) {
+        output_msg("Canceled");
+        return FALSE;
+      }
+      if(const auto* message = sinkRegion(image, {std::make_tuple(img, 0u, 0u)}, Rect{0, top, layout.width, std::min(top + rows, layout.height)}, target, image->max_threads)) {
+        output_msg(message);
+        return FALSE;
+      }
+    }
+    return TRUE;
+
+  } catch (const std::exception& e) {
+    output_msg(e.what());
+    return FALSE;
   }
+}
 
-  return dib_storage.release();
+// --- probe
+
+namespace {
+
+void copyString(char* dst, size_t size, const char* src) {
+  if(! src)
+    src = "";
+  const auto count = std::min(size - 1, strlen(src));
+  memcpy(dst, src, count);
+  dst[count] = 0;
 }
 
-FIBITMAP* DLL_CALLCONV
-Load(FreeImageIO* io, fi_handle handle, int page, Args args, void* data)
-{
+BOOL probe(FIIO_source* source, FISIDECAR_PROBE* probe) {
   using unique_ctx    = unique_ptr<heif_context, void (*)(heif_context*)>;
   using unique_himage = unique_ptr<heif_image_handle, void (*)(const heif_image_handle*)>;
 
-  assert(io);
-  assert(handle);
-
-  const auto format_id = [&]{ 
-    const auto start_pos = io->tell_proc(handle);
-    const auto format_id = h::Validate(io, handle) ? h::s_format_id : a::s_format_id;
-    io->seek_proc(handle, start_pos, SEEK_SET);
-    return format_id;
-  }(); //< invoke
+  std::unique_ptr<FIIO_source> source_storage{source};
+  if(! source || ! probe)
+    return FALSE;
 
-  const auto max_threads = [&]{ 
-    std::bitset<FISIDECAR_LOAD_MAXTHREADS_VALUE_SIZE> mask; 
-    mask.set(); 
-    const auto val = ::flags(args) & mask.to_ulong(); 
-    return val ? val : FISIDECAR_LOAD_MAXTHREADS_DEFAULT;
-  }(); //< invoke
+  *probe = {};
 
-  auto output_msg = output_msg_t{args, format_id};
+  const auto format_id = getFormatId(*source);
+  const LocalArgs args{0};
+  const auto output_msg = output_msg_t{args.get(), format_id};
 
   try {
-#if defined(FI_ADV)
-    FIProgress progress(args->cbOption, args->cb, FI_OP_LOAD, format_id);
-    if(progress.isCanceled()) {
-      return {};
-    }
-#endif
-    auto* ctx = heif_context_alloc();
-    unique_ctx ctx_storage{ctx, &heif_context_free};
-
-    ::call_context_set_max_decoding_threads(ctx, max_threads);
-
-    FIIO fio(io, handle);
-    FIIO_reader fio_reader;
-
-    // --- read file
-
-    auto err = heif_context_read_from_reader(ctx, &fio_reader, &fio, nullptr);
+    // --- parse the boxes, no decoding
 
+    unique_ctx ctx{libheif_context_alloc(), &heif_context_free};
+    auto err = source->read(ctx.get());
     if(err.code) {
       output_msg(err.message);
-      return {};
+      return FALSE;
     }
-    
-    // --- get handle to the primary image
-    
-    heif_image_handle* himage;
-    err = heif_context_get_primary_image_handle(ctx, &himage);
 
+    heif_image_handle* himage;
+    err = heif_context_get_primary_image_handle(ctx.get(), &himage);
     if(err.code) {
       output_msg(err.message);
-      return {};
+      return FALSE;
     }
     unique_himage himage_storage{himage, &heif_image_handle_release};
 
-    // --- decode image and get profile
-#if defined(FI_ADV)
-    static const auto read_end_progress = .3;
-    static const auto decode_end_progress = .9;
-    if(! progress.reportProgress(read_end_progress))
-      return {};
+    probe->fif = FREE_IMAGE_FORMAT(format_id);
+    probe->width = unsigned(heif_image_handle_get_width(himage));
+    probe->height = unsigned(heif_image_handle_get_height(himage));
+    probe->ispe_width = unsigned(heif_image_handle_get_ispe_width(himage));
+    probe->ispe_height = unsigned(heif_image_handle_get_ispe_height(himage));
+    probe->luma_bits = unsigned(std::max(heif_image_handle_get_luma_bits_per_pixel(himage), 0));
+    probe->chroma_bits = unsigned(std::max(heif_image_handle_get_chroma_bits_per_pixel(himage), 0));
+    probe->has_alpha = heif_image_handle_has_alpha_channel(himage) ? TRUE : FALSE;
+
+    heif_colorspace colorspace{heif_colorspace_undefined};
+    heif_chroma chroma{heif_chroma_undefined};
+    if(! heif_image_handle_get_preferred_decoding_colorspace(himage, &colorspace, &chroma).code) {
+      probe->is_monochrome = colorspace == heif_colorspace_monochrome ? TRUE : FALSE;
+      switch(chroma) {
+        case heif_chroma_monochrome: probe->chroma = 400; break;
+        case heif_chroma_420: probe->chroma = 420; break;
+        case heif_chroma_422: probe->chroma = 422; break;
+        case heif_chroma_444: probe->chroma = 444; break;
+        default: break;
+      }
+    }
 
-    Progress progress_decode{&progress, read_end_progress, decode_end_progress}; 
-    output_msg.progress = &progress_decode; 
+    switch(heif_image_handle_get_color_profile_type(himage)) {
+      case heif_color_profile_type_nclx: probe->profile = FISIDECAR_PROFILE_NCLX; break;
+      case heif_color_profile_type_rICC:
+      case heif_color_profile_type_prof: probe->profile = FISIDECAR_PROFILE_ICC; break;
+      default: probe->profile = FISIDECAR_PROFILE_NONE; break;
+    }
+
+    probe->thumbnails = unsigned(std::max(heif_image_handle_get_number_of_thumbnails(himage), 0));
+    probe->pages = unsigned(std::max(heif_context_get_number_of_top_level_images(ctx.get()), 0));
+
+    probe->tile_width = probe->ispe_width;
+    probe->tile_height = probe->ispe_height;
+    probe->tile_columns = probe->tile_rows = 1;
+#if defined(FISIDECAR_HAS_HEIF_TILES)
+    heif_image_tiling tiling;
+    if(getTiling(himage, false, tiling)) {
+      probe->tile_width = tiling.tile_width;
+      probe->tile_height = tiling.tile_height;
+      probe->tile_columns = tiling.num_columns;
+      probe->tile_rows = tiling.num_rows;
+    }
 #endif
-    auto dib = loadFromHimage(himage, output_msg);
-    if(! dib)
-      return {};
 
-    unique_dib dib_storage{dib};
-    
-    // --- get metadata
+    // --- metadata, just the types and sizes
 
-    {
-      static const auto idsCount = 5; //< made-up number, really
-      heif_item_id ids[idsCount];
-      unique_arr<heif_item_id> ids_storage;
-      heif_item_id* items = ids;
-
-      const char* filter = {};
-      const auto itemsCount = heif_image_handle_get_number_of_metadata_blocks(himage, filter);
-      if(itemsCount > idsCount) {
-        items = new heif_item_id[itemsCount];
-        ids_storage.reset(items);
-      }
+    const auto count = heif_image_handle_get_number_of_metadata_blocks(himage, nullptr);
+    probe->metadata_count = unsigned(std::max(count, 0));
 
-      (void) heif_image_handle_get_list_of_metadata_block_IDs(himage, filter, items, itemsCount);
+    heif_item_id ids[FISIDECAR_PROBE_MAX_METADATA];
+    const auto listed = heif_image_handle_get_list_of_metadata_block_IDs(himage, nullptr, ids, FISIDECAR_PROBE_MAX_METADATA);
+    for(int i = 0; i < listed; i++) {
+      auto& info = probe->metadata[i];
+      copyString(info.type, sizeof(info.type), heif_image_handle_get_metadata_type(himage, ids[i]));
+      copyString(info.content_type, sizeof(info.content_type), heif_image_handle_get_metadata_content_type(himage, ids[i]));
+      info.size = unsigned(heif_image_handle_get_metadata_size(himage, ids[i]));
+    }
+    return TRUE;
 
-      for(const auto* it = items; it != items + itemsCount; it++) {
-        const auto type = std::string(heif_image_handle_get_metadata_type(himage, *it)); //< We count on SSO this to be cheap                                                           //<
+  } catch (const std::exception& e) {
+    output_msg(e.what());
+    return FALSE;
+  }
+}
 
-        if(type == "Exif") {
-          auto block = get_metadata_block(*himage, *it);
+} // namespace
 
-          if(! block.first) {
-            output_msg("Out of memory for %s block", type.c_str()); 
-          } else {
-            // First 4 bytes are the offset into the block where the data starts
-            // (https://github.com/strukturag/libheif/issues/269#issuecomment-667149770)
-            const auto size = block.second;
-            const auto* const data = static_cast<unsigned char*>(block.first.get());
-            assert(size > 4);
-            const auto offset = unsigned(data[0] << 4) | (data[1] << 3) | (data[2] << 2) | data[3];
-            
-            if(size > (4 + offset)) {
-
-              // ### However, where the data starts is the byte order (TIFF header), 
-              // skiping over the "exif\0\0" signature, if any. 
-              // This creates problems: 
-              //  - libexif fails to load such blocks (https://github.com/libexif/libexif/issues/58)
-              //  - FreeImage fails to save such blocks in JPEG and others.
-              // DO THE UGLY THING and preped a signatire.
-
-              const auto sizeofSig = sizeof("Exif\0\0") - 1;
-              const auto new_size = sizeofSig + (size - (4 + offset));
-              const auto new_data = static_cast<unsigned char*>(malloc(new_size));
-
-              if(! new_data) {
-                output_msg("Out of memory for %s block", type.c_str()); 
-              } else {
-                memcpy(new_data, "Exif\0\0", sizeofSig);
-                memcpy(new_data + sizeofSig, data + (4 + offset), new_size - sizeofSig);
-
-                block.second = new_size;
-                block.first.reset(new_data);
-
-                addExif(dib, block.first.get(), block.second);
-              }
-            }
-          }
-        } else if(type == "mime" && heif_image_handle_get_metadata_content_type(himage, *it) == std::string("application/rdf+xml")) {
-          const auto block = get_metadata_block(*himage, *it);
+BOOL Probe(const char* filename, FISIDECAR_PROBE* info) {
+  using unique_file = unique_ptr<FILE, int (*)(FILE*)>;
 
-          if(! block.first) 
-            output_msg("Out of memory for XMP block"); 
-          else 
-            addXMP(dib, block.first.get(), block.second);
-        } else {
-          output_msg("metadata of type %s not implemented", type.c_str());
-        }
+  unique_file file{filename ? fopen(filename, "rb") : nullptr, &fclose};
+  if(! file)
+    return FALSE;
+  return probe(new (std::nothrow) FIIO_source(file.get()), info);
+}
+
+BOOL Probe(FIMEMORY* stream, FISIDECAR_PROBE* info) {
+  return stream ? probe(new (std::nothrow) FIIO_source(stream), info) : FALSE;
+}
+
+BOOL Probe(FreeImageIO* io, fi_handle handle, FISIDECAR_PROBE* info) {
+  return io && handle ? probe(new (std::nothrow) FIIO_source(io, handle, true), info) : FALSE;
+}
+
+// --- batch loading
+
+namespace {
+
+// Compressed size, the cost estimate of an item. 0 if unknown
+int64_t getInputSize(const FISIDECAR_BATCH_ITEM& item) {
+  using unique_file = unique_ptr<FILE, int (*)(FILE*)>;
+
+  if(item.filename) {
+    unique_file file{fopen(item.filename, "rb"), &fclose};
+    if(! file || fseek(file.get(), 0, SEEK_END))
+      return 0;
+    return std::max<int64_t>(ftell(file.get()), 0);
+  }
+
+  BYTE* data{};
+  DWORD size{};
+  return item.stream && FreeImage_AcquireMemory(item.stream, &data, &size) ? int64_t(size) : 0;
+}
+
+FREE_IMAGE_FORMAT detectFormat(const FISIDECAR_BATCH_ITEM& item) {
+  if(item.fif != FIF_UNKNOWN)
+    return item.fif;
+
+  const auto fif = item.filename ? FreeImage_GetFileType(item.filename) : FreeImage_GetFileTypeFromMemory(item.stream);
+  return fif == FIF_UNKNOWN && item.filename ? FreeImage_GetFIFFromFilename(item.filename) : fif;
+}
+
+// Loads the item with the decoders, selected on the calling thread (this one may be a pool worker)
+void loadItem(FISIDECAR_BATCH_ITEM& item, int flags, const decoder_map_t& decoders) {
+  auto& thread_decoders = threadDecoders();
+  auto own_decoders = thread_decoders;
+  thread_decoders = decoders;
+
+  std::string message;
+  s_message_sink = &message;
+
+  if(item.fif == FIF_UNKNOWN)
+    message = "Unknown file format";
+  else if(item.filename)
+    item.dib = FreeImage_Load(item.fif, item.filename, flags);
+  else
+    item.dib = FreeImage_LoadFromMemory(item.fif, item.stream, flags);
+
+  s_message_sink = {};
+  thread_decoders = std::move(own_decoders);
+
+  if(! item.dib)
+    copyString(item.error, sizeof(item.error), message.empty() ? "Failed to load" : message.c_str());
+}
+
+} // namespace
+
+unsigned LoadBatch(FISIDECAR_BATCH_ITEM* items, unsigned count) {
+  if(! items || ! count)
+    return 0;
+
+  try {
+    // Biggest first - they start early, and the small ones fill the gaps at the end
+    std::vector<int64_t> sizes(count);
+    std::vector<unsigned> order(count);
+    int64_t total{};
+    for(unsigned i = 0; i < count; i++) {
+      auto& item = items[i];
+      item.dib = {};
+      item.error[0] = 0;
+      if(! item.filename && ! item.stream)
+        copyString(item.error, sizeof(item.error), "No input");
+      sizes[i] = getInputSize(item);
+      total += sizes[i];
+      order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](unsigned l, unsigned r) { return sizes[l] > sizes[r]; });
+
+    // A file, smaller than its part of the budget, is loaded by a single thread - the parallelism is across the files.
+    // Bigger ones keep their thread limit, the pool lends them the workers, which run out of files.
+    // (With more files, than threads, of about the same size, every file is "small"; with a few, every file is "big".)
+    const auto budget = parallel_budget();
+    const auto small_size = total / budget;
+    const auto decoders = threadDecoders();
+
+    parallel_for(count, budget, [&](unsigned i) {
+      const auto index = order[i];
+      auto& item = items[index];
+      if(! item.filename && ! item.stream)
+        return;
+
+      try {
+        item.fif = detectFormat(item);
+
+        // The thread limit bits mean something else to the other plugins
+        auto flags = item.flags;
+        if(sizes[index] < small_size && isOwnFormat(item.fif))
+          flags = (flags & ~int((1u << FISIDECAR_LOAD_MAXTHREADS_VALUE_SIZE) - 1)) | 1;
+
+        loadItem(item, flags, decoders);
+      } catch (const std::exception& e) {
+        s_message_sink = {};
+        copyString(item.error, sizeof(item.error), e.what());
       }
+    });
+
+  } catch (const std::exception&) { //< std::bad_alloc, before anything is loaded
+    return 0;
+  }
+
+  return unsigned(std::count_if(items, items + count, [](const FISIDECAR_BATCH_ITEM& item) { return item.dib != nullptr; }));
+}
+
+// --- asynchronous loading
+
+struct FISIDECAR_ASYNC
+{
+  FISIDECAR_ASYNC(FREE_IMAGE_FORMAT fif, const char* filename, FIMEMORY* stream, int flags)
+    : item{}
+    , filename(filename ? filename : "")
+    , decoders(threadDecoders())
+    , canceled{false}
+    , done{}
+  {
+    this->item.filename = filename ? this->filename.c_str() : nullptr;
+    this->item.stream = stream;
+    this->item.flags = flags;
+    this->item.fif = fif;
+  }
+
+  void run();
+  bool wait(unsigned timeout_ms);
+
+  FISIDECAR_BATCH_ITEM item;
+  std::string filename;             //< a copy, the string of the caller may be gone by the time the load starts
+  decoder_map_t decoders;           //< of the calling thread
+  std::atomic<bool> canceled;
+
+  std::mutex mutex;                 //< guards the below
+  std::condition_variable finished;
+  bool done;
+};
+
+void FISIDECAR_ASYNC::run() {
+  s_cancel_token = &this->canceled;
+  try {
+    if(this->canceled) //< while queued
+      copyString(this->item.error, sizeof(this->item.error), "Canceled");
+    else {
+      this->item.fif = detectFormat(this->item);
+      loadItem(this->item, this->item.flags, this->decoders);
     }
+  } catch (const std::exception& e) {
+    s_message_sink = {};
+    copyString(this->item.error, sizeof(this->item.error), e.what());
+  }
+  s_cancel_token = {};
 
-    // --- get thumb
+  // Notified under the lock - once the waiter sees done, it may free this
+  std::lock_guard<std::mutex> lock(this->mutex);
+  this->done = true;
+  this->finished.notify_all();
+}
 
-    {
-      static const auto idsCount = 1; //< it is usually just one
-      heif_item_id ids[idsCount];
+bool FISIDECAR_ASYNC::wait(unsigned timeout_ms) {
+  std::unique_lock<std::mutex> lock(this->mutex);
+  if(timeout_ms == FISIDECAR_WAIT_INFINITE)
+    this->finished.wait(lock, [this] { return this->done; });
+  else
+    this->finished.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this] { return this->done; });
+  return this->done;
+}
 
-      if(const auto thumbsCount = heif_image_handle_get_number_of_thumbnails(himage)) {
-        if(thumbsCount > 1) {
-          output_msg("Warning: Thumbs beyond the first are ignored.");
-        }
+FISIDECAR_ASYNC* LoadAsync(FREE_IMAGE_FORMAT fif, const char* filename, FIMEMORY* stream, int flags) {
+  if(! filename && ! stream)
+    return {};
+
+  try {
+    std::unique_ptr<FISIDECAR_ASYNC> async{new FISIDECAR_ASYNC(fif, filename, stream, flags)};
+    // On a pool worker, which is then the calling thread of the load's jobs - no threads beyond the budget
+    auto* task = async.get();
+    parallel_post([task] { task->run(); });
+    return async.release();
+  } catch (const std::exception&) { //< std::bad_alloc, std::system_error (out of threads)
+    return {};
+  }
+}
 
-        (void) heif_image_handle_get_list_of_thumbnail_IDs(himage, ids, idsCount);
+void CancelLoad(FISIDECAR_ASYNC* async) {
+  if(async)
+    async->canceled = true;
+}
 
-        heif_image_handle* hthumb;
-        err = heif_image_handle_get_thumbnail(himage, *ids, &hthumb);
-        assert(! err.code);
+BOOL WaitLoad(FISIDECAR_ASYNC* async, unsigned timeout_ms) {
+  return async && async->wait(timeout_ms) ? TRUE : FALSE;
+}
 
-        unique_himage himage_storage{hthumb, &heif_image_handle_release};
+const char* GetLoadError(FISIDECAR_ASYNC* async) {
+  return async && async->wait(0) ? async->item.error : nullptr;
+}
 
-#if defined(FI_ADV)
-        if(! progress.reportProgress(decode_end_progress)) {
-          return {};
-        }
+FIBITMAP* FinishLoad(FISIDECAR_ASYNC* async) {
+  std::unique_ptr<FISIDECAR_ASYNC> async_storage{async};
+  if(! async)
+    return {};
 
-        FreeImageLoadArgs thArgs{*args};
-        thArgs.flags &= ~FIF_LOAD_NOPIXELS;
-        output_msg.args = &thArgs; 
-        output_msg.progress = {};  
-#else
-        output_msg.args &= ~FIF_LOAD_NOPIXELS;
-#endif
-        auto thumb = loadFromHimage(hthumb, output_msg);
-        FreeImage_SetThumbnail(dib, thumb);
-        FreeImage_Unload(thumb);
-      }
+  async->wait(FISIDECAR_WAIT_INFINITE);
+
+  // Canceled after the last check, the caller does not want it anyway
+  unique_dib dib{async->item.dib};
+  return async->canceled ? nullptr : dib.release();
+}
+
+// --- loading into a given, or recycled, bitmap
+
+BOOL LoadInto(FIBITMAP* dst, FREE_IMAGE_FORMAT fif, const char* filename, FIMEMORY* stream, int flags) {
+  if(! dst || ! FreeImage_HasPixels(dst) || (! filename && ! stream) || (flags & FIF_LOAD_NOPIXELS))
+    return FALSE;
+
+  FISIDECAR_BATCH_ITEM item{};
+  item.filename = filename;
+  item.stream = stream;
+  item.fif = fif;
+  if(! isOwnFormat(item.fif = detectFormat(item))) //< the other plugins know nothing about the target
+    return FALSE;
+
+  s_target_dib = dst;
+  s_target_used = false;
+  auto* view = filename ? FreeImage_Load(item.fif, filename, flags) : FreeImage_LoadFromMemory(item.fif, stream, flags);
+  const auto used = s_target_used;
+  s_target_dib = {};
+  s_target_used = false;
+
+  unique_dib view_storage{view};
+  if(! view || ! used)
+    return FALSE;
+
+  // The pixels are in place, the rest is moved from the view
+  bitmap_reset(dst);
+  FreeImage_CloneMetadata(dst, view);
+  const auto* icc = FreeImage_GetICCProfile(view);
+  if(icc && icc->data && icc->size)
+    FreeImage_CreateICCProfile(dst, icc->data, icc->size);
+  if(auto* thumb = FreeImage_GetThumbnail(view))
+    FreeImage_SetThumbnail(dst, thumb);
+  return TRUE;
+}
+
+void SetBitmapPool(size_t bytes) {
+  bitmap_pool_set_capacity(bytes);
+}
+
+void RecycleBitmap(FIBITMAP* dib) {
+  bitmap_pool_release(dib);
+}
+
+// --- incremental loading
+
+struct FISIDECAR_STREAM
+{
+  using unique_ctx    = unique_ptr<heif_context, void (*)(heif_context*)>;
+  using unique_himage = unique_ptr<heif_image_handle, void (*)(const heif_image_handle*)>;
+
+  FISIDECAR_STREAM(uint64_t expected_size, int flags)
+    : stream(expected_size)
+    , ctx{nullptr, &heif_context_free}
+    , himage{nullptr, &heif_image_handle_release}
+    , flags(flags & ~FIF_LOAD_NOPIXELS)
+    , max_threads(getMaxThreads(flags))
+    , failed{}
+  {}
+
+  bool parse(const output_msg_t& output_msg);
+
+  FIIO_stream stream;
+
+  std::mutex mutex;     //< serializes the loads, guards the below
+  unique_ctx ctx;
+  unique_himage himage;
+  int flags;
+  unsigned max_threads;
+  bool failed;
+};
+
+// Parses the container, once - waits for it to arrive
+bool FISIDECAR_STREAM::parse(const output_msg_t& output_msg) {
+  if(this->himage)
+    return true;
+  if(this->failed)
+    return false;
+
+  this->failed = true; //< until parsed
+  this->ctx.reset(libheif_context_alloc());
+  auto err = this->stream.read(this->ctx.get());
+  if(err.code) {
+    output_msg(err.message);
+    return false;
+  }
+
+  heif_image_handle* himage;
+  err = heif_context_get_primary_image_handle(this->ctx.get(), &himage);
+  if(err.code) {
+    output_msg(err.message);
+    return false;
+  }
+  this->himage.reset(himage);
+  this->failed = false;
+  return true;
+}
+
+namespace {
+
+enum stream_part_t { stream_header, stream_thumbnail, stream_image };
+
+FIBITMAP* loadStream(FISIDECAR_STREAM* stream, stream_part_t part) {
+  using unique_himage = unique_ptr<heif_image_handle, void (*)(const heif_image_handle*)>;
+
+  if(! stream)
+    return {};
+
+  const auto flags = part == stream_header ? stream->flags | FIF_LOAD_NOPIXELS
+    : part == stream_thumbnail ? (stream->flags & ~FISIDECAR_LOAD_HEIF_SIZE_MASK) | FISIDECAR_LOAD_HEIF_SDR //< as attached by Load
+    : stream->flags;
+  const LocalArgs args{flags};
+  const auto output_msg = output_msg_t{args.get(), getFormatId(stream->stream)};
+
+  std::lock_guard<std::mutex> lock(stream->mutex);
+  try {
+    if(! stream->parse(output_msg))
+      return {};
+
+    auto* himage = stream->himage.get();
+    unique_himage hthumb{nullptr, &heif_image_handle_release};
+    if(part == stream_thumbnail) {
+      hthumb.reset(getThumbnail(himage, output_msg));
+      if(! hthumb)
+        return {};
+      himage = hthumb.get();
+    } else if(part == stream_image) {
+      ::call_context_set_max_decoding_threads(stream->ctx.get(), int(parallel_share(getTileCount(himage, stream->max_threads), stream->max_threads)));
     }
 
-    return dib_storage.release();
+    // Waits for the data of the image (the thumbnail's comes first, usually)
+    unique_dib dib{loadFromHimage(himage, stream->max_threads, output_msg)};
+    if(! dib)
+      return {};
 
-  } catch (const std::exception& e) { //< std::bad_alloc to the very least, probably others fom libheif
+    if(part != stream_thumbnail)
+      loadMetadata(himage, dib.get(), output_msg);
+    return dib.release();
+
+  } catch (const std::exception& e) {
     output_msg(e.what());
     return {};
   }
@@ -670,6 +3173,173 @@ Load(FreeImageIO* io, fi_handle handle, int page, Args args, void* data)
 
 } // namespace
 
+FISIDECAR_STREAM* OpenStream(uint64_t expected_size, int flags) {
+  try {
+    return new FISIDECAR_STREAM(expected_size, flags);
+  } catch (const std::exception&) { //< std::bad_alloc
+    return {};
+  }
+}
+
+BOOL PushStream(FISIDECAR_STREAM* stream, const void* data, size_t size) {
+  if(! stream || (! data && size))
+    return FALSE;
+
+  try {
+    stream->stream.push(data, size);
+    return TRUE;
+  } catch (const std::exception&) { //< std::bad_alloc
+    return FALSE;
+  }
+}
+
+void EndStream(FISIDECAR_STREAM* stream) {
+  if(stream)
+    stream->stream.end();
+}
+
+void CloseStream(FISIDECAR_STREAM* stream) {
+  delete stream;
+}
+
+FIBITMAP* LoadStreamHeader(FISIDECAR_STREAM* stream) {
+  return loadStream(stream, stream_header);
+}
+
+FIBITMAP* LoadStreamThumbnail(FISIDECAR_STREAM* stream) {
+  return loadStream(stream, stream_thumbnail);
+}
+
+FIBITMAP* LoadStream(FISIDECAR_STREAM* stream) {
+  return loadStream(stream, stream_image);
+}
+
+// --- libheif shutdown
+
+void ReleaseState() {
+  documents().flush();
+
+  std::lock_guard<std::mutex> lock(s_decoders_mutex);
+  s_decoders.clear();
+  s_decoders_generation.fetch_add(1, std::memory_order_release);
+}
+
+// --- output profile
+
+BOOL SetOutputProfile(const void* data, size_t size) {
+#if defined(FISIDECAR_HAS_LCMS)
+  icc_ptr icc;
+  if(data && size) {
+    unique_profile profile{cmsOpenProfileFromMem(data, cmsUInt32Number(size)), &cmsCloseProfile};
+    if(! profile || cmsGetColorSpace(profile.get()) != cmsSigRgbData)
+      return FALSE;
+    const auto* bytes = static_cast<const BYTE*>(data);
+    icc = std::make_shared<const std::vector<BYTE>>(bytes, bytes + size);
+  }
+
+  std::lock_guard<std::mutex> lock(s_output_mutex);
+  s_output_profile = icc;
+  ++s_output_generation;
+  return TRUE;
+#else
+  (void) data, (void) size;
+  return FALSE;
+#endif
+}
+
+// --- decoder selection
+
+unsigned GetDecoders(FREE_IMAGE_FORMAT fif, FISIDECAR_DECODER_INFO* decoders, unsigned count) {
+  if(! isOwnFormat(fif))
+    return 0;
+
+#if defined(FISIDECAR_HAS_HEIF_DECODER_ID)
+  libheif_ensure();
+
+  const auto compression = getCompression(fif);
+  const auto total = heif_get_decoder_descriptors(compression, nullptr, 0);
+  if(total <= 0)
+    return 0;
+
+  if(decoders && count) {
+    std::vector<const heif_decoder_descriptor*> descriptors(total);
+    const auto found = heif_get_decoder_descriptors(compression, descriptors.data(), total);
+    for(int i = 0; i < found && unsigned(i) < count; i++) {
+      auto& decoder = decoders[i];
+      copyString(decoder.id, sizeof(decoder.id), heif_decoder_descriptor_get_id_name(descriptors[i]));
+      copyString(decoder.name, sizeof(decoder.name), heif_decoder_descriptor_get_name(descriptors[i]));
+      decoder.is_default = i == 0; //< sorted by priority, libheif takes the first
+    }
+  }
+  return unsigned(total);
+#else
+  (void) decoders, (void) count;
+  return 0;
+#endif
+}
+
+BOOL SetDecoder(FREE_IMAGE_FORMAT fif, const char* id, bool this_thread) {
+  if(! isOwnFormat(fif))
+    return FALSE;
+
+  const std::string decoder_id = id ? id : "";
+#if defined(FISIDECAR_HAS_HEIF_DECODER_ID)
+  if(! decoder_id.empty()) {
+    libheif_ensure();
+
+    const auto compression = getCompression(fif);
+    std::vector<const heif_decoder_descriptor*> descriptors(std::max(heif_get_decoder_descriptors(compression, nullptr, 0), 0));
+    const auto found = heif_get_decoder_descriptors(compression, descriptors.data(), int(descriptors.size()));
+    const auto end = descriptors.begin() + std::max(found, 0);
+    if(std::none_of(descriptors.begin(), end, [&](const heif_decoder_descriptor* descriptor) {
+        const auto* name = heif_decoder_descriptor_get_id_name(descriptor);
+        return name && decoder_id == name;
+      }))
+      return FALSE;
+  }
+#else
+  if(! decoder_id.empty())
+    return FALSE;
+#endif
+
+  if(this_thread) {
+    if(decoder_id.empty())
+      threadDecoders().erase(fif);
+    else
+      threadDecoders()[fif] = decoder_id;
+    return TRUE;
+  }
+
+  std::lock_guard<std::mutex> lock(s_decoders_mutex);
+  if(decoder_id.empty())
+    s_decoders.erase(fif);
+  else
+    s_decoders[fif] = decoder_id;
+  return TRUE;
+}
+
+// --- load statistics
+
+void EnableStats(bool enable) {
+  s_stats_enabled = enable;
+}
+
+BOOL GetLoadStats(FISIDECAR_LOAD_STATS* stats) {
+  if(! stats || ! s_has_last_stats)
+    return FALSE;
+
+  *stats = s_last_stats;
+  return TRUE;
+}
+
+void GetStatsTotals(FISIDECAR_STATS_TOTALS* totals, bool reset) {
+  std::lock_guard<std::mutex> lock(s_totals_mutex);
+  if(totals)
+    *totals = s_totals;
+  if(reset)
+    s_totals = {};
+}
+
 void DLL_CALLCONV
 InitHEIF(Plugin* plugin, int format_id)
 {
@@ -688,6 +3358,11 @@ InitHEIF(Plugin* plugin, int format_id)
 
     static const char* DLL_CALLCONV
     MimeType() { return "image/heif"; }
+
+    static BOOL DLL_CALLCONV
+    Save(FreeImageIO* io, FIBITMAP* dib, fi_handle handle, int page, int flags, void* data) {
+      return save(io, dib, handle, flags, heif_compression_HEVC, s_format_id);
+    }
   };
 
   plugin->format_proc = impl::Format;
@@ -702,6 +3377,12 @@ InitHEIF(Plugin* plugin, int format_id)
   plugin->mime_proc = impl::MimeType;
   plugin->supports_icc_profiles_proc = returnTRUE;
 	plugin->supports_no_pixels_proc = returnTRUE;
+  plugin->open_proc = Open;
+  plugin->close_proc = Close;
+  plugin->pagecount_proc = PageCount;
+  plugin->save_proc = impl::Save;
+  plugin->supports_export_bpp_proc = supportsExportBPP;
+  plugin->supports_export_type_proc = supportsExportType;
 }
 
 void DLL_CALLCONV
@@ -723,8 +3404,15 @@ InitAVIF(Plugin* plugin, int format_id)
     static const char* DLL_CALLCONV
     MimeType() { return "image/avif"; }
 
+    static BOOL DLL_CALLCONV
+    Save(FreeImageIO* io, FIBITMAP* dib, fi_handle handle, int page, int flags, void* data) {
+      return save(io, dib, handle, flags, heif_compression_AV1, s_format_id);
+    }
+
     static BOOL DLL_CALLCONV
     Validate(FreeImageIO* io, fi_handle handle) {
+      FIIO_observe_io(io);
+
       BYTE signature[12] = {};
 
       io->read_proc(signature, sizeof(signature), 1, handle);
@@ -750,4 +3438,10 @@ InitAVIF(Plugin* plugin, int format_id)
   plugin->mime_proc = impl::MimeType;
   plugin->supports_icc_profiles_proc = returnTRUE;
   plugin->supports_no_pixels_proc = returnTRUE;
+  plugin->open_proc = Open;
+  plugin->close_proc = Close;
+  plugin->pagecount_proc = PageCount;
+  plugin->save_proc = impl::Save;
+  plugin->supports_export_bpp_proc = supportsExportBPP;
+  plugin->supports_export_type_proc = supportsExportType;
 }
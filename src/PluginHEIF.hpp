@@ -1,3 +1,61 @@
+#include <cstdint>
+#include <cstddef>
 #include "FreeImage.h"
+#include "FISidecar.h"
 void DLL_CALLCONV InitHEIF(Plugin* plugin, int format_id);
 void DLL_CALLCONV InitAVIF(Plugin* plugin, int format_id);
+
+// Region and tile decoding (FISidecar_OpenImage and friends)
+FISIDECAR_IMAGE* OpenImage(const char* filename, int flags);
+FISIDECAR_IMAGE* OpenImage(FIMEMORY* stream, int flags);
+FISIDECAR_IMAGE* OpenImage(FreeImageIO* io, fi_handle handle, int flags);
+void CloseImage(FISIDECAR_IMAGE* image);
+BOOL GetTileLayout(const FISIDECAR_IMAGE* image, FISIDECAR_TILE_LAYOUT* layout);
+FIBITMAP* LoadRegion(FISIDECAR_IMAGE* image, int left, int top, int right, int bottom);
+BOOL LoadTile(FISIDECAR_IMAGE* image, unsigned column, unsigned row, FIBITMAP* dst, int dst_left, int dst_top);
+BOOL LoadToSink(FISIDECAR_IMAGE* image, FISIDECAR_SINK sink, void* user_data, int mode, unsigned band_height);
+
+// Container only probing (FISidecar_Probe)
+BOOL Probe(const char* filename, FISIDECAR_PROBE* info);
+BOOL Probe(FIMEMORY* stream, FISIDECAR_PROBE* info);
+BOOL Probe(FreeImageIO* io, fi_handle handle, FISIDECAR_PROBE* info);
+
+// Batch loading (FISidecar_LoadBatch)
+unsigned LoadBatch(FISIDECAR_BATCH_ITEM* items, unsigned count);
+
+// Asynchronous loading (FISidecar_LoadAsync and friends)
+FISIDECAR_ASYNC* LoadAsync(FREE_IMAGE_FORMAT fif, const char* filename, FIMEMORY* stream, int flags);
+void CancelLoad(FISIDECAR_ASYNC* async);
+BOOL WaitLoad(FISIDECAR_ASYNC* async, unsigned timeout_ms);
+const char* GetLoadError(FISIDECAR_ASYNC* async);
+FIBITMAP* FinishLoad(FISIDECAR_ASYNC* async);
+
+// Load statistics (FISidecar_GetLoadStats and friends)
+void EnableStats(bool enable);
+BOOL GetLoadStats(FISIDECAR_LOAD_STATS* stats);
+void GetStatsTotals(FISIDECAR_STATS_TOTALS* totals, bool reset);
+
+// Loading into a given, or recycled, bitmap (FISidecar_LoadInto and friends)
+BOOL LoadInto(FIBITMAP* dst, FREE_IMAGE_FORMAT fif, const char* filename, FIMEMORY* stream, int flags);
+void SetBitmapPool(size_t bytes);
+void RecycleBitmap(FIBITMAP* dib);
+
+// Incremental loading (FISidecar_OpenStream and friends)
+FISIDECAR_STREAM* OpenStream(uint64_t expected_size, int flags);
+BOOL PushStream(FISIDECAR_STREAM* stream, const void* data, size_t size);
+void EndStream(FISIDECAR_STREAM* stream);
+void CloseStream(FISIDECAR_STREAM* stream);
+FIBITMAP* LoadStreamHeader(FISIDECAR_STREAM* stream);
+FIBITMAP* LoadStreamThumbnail(FISIDECAR_STREAM* stream);
+FIBITMAP* LoadStream(FISIDECAR_STREAM* stream);
+
+// Releases what is tied to the libheif instance - the parsed files, kept between the page loads of multipage bitmaps,
+// and the decoder selections (FISidecar_DeInitialise)
+void ReleaseState();
+
+// Output profile of FISIDECAR_LOAD_HEIF_TO_SRGB (FISidecar_SetOutputProfile)
+BOOL SetOutputProfile(const void* data, size_t size);
+
+// Decoder selection (FISidecar_GetDecoders and friends)
+unsigned GetDecoders(FREE_IMAGE_FORMAT fif, FISIDECAR_DECODER_INFO* decoders, unsigned count);
+BOOL SetDecoder(FREE_IMAGE_FORMAT fif, const char* id, bool this_thread);
@@ -0,0 +1,55 @@
+#pragma once
+
+// Instruction set detection, shared by the pixel kernels
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define FISIDECAR_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define FISIDECAR_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+// MSVC allows intrinsics for any instruction set, GCC and Clang need them enabled per function
+#if defined(FISIDECAR_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+#define FISIDECAR_TARGET(isa) __attribute__((target(isa)))
+#else
+#define FISIDECAR_TARGET(isa)
+#endif
+
+#if defined(FISIDECAR_SIMD_X86)
+
+struct cpu_features
+{
+  bool ssse3;
+  bool avx2;
+
+  cpu_features() : ssse3(), avx2() {
+#if defined(_MSC_VER) && ! defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    const auto max_leaf = info[0];
+    __cpuid(info, 1);
+    ssse3 = (info[2] & (1 << 9)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    if(max_leaf >= 7 && osxsave && (_xgetbv(0) & 6) == 6) {
+      __cpuidex(info, 7, 0);
+      avx2 = (info[1] & (1 << 5)) != 0;
+    }
+#else
+    __builtin_cpu_init();
+    ssse3 = __builtin_cpu_supports("ssse3");
+    avx2 = __builtin_cpu_supports("avx2");
+#endif
+  }
+};
+
+inline const cpu_features& cpu() {
+  static const cpu_features features;
+  return features;
+}
+
+#endif // FISIDECAR_SIMD_X86
@@ -0,0 +1,161 @@
+#include "Startup.hpp"
+#include "libheif/heif.h"
+#include <cstdlib>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// heif_init/heif_deinit and the plugin loading API
+#if defined(LIBHEIF_HAVE_VERSION)
+#if LIBHEIF_HAVE_VERSION(1, 13, 0)
+#define FISIDECAR_HAS_HEIF_INIT
+#endif
+#if LIBHEIF_HAVE_VERSION(1, 14, 0)
+#define FISIDECAR_HAS_HEIF_PLUGINS
+#endif
+#endif
+
+namespace {
+
+using startup_clock = std::chrono::steady_clock;
+
+double elapsedMs(startup_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(startup_clock::now() - start).count();
+}
+
+std::atomic<bool> s_ready{false};
+std::atomic<bool> s_first_load{true};
+
+std::mutex s_mutex; //< guards the below
+std::vector<std::string> s_plugin_files;
+#if defined(FISIDECAR_HAS_HEIF_PLUGINS)
+std::vector<const heif_plugin*> s_plugins;
+#endif
+FISIDECAR_STARTUP_STATS s_stats{};
+
+#if defined(FISIDECAR_HAS_HEIF_INIT)
+
+// heif_init scans the directories in LIBHEIF_PLUGIN_PATH (if set), so an empty list scans none. A path, set by the user, is left alone.
+// Returns whether the variable was set - to be removed again by restorePluginScan, right after heif_init.
+// setenv is not thread-safe (against getenv on other threads either), so this is for libheif_init, when no other thread runs.
+bool disablePluginScan() {
+  if(getenv("LIBHEIF_PLUGIN_PATH"))
+    return false;
+#if defined(_WIN32)
+  return _putenv_s("LIBHEIF_PLUGIN_PATH", "<none>") == 0; //< an empty value would remove it
+#else
+  return setenv("LIBHEIF_PLUGIN_PATH", "", 0) == 0;
+#endif
+}
+
+void restorePluginScan() {
+#if defined(_WIN32)
+  _putenv_s("LIBHEIF_PLUGIN_PATH", ""); //< removes it
+#else
+  unsetenv("LIBHEIF_PLUGIN_PATH");
+#endif
+}
+
+#endif
+
+// Called with s_mutex held
+void initialise(bool scan_plugin_directory) {
+  if(s_ready.load(std::memory_order_relaxed))
+    return;
+
+  const auto start = startup_clock::now();
+#if defined(FISIDECAR_HAS_HEIF_INIT)
+  // The environment of the process is changed only for the duration of heif_init, not for child processes or later inits
+  const auto isScanDisabled = ! scan_plugin_directory && disablePluginScan();
+
+  (void) heif_init(nullptr); //< a plugin, failing to load, leaves the built-in codecs working
+
+  if(isScanDisabled)
+    restorePluginScan();
+
+#if defined(FISIDECAR_HAS_HEIF_PLUGINS)
+  for(const auto& file : s_plugin_files) {
+    const heif_plugin* plugin{};
+    if(! heif_load_plugin(file.c_str(), &plugin).code && plugin)
+      s_plugins.push_back(plugin);
+  }
+  s_stats.plugins = unsigned(s_plugins.size());
+#endif
+#else
+  (void) scan_plugin_directory;
+#endif
+  s_stats.init_ms += elapsedMs(start);
+
+  s_ready.store(true, std::memory_order_release);
+}
+
+} // namespace
+
+void libheif_configure(const char* const* plugins) {
+  std::lock_guard<std::mutex> lock(s_mutex);
+  s_plugin_files.clear();
+  for(auto* it = plugins; it && *it; ++it)
+    s_plugin_files.emplace_back(*it);
+}
+
+void libheif_ensure() {
+  if(s_ready.load(std::memory_order_acquire))
+    return;
+
+  std::lock_guard<std::mutex> lock(s_mutex);
+  initialise(true);
+}
+
+void libheif_init(bool scan_plugin_directory) {
+  std::lock_guard<std::mutex> lock(s_mutex);
+  initialise(scan_plugin_directory);
+}
+
+heif_context* libheif_context_alloc() {
+  libheif_ensure();
+  return heif_context_alloc();
+}
+
+void libheif_shutdown() {
+  std::lock_guard<std::mutex> lock(s_mutex);
+  if(! s_ready.load(std::memory_order_relaxed))
+    return;
+
+#if defined(FISIDECAR_HAS_HEIF_INIT)
+#if defined(FISIDECAR_HAS_HEIF_PLUGINS)
+  for(auto* plugin : s_plugins)
+    (void) heif_unload_plugin(plugin);
+  s_plugins.clear();
+#endif
+  heif_deinit();
+#endif
+
+  s_ready.store(false, std::memory_order_release);
+}
+
+void startup_add_register_ms(double ms) {
+  std::lock_guard<std::mutex> lock(s_mutex);
+  s_stats.register_ms += ms;
+}
+
+void startup_get_stats(FISIDECAR_STARTUP_STATS* stats) {
+  std::lock_guard<std::mutex> lock(s_mutex);
+  *stats = s_stats;
+}
+
+// --- FirstLoadTimer
+
+FirstLoadTimer::FirstLoadTimer()
+  : first_(s_first_load.load(std::memory_order_relaxed) && s_first_load.exchange(false))
+  , start_(first_ ? startup_clock::now() : startup_clock::time_point{})
+{}
+
+FirstLoadTimer::~FirstLoadTimer() {
+  if(! this->first_)
+    return;
+
+  const auto ms = elapsedMs(this->start_);
+  std::lock_guard<std::mutex> lock(s_mutex);
+  s_stats.first_load_ms = ms;
+}
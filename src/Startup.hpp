@@ -0,0 +1,48 @@
+#pragma once
+
+#include <chrono>
+#include "FISidecar.h"
+
+struct heif_context;
+
+/** @brief libheif initialization, deferred to the first use.
+ *
+ * heif_init loads the decoder/encoder plugins, scanning libheif's plugin directory - which is most of the startup of a short-lived process.
+ * Registering the plugins does not touch libheif, the first context (libheif_context_alloc) initializes it, with the configured plugins.
+**/
+
+// Plugin files to load (null terminated, can be null). Applies to the next initialization.
+void libheif_configure(const char* const* plugins);
+
+// Initializes libheif, unless it is already - scanning libheif's plugin directory. Thread-safe, cheap once done
+void libheif_ensure();
+
+// libheif_ensure, optionally without the scan. That changes the process environment for the duration of heif_init,
+// so no other thread may be running - FISidecar_Initialise only.
+void libheif_init(bool scan_plugin_directory);
+
+// heif_context_alloc, after libheif_ensure
+heif_context* libheif_context_alloc();
+
+// Unloads the plugins and deinitializes libheif, if it was initialized. No libheif objects may be alive.
+void libheif_shutdown();
+
+// Time spent in FISidecar_RegisterPlugin*
+void startup_add_register_ms(double ms);
+
+void startup_get_stats(FISIDECAR_STARTUP_STATS* stats);
+
+// Times its scope into first_load_ms, if it is the first load of the process
+class FirstLoadTimer
+{
+public:
+  FirstLoadTimer();
+  ~FirstLoadTimer();
+
+  FirstLoadTimer(const FirstLoadTimer&) = delete;
+  FirstLoadTimer& operator=(const FirstLoadTimer&) = delete;
+
+private:
+  bool first_;
+  std::chrono::steady_clock::time_point start_;
+};
@@ -0,0 +1,321 @@
+#include "Swizzle.hpp"
+#include "Parallel.hpp"
+#include <cstring>
+#include <algorithm>
+
+#include "Simd.hpp"
+
+namespace {
+
+// FreeImage stores 8bit pixels either as BGR(A) (little-endian default), or as RGB(A)
+const bool isBGR = FI_RGBA_RED == 2;
+
+// --- scalar, any bpp combination, any color order
+
+template<unsigned SrcBpp, unsigned DstBpp>
+void row_scalar(const BYTE* src, BYTE* dst, unsigned width, unsigned = 8) {
+  for(unsigned x = 0; x < width; x++) {
+    dst[FI_RGBA_RED]   = src[0];
+    dst[FI_RGBA_GREEN] = src[1];
+    dst[FI_RGBA_BLUE]  = src[2];
+    if(DstBpp == 32)
+      dst[FI_RGBA_ALPHA] = (SrcBpp == 32) ? src[3] : 0xFF;
+
+    src += SrcBpp / 8;
+    dst += DstBpp / 8;
+  }
+}
+
+// --- 16bit, scales src_bits to the full 16 bits by replicating the top bits into the bottom (v << 6 | v >> 4 for 10bit)
+
+template<unsigned Bpp>
+void row16_scalar(const BYTE* src, BYTE* dst, unsigned width, unsigned src_bits) {
+  const auto up = 16 - src_bits;
+  const auto down = src_bits - up;
+
+  const auto* s = reinterpret_cast<const WORD*>(src);
+  auto* d = reinterpret_cast<WORD*>(dst);
+  for(auto* const end = d + size_t(width) * (Bpp / 16); d != end; ++d, ++s)
+    *d = WORD((*s << up) | (*s >> down));
+}
+
+// --- 16bit to dst_bits (saving), dropping the low bits
+
+template<unsigned Bpp>
+void row16_down_scalar(const BYTE* src, BYTE* dst, unsigned width, unsigned dst_bits) {
+  const auto down = 16 - dst_bits;
+
+  const auto* s = reinterpret_cast<const WORD*>(src);
+  auto* d = reinterpret_cast<WORD*>(dst);
+  for(auto* const end = d + size_t(width) * (Bpp / 16); d != end; ++d, ++s)
+    *d = WORD(*s >> down);
+}
+
+// --- same layout on both sides (RGB color order)
+
+template<unsigned Bpp>
+void row_copy(const BYTE* src, BYTE* dst, unsigned width, unsigned) {
+  memcpy(dst, src, size_t(width) * (Bpp / 8));
+}
+
+#if defined(FISIDECAR_SIMD_X86)
+
+// Swaps bytes 0 and 2 of each pixel. For 24bpp, 5 pixels are handled, the 16th byte stays in place.
+const char s_shuffle24[16] = {2,1,0, 5,4,3, 8,7,6, 11,10,9, 14,13,12, 15};
+const char s_shuffle32[16] = {2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15};
+
+template<unsigned Bpp>
+FISIDECAR_TARGET("ssse3")
+void row_ssse3(const BYTE* src, BYTE* dst, unsigned width, unsigned = 8) {
+  const auto mask = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Bpp == 24 ? s_shuffle24 : s_shuffle32));
+  const unsigned bytes = Bpp / 8;
+  const unsigned step = (Bpp == 24) ? 5 : 4; //< pixels per iteration
+
+  // 24bpp reads and writes 16 bytes, but advances by 15, the extra byte is overwritten by the next iteration
+  unsigned x = 0;
+  for(; x + step + (Bpp == 24) <= width; x += step) {
+    const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_shuffle_epi8(v, mask));
+    src += step * bytes;
+    dst += step * bytes;
+  }
+  row_scalar<Bpp, Bpp>(src, dst, width - x);
+}
+
+template<unsigned Bpp>
+FISIDECAR_TARGET("avx2")
+void row_avx2(const BYTE* src, BYTE* dst, unsigned width, unsigned) {
+  const auto mask128 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Bpp == 24 ? s_shuffle24 : s_shuffle32));
+  const auto mask = _mm256_broadcastsi128_si256(mask128);
+  unsigned x = 0;
+
+  if(Bpp == 32) {
+    for(; x + 8 <= width; x += 8) {
+      const auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), _mm256_shuffle_epi8(v, mask));
+      src += 32;
+      dst += 32;
+    }
+  } else {
+    // Each 128bit lane holds 4 pixels (12 bytes) + 4 bytes, which are overwritten by the next store.
+    // The high lane is stored after the low one, so it wins the overlap.
+    for(; x + 10 <= width; x += 8) {
+      const auto lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+      const auto hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 12));
+      const auto v = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), mask);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm256_castsi256_si128(v));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 12), _mm256_extracti128_si256(v, 1));
+      src += 24;
+      dst += 24;
+    }
+  }
+  row_ssse3<Bpp>(src, dst, width - x);
+}
+
+template<unsigned Bpp>
+FISIDECAR_TARGET("sse2")
+void row16_sse2(const BYTE* src, BYTE* dst, unsigned width, unsigned src_bits) {
+  const auto up = _mm_cvtsi32_si128(int(16 - src_bits));
+  const auto down = _mm_cvtsi32_si128(int(2 * src_bits - 16));
+  const auto samples = width * (Bpp / 16);
+
+  unsigned i = 0;
+  for(; i + 8 <= samples; i += 8) {
+    const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_or_si128(_mm_sll_epi16(v, up), _mm_srl_epi16(v, down)));
+    src += 16;
+    dst += 16;
+  }
+  row16_scalar<16>(src, dst, samples - i, src_bits);
+}
+
+template<unsigned Bpp>
+FISIDECAR_TARGET("avx2")
+void row16_avx2(const BYTE* src, BYTE* dst, unsigned width, unsigned src_bits) {
+  const auto up = _mm_cvtsi32_si128(int(16 - src_bits));
+  const auto down = _mm_cvtsi32_si128(int(2 * src_bits - 16));
+  const auto samples = width * (Bpp / 16);
+
+  unsigned i = 0;
+  for(; i + 16 <= samples; i += 16) {
+    const auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), _mm256_or_si256(_mm256_sll_epi16(v, up), _mm256_srl_epi16(v, down)));
+    src += 32;
+    dst += 32;
+  }
+  row16_scalar<16>(src, dst, samples - i, src_bits);
+}
+
+template<unsigned Bpp>
+FISIDECAR_TARGET("sse2")
+void row16_down_sse2(const BYTE* src, BYTE* dst, unsigned width, unsigned dst_bits) {
+  const auto down = _mm_cvtsi32_si128(int(16 - dst_bits));
+  const auto samples = width * (Bpp / 16);
+
+  unsigned i = 0;
+  for(; i + 8 <= samples; i += 8) {
+    const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_srl_epi16(v, down));
+    src += 16;
+    dst += 16;
+  }
+  row16_down_scalar<16>(src, dst, samples - i, dst_bits);
+}
+
+template<unsigned Bpp>
+swizzle_row_t best_row16_down() {
+  return &row16_down_sse2<Bpp>;
+}
+
+template<unsigned Bpp>
+swizzle_row_t best_swap_row() {
+  if(cpu().avx2)
+    return &row_avx2<Bpp>;
+  if(cpu().ssse3)
+    return &row_ssse3<Bpp>;
+  return &row_scalar<Bpp, Bpp>;
+}
+
+template<unsigned Bpp>
+swizzle_row_t best_row16() {
+  return cpu().avx2 ? &row16_avx2<Bpp> : &row16_sse2<Bpp>;
+}
+
+#elif defined(FISIDECAR_SIMD_NEON)
+
+template<unsigned Bpp>
+void row_neon(const BYTE* src, BYTE* dst, unsigned width, unsigned) {
+  unsigned x = 0;
+  for(; x + 16 <= width; x += 16) {
+    if(Bpp == 24) {
+      auto v = vld3q_u8(src);
+      const auto r = v.val[0];
+      v.val[0] = v.val[2];
+      v.val[2] = r;
+      vst3q_u8(dst, v);
+    } else {
+      auto v = vld4q_u8(src);
+      const auto r = v.val[0];
+      v.val[0] = v.val[2];
+      v.val[2] = r;
+      vst4q_u8(dst, v);
+    }
+    src += 16 * (Bpp / 8);
+    dst += 16 * (Bpp / 8);
+  }
+  row_scalar<Bpp, Bpp>(src, dst, width - x);
+}
+
+template<unsigned Bpp>
+swizzle_row_t best_swap_row() {
+  return &row_neon<Bpp>;
+}
+
+template<unsigned Bpp>
+void row16_neon(const BYTE* src, BYTE* dst, unsigned width, unsigned src_bits) {
+  const auto up = vdupq_n_s16(int16_t(16 - src_bits));
+  const auto down = vdupq_n_s16(int16_t(16 - 2 * int(src_bits))); //< negative, shifts right
+  const auto samples = width * (Bpp / 16);
+
+  unsigned i = 0;
+  for(; i + 8 <= samples; i += 8) {
+    const auto v = vld1q_u16(reinterpret_cast<const uint16_t*>(src));
+    vst1q_u16(reinterpret_cast<uint16_t*>(dst), vorrq_u16(vshlq_u16(v, up), vshlq_u16(v, down)));
+    src += 16;
+    dst += 16;
+  }
+  row16_scalar<16>(src, dst, samples - i, src_bits);
+}
+
+template<unsigned Bpp>
+swizzle_row_t best_row16() {
+  return &row16_neon<Bpp>;
+}
+
+template<unsigned Bpp>
+void row16_down_neon(const BYTE* src, BYTE* dst, unsigned width, unsigned dst_bits) {
+  const auto down = vdupq_n_s16(int16_t(int(dst_bits) - 16)); //< negative, shifts right
+  const auto samples = width * (Bpp / 16);
+
+  unsigned i = 0;
+  for(; i + 8 <= samples; i += 8) {
+    const auto v = vld1q_u16(reinterpret_cast<const uint16_t*>(src));
+    vst1q_u16(reinterpret_cast<uint16_t*>(dst), vshlq_u16(v, down));
+    src += 16;
+    dst += 16;
+  }
+  row16_down_scalar<16>(src, dst, samples - i, dst_bits);
+}
+
+template<unsigned Bpp>
+swizzle_row_t best_row16_down() {
+  return &row16_down_neon<Bpp>;
+}
+
+#else
+
+template<unsigned Bpp>
+swizzle_row_t best_swap_row() {
+  return &row_scalar<Bpp, Bpp>;
+}
+
+template<unsigned Bpp>
+swizzle_row_t best_row16() {
+  return &row16_scalar<Bpp>;
+}
+
+template<unsigned Bpp>
+swizzle_row_t best_row16_down() {
+  return &row16_down_scalar<Bpp>;
+}
+
+#endif
+
+template<unsigned Bpp>
+swizzle_row_t best_row() {
+  return isBGR ? best_swap_row<Bpp>() : &row_copy<Bpp>;
+}
+
+} // namespace
+
+swizzle_row_t get_swizzle_row(unsigned src_bpp, unsigned dst_bpp) {
+  if(src_bpp != dst_bpp)
+    return {};
+
+  switch(src_bpp) {
+    case 24: return best_row<24>();
+    case 32: return best_row<32>();
+    case 48: return best_row16<48>();
+    case 64: return best_row16<64>();
+  }
+  return {};
+}
+
+swizzle_row_t get_unswizzle_row(unsigned bpp) {
+  switch(bpp) {
+    case 24: return best_row<24>();
+    case 32: return best_row<32>();
+    case 48: return best_row16_down<48>();
+    case 64: return best_row16_down<64>();
+  }
+  return {};
+}
+
+unsigned swizzle_image(swizzle_row_t row
+  , const BYTE* src, ptrdiff_t src_pitch
+  , BYTE* dst, ptrdiff_t dst_pitch
+  , unsigned width, unsigned height, unsigned src_bits
+  , unsigned max_threads)
+{
+  // A thread is worth it only for a decent amount of work (thumbnails are done in-place)
+  static const size_t min_bytes_per_band = 1 << 20;
+  const auto bytes = size_t(src_pitch < 0 ? -src_pitch : src_pitch) * height;
+  const auto bands = unsigned(std::max<size_t>(1, std::min<size_t>({max_threads, height, bytes / min_bytes_per_band})));
+  const auto rows_per_band = (height + bands - 1) / bands;
+
+  return parallel_for(bands, bands, [=](unsigned band) {
+    const auto last = std::min(height, (band + 1) * rows_per_band);
+    for(auto y = band * rows_per_band; y < last; y++)
+      row(src + src_pitch * ptrdiff_t(y), dst + dst_pitch * ptrdiff_t(y), width, src_bits);
+  });
+}
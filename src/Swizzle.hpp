@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include "FreeImage.h"
+
+/** @brief Converts one row of interleaved pixels, as produced by libheif, to the FreeImage layout.
+ *
+ * The kernels are specialized at compile time per source/destination bpp and FreeImage color order (FI_RGBA_*),
+ * and, where possible, vectorized (SSSE3/AVX2 or NEON, selected at runtime).
+ * Vertical flip is handled by swizzle_image, using a negative destination pitch.
+**/
+typedef void (*swizzle_row_t)(const BYTE* src, BYTE* dst, unsigned width, unsigned src_bits);
+
+/** @brief Returns the best kernel for the given combination, or null if the combination is not supported.
+ *
+ * Supported are:
+ *  - 24 -> 24 (RGB -> FreeImage RGB) and 32 -> 32 (RGBA -> FreeImage RGBA)
+ *  - 48 -> 48 (RRGGBB -> FIT_RGB16) and 64 -> 64 (RRGGBBAA -> FIT_RGBA16), native endian.
+ *    The source holds src_bits (9-16) significant bits per channel, which are scaled to the full 16 bit range.
+ *    FIRGB(A)16 is always in RGB(A) order, so there is no channel swap.
+**/
+swizzle_row_t get_swizzle_row(unsigned src_bpp, unsigned dst_bpp);
+
+/** @brief The reverse of get_swizzle_row, for saving - FreeImage layout to interleaved pixels for libheif.
+ *
+ *  - 24 and 32 bpp - swapping the channels is its own inverse, so these are the load kernels.
+ *  - 48 and 64 bpp - the samples are reduced to the bits, passed as src_bits (the bit depth of the target), by dropping the low ones.
+**/
+swizzle_row_t get_unswizzle_row(unsigned bpp);
+
+/** @brief Runs a row kernel over an image, splitting the rows between up to max_threads threads.
+ *
+ * dst points to the row where src row 0 goes, dst_pitch can be negative (bottom-up DIB).
+ * Returns the threads, which took part.
+**/
+unsigned swizzle_image(swizzle_row_t row
+  , const BYTE* src, ptrdiff_t src_pitch
+  , BYTE* dst, ptrdiff_t dst_pitch
+  , unsigned width, unsigned height, unsigned src_bits
+  , unsigned max_threads);
@@ -0,0 +1,295 @@
+#include "YCbCr.hpp"
+#include "Parallel.hpp"
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+#include "Simd.hpp"
+
+namespace {
+
+// FreeImage stores 8bit pixels either as BGR(A) (little-endian default), or as RGB(A)
+const bool isBGR = FI_RGBA_RED == 2;
+
+const int s_fraction_bits = 13;
+const int s_round = 1 << (s_fraction_bits - 1);
+
+typedef void (*ycbcr_row_t)(const BYTE* y, const BYTE* cb, const BYTE* cr, const BYTE* alpha, BYTE* dst, unsigned width, const ycbcr_matrix& m);
+
+// --- scalar
+
+inline BYTE clamp8(int v) {
+  return BYTE(v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+template<unsigned DstBpp>
+inline void pixel(int y, int cb, int cr, BYTE alpha, BYTE* dst, const ycbcr_matrix& m) {
+  y = (y - m.y_offset) * m.y_scale + s_round;
+  cb -= 128;
+  cr -= 128;
+
+  dst[FI_RGBA_RED]   = clamp8((y + m.cr_r * cr) >> s_fraction_bits);
+  dst[FI_RGBA_GREEN] = clamp8((y - m.cb_g * cb - m.cr_g * cr) >> s_fraction_bits);
+  dst[FI_RGBA_BLUE]  = clamp8((y + m.cb_b * cb) >> s_fraction_bits);
+  if(DstBpp == 32)
+    dst[FI_RGBA_ALPHA] = alpha;
+}
+
+template<unsigned DstBpp, unsigned ShiftX>
+void row_scalar(const BYTE* y, const BYTE* cb, const BYTE* cr, const BYTE* alpha, BYTE* dst, unsigned width, const ycbcr_matrix& m) {
+  for(unsigned x = 0; x < width; x++) {
+    const auto c = x >> ShiftX;
+    pixel<DstBpp>(y[x], cb[c], cr[c], alpha ? alpha[x] : 0xFF, dst, m);
+    dst += DstBpp / 8;
+  }
+}
+
+#if defined(FISIDECAR_SIMD_X86)
+
+// Two 16bit coefficients per 32bit lane, for _mm_madd_epi16 of interleaved (a, b) samples
+inline __m128i coefficients(int a, int b) {
+  return _mm_set1_epi32(int((uint32_t(uint16_t(b)) << 16) | uint16_t(a)));
+}
+
+// 8 chroma samples, for 8 pixels - 4 duplicated ones, if subsampled
+template<unsigned ShiftX>
+FISIDECAR_TARGET("sse2")
+inline __m128i load_chroma(const BYTE* c) {
+  if(ShiftX) {
+    int32_t v;
+    memcpy(&v, c, sizeof(v));
+    const auto c4 = _mm_cvtsi32_si128(v);
+    return _mm_unpacklo_epi8(c4, c4);
+  }
+  return _mm_loadl_epi64(reinterpret_cast<const __m128i*>(c));
+}
+
+// (a * ka + b * kb) >> s_fraction_bits for 8 pixels, saturated to 8 bits (in the low half)
+FISIDECAR_TARGET("sse2")
+inline __m128i combine(__m128i a, __m128i b, __m128i k, __m128i extra_lo, __m128i extra_hi) {
+  const auto round = _mm_set1_epi32(s_round);
+  const auto lo = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, b), k), extra_lo), round), s_fraction_bits);
+  const auto hi = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, b), k), extra_hi), round), s_fraction_bits);
+  const auto v = _mm_packs_epi32(lo, hi);
+  return _mm_packus_epi16(v, v);
+}
+
+template<unsigned DstBpp, unsigned ShiftX>
+FISIDECAR_TARGET("sse2")
+void row_sse2(const BYTE* y, const BYTE* cb, const BYTE* cr, const BYTE* alpha, BYTE* dst, unsigned width, const ycbcr_matrix& m) {
+  const auto zero = _mm_setzero_si128();
+  const auto y_offset = _mm_set1_epi16(short(m.y_offset));
+  const auto c_offset = _mm_set1_epi16(128);
+  const auto opaque = _mm_set1_epi8(char(0xFF));
+
+  const auto k_r = coefficients(m.y_scale, m.cr_r);
+  const auto k_g = coefficients(m.y_scale, -m.cb_g);
+  const auto k_gr = coefficients(-m.cr_g, 0);
+  const auto k_b = coefficients(m.y_scale, m.cb_b);
+
+  unsigned x = 0;
+  for(; x + 8 <= width; x += 8) {
+    const auto yv = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(y + x)), zero), y_offset);
+    const auto cbv = _mm_sub_epi16(_mm_unpacklo_epi8(load_chroma<ShiftX>(cb + (x >> ShiftX)), zero), c_offset);
+    const auto crv = _mm_sub_epi16(_mm_unpacklo_epi8(load_chroma<ShiftX>(cr + (x >> ShiftX)), zero), c_offset);
+
+    // The Cr part of G, 32bit, for the two halves
+    const auto gr_lo = _mm_madd_epi16(_mm_unpacklo_epi16(crv, zero), k_gr);
+    const auto gr_hi = _mm_madd_epi16(_mm_unpackhi_epi16(crv, zero), k_gr);
+
+    const auto r = combine(yv, crv, k_r, zero, zero);
+    const auto g = combine(yv, cbv, k_g, gr_lo, gr_hi);
+    const auto b = combine(yv, cbv, k_b, zero, zero);
+
+    const auto first = isBGR ? b : r;
+    const auto third = isBGR ? r : b;
+    auto* d = dst + size_t(x) * (DstBpp / 8);
+
+    if(DstBpp == 32) {
+      const auto a = alpha ? _mm_loadl_epi64(reinterpret_cast<const __m128i*>(alpha + x)) : opaque;
+      const auto low = _mm_unpacklo_epi8(first, g);
+      const auto high = _mm_unpacklo_epi8(third, a);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(d), _mm_unpacklo_epi16(low, high));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(d + 16), _mm_unpackhi_epi16(low, high));
+    } else {
+      // No byte shuffle in SSE2, the 3 bytes of each pixel are interleaved from the registers
+      alignas(16) BYTE c0[16], c1[16], c2[16];
+      _mm_store_si128(reinterpret_cast<__m128i*>(c0), first);
+      _mm_store_si128(reinterpret_cast<__m128i*>(c1), g);
+      _mm_store_si128(reinterpret_cast<__m128i*>(c2), third);
+      for(unsigned i = 0; i < 8; i++, d += 3) {
+        d[0] = c0[i];
+        d[1] = c1[i];
+        d[2] = c2[i];
+      }
+    }
+  }
+  row_scalar<DstBpp, ShiftX>(y + x, cb + (x >> ShiftX), cr + (x >> ShiftX), alpha ? alpha + x : nullptr, dst + size_t(x) * (DstBpp / 8), width - x, m);
+}
+
+template<unsigned DstBpp, unsigned ShiftX>
+ycbcr_row_t best_row() {
+  return &row_sse2<DstBpp, ShiftX>;
+}
+
+#elif defined(FISIDECAR_SIMD_NEON)
+
+template<unsigned ShiftX>
+inline uint8x8_t load_chroma(const BYTE* c) {
+  if(ShiftX) {
+    uint32_t v;
+    memcpy(&v, c, sizeof(v));
+    const auto c4 = vcreate_u8(v);
+    return vzip_u8(c4, c4).val[0];
+  }
+  return vld1_u8(c);
+}
+
+template<unsigned DstBpp, unsigned ShiftX>
+void row_neon(const BYTE* y, const BYTE* cb, const BYTE* cr, const BYTE* alpha, BYTE* dst, unsigned width, const ycbcr_matrix& m) {
+  const auto y_offset = vdupq_n_s16(int16_t(m.y_offset));
+  const auto c_offset = vdupq_n_s16(128);
+  const auto y_scale = int16_t(m.y_scale);
+
+  // Rounding, shifting and saturating to 8 bits
+  const auto narrow = [](int32x4_t lo, int32x4_t hi) {
+    return vqmovn_u16(vcombine_u16(vqrshrun_n_s32(lo, s_fraction_bits), vqrshrun_n_s32(hi, s_fraction_bits)));
+  };
+
+  unsigned x = 0;
+  for(; x + 8 <= width; x += 8) {
+    const auto yv = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(y + x))), y_offset);
+    const auto cbv = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(load_chroma<ShiftX>(cb + (x >> ShiftX)))), c_offset);
+    const auto crv = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(load_chroma<ShiftX>(cr + (x >> ShiftX)))), c_offset);
+
+    const auto y_lo = vmull_n_s16(vget_low_s16(yv), y_scale);
+    const auto y_hi = vmull_n_s16(vget_high_s16(yv), y_scale);
+
+    const auto r = narrow(vmlal_n_s16(y_lo, vget_low_s16(crv), int16_t(m.cr_r)), vmlal_n_s16(y_hi, vget_high_s16(crv), int16_t(m.cr_r)));
+    const auto g = narrow(
+        vmlsl_n_s16(vmlsl_n_s16(y_lo, vget_low_s16(cbv), int16_t(m.cb_g)), vget_low_s16(crv), int16_t(m.cr_g))
+      , vmlsl_n_s16(vmlsl_n_s16(y_hi, vget_high_s16(cbv), int16_t(m.cb_g)), vget_high_s16(crv), int16_t(m.cr_g)));
+    const auto b = narrow(vmlal_n_s16(y_lo, vget_low_s16(cbv), int16_t(m.cb_b)), vmlal_n_s16(y_hi, vget_high_s16(cbv), int16_t(m.cb_b)));
+
+    auto* d = dst + size_t(x) * (DstBpp / 8);
+    if(DstBpp == 32) {
+      uint8x8x4_t v;
+      v.val[FI_RGBA_RED] = r;
+      v.val[FI_RGBA_GREEN] = g;
+      v.val[FI_RGBA_BLUE] = b;
+      v.val[FI_RGBA_ALPHA] = alpha ? vld1_u8(alpha + x) : vdup_n_u8(0xFF);
+      vst4_u8(d, v);
+    } else {
+      uint8x8x3_t v;
+      v.val[FI_RGBA_RED] = r;
+      v.val[FI_RGBA_GREEN] = g;
+      v.val[FI_RGBA_BLUE] = b;
+      vst3_u8(d, v);
+    }
+  }
+  row_scalar<DstBpp, ShiftX>(y + x, cb + (x >> ShiftX), cr + (x >> ShiftX), alpha ? alpha + x : nullptr, dst + size_t(x) * (DstBpp / 8), width - x, m);
+}
+
+template<unsigned DstBpp, unsigned ShiftX>
+ycbcr_row_t best_row() {
+  return &row_neon<DstBpp, ShiftX>;
+}
+
+#else
+
+template<unsigned DstBpp, unsigned ShiftX>
+ycbcr_row_t best_row() {
+  return &row_scalar<DstBpp, ShiftX>;
+}
+
+#endif
+
+ycbcr_row_t get_row(unsigned dst_bpp, unsigned shift_x) {
+  switch(dst_bpp) {
+    case 24: return shift_x ? best_row<24, 1>() : best_row<24, 0>();
+    case 32: return shift_x ? best_row<32, 1>() : best_row<32, 0>();
+  }
+  return {};
+}
+
+int fixed(double v) {
+  return int(std::lround(v * (1 << s_fraction_bits)));
+}
+
+} // namespace
+
+bool get_ycbcr_matrix(unsigned matrix_coefficients, bool full_range, ycbcr_matrix& matrix) {
+  double kr, kb;
+  switch(matrix_coefficients) {
+    case 1:                 kr = 0.2126; kb = 0.0722; break; //< BT.709
+    case 2: case 5: case 6: kr = 0.299;  kb = 0.114;  break; //< BT.601 (unspecified, as libheif)
+    case 4:                 kr = 0.30;   kb = 0.11;   break; //< FCC
+    case 7:                 kr = 0.212;  kb = 0.087;  break; //< SMPTE 240M
+    case 9:                 kr = 0.2627; kb = 0.0593; break; //< BT.2020 non-constant luminance
+    default:
+      return false;
+  }
+  const auto kg = 1 - kr - kb;
+  const auto c = full_range ? 1.0 : 255.0 / 224;
+
+  matrix.y_offset = full_range ? 0 : 16;
+  matrix.y_scale = fixed(full_range ? 1.0 : 255.0 / 219);
+  matrix.cr_r = fixed(2 * (1 - kr) * c);
+  matrix.cb_g = fixed(2 * kb * (1 - kb) / kg * c);
+  matrix.cr_g = fixed(2 * kr * (1 - kr) / kg * c);
+  matrix.cb_b = fixed(2 * (1 - kb) * c);
+  return true;
+}
+
+unsigned ycbcr_image(const ycbcr_planes& src, const ycbcr_matrix& matrix
+  , unsigned left, unsigned top, unsigned width, unsigned height
+  , BYTE* dst, ptrdiff_t dst_pitch, unsigned dst_bpp
+  , unsigned max_threads)
+{
+  const auto row = get_row(dst_bpp, src.shift_x);
+  if(! row || ! width || ! height)
+    return 1;
+
+  // Monochrome is Y with neutral chroma
+  std::vector<BYTE> neutral;
+  auto planes = src;
+  if(! planes.cb || ! planes.cr) {
+    neutral.assign(((left + width) >> planes.shift_x) + 1, 128);
+    planes.cb = planes.cr = neutral.data();
+    planes.cb_pitch = 0;
+    planes.shift_y = 0;
+  }
+
+  // As swizzle_image, a thread is worth it only for a decent amount of work
+  static const size_t min_bytes_per_band = 1 << 20;
+  const auto bytes = size_t(width) * height * (dst_bpp / 8);
+  const auto bands = unsigned(std::max<size_t>(1, std::min<size_t>({max_threads, height, bytes / min_bytes_per_band})));
+  const auto rows_per_band = (height + bands - 1) / bands;
+  const auto dst_bytespp = dst_bpp / 8;
+  const auto& m = matrix;
+
+  return parallel_for(bands, bands, [=, &planes, &m](unsigned band) {
+    const auto last = std::min(height, (band + 1) * rows_per_band);
+    for(auto r = band * rows_per_band; r < last; r++) {
+      const auto sy = top + r;
+      const auto chroma_offset = planes.cb_pitch * ptrdiff_t(sy >> planes.shift_y) + (left >> planes.shift_x);
+
+      const auto* y = planes.y + planes.y_pitch * ptrdiff_t(sy) + left;
+      const auto* cb = planes.cb + chroma_offset;
+      const auto* cr = planes.cr + chroma_offset;
+      const auto* alpha = planes.alpha ? planes.alpha + planes.alpha_pitch * ptrdiff_t(sy) + left : nullptr;
+      auto* d = dst + dst_pitch * ptrdiff_t(r);
+      auto w = width;
+
+      // A row, starting on the second pixel of a chroma pair, gets the first one on its own, the kernels start on a pair
+      if(planes.shift_x && (left & 1)) {
+        row(y, cb, cr, alpha, d, 1, m);
+        y++, cb++, cr++, d += dst_bytespp, w--;
+        if(alpha)
+          alpha++;
+      }
+      row(y, cb, cr, alpha, d, w, m);
+    }
+  });
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "FreeImage.h"
+
+/** @brief YCbCr to RGB conversion matrix, in fixed point (13 fractional bits), range offsets included. **/
+struct ycbcr_matrix
+{
+  int y_offset;     //< 16 for limited range, 0 for full
+  int y_scale;      //< 255 / 219 for limited range, 1 for full
+  int cr_r;         //< R = Y + cr_r * Cr
+  int cb_g;         //< G = Y - cb_g * Cb - cr_g * Cr
+  int cr_g;
+  int cb_b;         //< B = Y + cb_b * Cb
+};
+
+/** @brief Fills the matrix for the NCLX matrix_coefficients and full_range_flag.
+ *
+ * Returns false for the matrices, which are not Kr/Kb based (identity/GBR, YCgCo, ICtCp, ...) - those are left to libheif.
+ * Unspecified (2) is BT.601, as in libheif.
+**/
+bool get_ycbcr_matrix(unsigned matrix_coefficients, bool full_range, ycbcr_matrix& matrix);
+
+/** @brief Planes of an 8 bit YCbCr image, as decoded by libheif, without a color conversion.
+ *
+ * cb and cr are subsampled by 2 horizontally (shift_x 1, 4:2:2 and 4:2:0) and vertically (shift_y 1, 4:2:0).
+ * Null cb and cr is monochrome. alpha can be null.
+**/
+struct ycbcr_planes
+{
+  const BYTE* y;
+  const BYTE* cb;
+  const BYTE* cr;
+  const BYTE* alpha;
+  ptrdiff_t y_pitch;
+  ptrdiff_t cb_pitch; //< cr has the same
+  ptrdiff_t alpha_pitch;
+  unsigned shift_x;
+  unsigned shift_y;
+};
+
+/** @brief Converts the [left, left + width) x [top, top + height) part of the planes straight to the FreeImage layout (24 or 32 bpp, FI_RGBA_* order),
+ * in a single pass - chroma upsampling (nearest), the matrix and the channel order, instead of libheif's conversion to RGB plus a swizzle.
+ *
+ * Just as swizzle_image, dst points to the row where row top goes, dst_pitch can be negative (bottom-up DIB).
+ * Rows are split in bands between up to max_threads threads. Returns the threads, which took part.
+**/
+unsigned ycbcr_image(const ycbcr_planes& src, const ycbcr_matrix& matrix
+  , unsigned left, unsigned top, unsigned width, unsigned height
+  , BYTE* dst, ptrdiff_t dst_pitch, unsigned dst_bpp
+  , unsigned max_threads);